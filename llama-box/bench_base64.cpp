@@ -0,0 +1,86 @@
+// bench_base64 checks the SIMD base64 codec of z_utils.hpp against the scalar one,
+// round-tripping random inputs and decoding corrupted ones, then times both on a 5 MiB payload.
+// it returns non-zero if any result differs.
+
+#include <cstdio>
+
+#include "llama.cpp/common/common.h"
+
+#include "z_utils.hpp"
+
+std::vector<uint8_t> decode_base64_scalar(const std::string & encoded_string);
+std::string          encode_base64_scalar(const unsigned char * input, size_t length);
+
+static std::vector<uint8_t> random_bytes(std::mt19937 & rng, size_t n) {
+    std::vector<uint8_t> ret(n);
+    for (uint8_t & b : ret) {
+        b = uint8_t(rng());
+    }
+    return ret;
+}
+
+template <typename F>
+static double time_ms(int32_t n_repeat, F && f) {
+    const auto t_start = std::chrono::steady_clock::now();
+    for (int32_t i = 0; i < n_repeat; i++) {
+        f();
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count() / n_repeat;
+}
+
+int main() {
+    std::mt19937 rng(42);
+    size_t       n_failed = 0;
+
+    // round trip
+    for (size_t n = 0; n < 100000; n++) {
+        const std::vector<uint8_t> data    = random_bytes(rng, n < 1024 ? n : rng() % 4096);
+        const std::string          encoded = encode_base64(data.data(), data.size());
+        if (encoded != encode_base64_scalar(data.data(), data.size())) {
+            fprintf(stderr, "encode mismatched, size = %zu\n", data.size());
+            n_failed++;
+            continue;
+        }
+        if (decode_base64(encoded) != data || decode_base64_scalar(encoded) != data) {
+            fprintf(stderr, "round trip mismatched, size = %zu\n", data.size());
+            n_failed++;
+        }
+    }
+
+    // corrupted, both must stop at the same place
+    for (size_t n = 0; n < 100000; n++) {
+        const std::vector<uint8_t> data    = random_bytes(rng, rng() % 512);
+        std::string                encoded = encode_base64(data.data(), data.size());
+        if (!encoded.empty()) {
+            for (size_t k = rng() % 3; k > 0; k--) {
+                encoded[rng() % encoded.size()] = char(rng());
+            }
+            encoded.resize(encoded.size() - rng() % std::min<size_t>(encoded.size(), 4));
+        }
+        if (decode_base64(encoded) != decode_base64_scalar(encoded)) {
+            fprintf(stderr, "corrupted decode mismatched, size = %zu\n", encoded.size());
+            n_failed++;
+        }
+    }
+
+    // timing
+    const std::vector<uint8_t> payload = random_bytes(rng, 5 << 20);
+    const std::string          encoded = encode_base64(payload.data(), payload.size());
+    const double               mib     = double(payload.size()) / (1 << 20);
+    const int32_t              repeat  = 20;
+    const double t_enc  = time_ms(repeat, [&]() { return encode_base64(payload.data(), payload.size()); });
+    const double t_encs = time_ms(repeat, [&]() { return encode_base64_scalar(payload.data(), payload.size()); });
+    const double t_dec  = time_ms(repeat, [&]() { return decode_base64(encoded); });
+    const double t_decs = time_ms(repeat, [&]() { return decode_base64_scalar(encoded); });
+    printf("encode 5 MiB: simd = %.2fms (%.0f MiB/s), scalar = %.2fms (%.0f MiB/s)\n", t_enc, mib / t_enc * 1.e3,
+           t_encs, mib / t_encs * 1.e3);
+    printf("decode 5 MiB: simd = %.2fms (%.0f MiB/s), scalar = %.2fms (%.0f MiB/s)\n", t_dec, mib / t_dec * 1.e3,
+           t_decs, mib / t_decs * 1.e3);
+
+    if (n_failed > 0) {
+        fprintf(stderr, "%zu cases failed\n", n_failed);
+        return 1;
+    }
+    printf("all cases passed\n");
+    return 0;
+}
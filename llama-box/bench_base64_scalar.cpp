@@ -0,0 +1,16 @@
+// the scalar base64 codec of z_utils.hpp, built without SIMD as the reference of bench_base64.cpp,
+// the codec functions are static, so this translation unit keeps its own copies.
+
+#define BOX_NO_SIMD
+
+#include "llama.cpp/common/common.h"
+
+#include "z_utils.hpp"
+
+std::vector<uint8_t> decode_base64_scalar(const std::string & encoded_string) {
+    return decode_base64(encoded_string);
+}
+
+std::string encode_base64_scalar(const unsigned char * input, size_t length) {
+    return encode_base64(input, length);
+}
@@ -265,7 +265,9 @@ static void llama_box_params_print_usage(int, char ** argv, const llama_box_para
     opts.push_back({ "server",                             "       --host HOST",                            "IP address to listen, or bind to an UNIX socket if the address ends with .sock (default: %s)", llm_params.hostname.c_str() });
     opts.push_back({ "server",                             "       --port PORT",                            "Port to listen (default: %d)", llm_params.port });
     opts.push_back({ "server",                             "-to    --timeout N",                            "Server read/write timeout in seconds (default: %d)", llm_params.timeout_read });
-    opts.push_back({ "server",                             "       --threads-http N",                       "Number of threads used to process HTTP requests (default: %d, maximum: 64)", llm_params.n_threads_http });
+    opts.push_back({ "server",                             "       --threads-http N",                       "Number of threads used to process HTTP requests (default: %d, maximum: 1024)", llm_params.n_threads_http });
+    opts.push_back({ "server",                             "       --slots N",                              "Number of slots to decode concurrently, the requests beyond wait in the scheduler (default: %d, 0 = --threads-http, maximum: 64)", params_.hs_params.n_slots });
+    opts.push_back({ "server",                             "       --threads-sampling N",                   "Number of threads used to sample and postprocess the decoded tasks of a batch concurrently (default: %d, 0 = min(--slots, 4), 1 = disabled)", params_.hs_params.n_threads_sampling });
     opts.push_back({ "server",                             "       --conn-idle N",                          "Server connection idle in seconds (default: %d)", params_.hs_params.conn_idle });
     opts.push_back({ "server",                             "       --conn-keepalive N",                     "Server connection keep-alive in seconds (default: %d)", params_.hs_params.conn_keepalive });
     opts.push_back({ "server",                             "-m,    --model FILE",                           "Model path (default: %s)", DEFAULT_MODEL_PATH });
@@ -344,6 +346,7 @@ static void llama_box_params_print_usage(int, char ** argv, const llama_box_para
                                                                                                             "Increasing this value above the value of the physical batch size may improve prompt processing performance when using multiple GPUs with pipeline parallelism. (default: %d)", llm_params.n_batch });
     opts.push_back({ "server/completion",                  "-ub,   --ubatch-size N",                        "Physical batch size, which is the maximum number of tokens that may be processed at a time.\n"
                                                                                                             "Increasing this value may improve performance during prompt processing, at the expense of higher memory usage. (default: %d)", llm_params.n_ubatch });
+    opts.push_back({ "server/completion",                  "       --max-batched-tokens N",                 "Maximum number of tokens to process within one batch step, decoding tokens are placed before prefilling tokens, capped by --batch-size (default: %d, 0 = same as --batch-size)", params_.hs_params.max_batched_tokens });
     opts.push_back({ "server/completion",                  "       --keep N",                               "Number of tokens to keep from the initial prompt (default: %d)", llm_params.n_keep });
     opts.push_back({ "server/completion",                  "       --no-escape",                            "Disable process escape sequences" });
     opts.push_back({ "server/completion",                  "-e,    --escape",                               R"(Process escapes sequences (\n, \r, \t, \', \", \\) (default: %s))", llm_params.escape ? "true" : "false" });
@@ -385,6 +388,9 @@ static void llama_box_params_print_usage(int, char ** argv, const llama_box_para
     opts.push_back({ "server/completion",                  "       --yarn-beta-slow N",                     "YaRN high correction dim or alpha (default: %.1f)", (double)llm_params.yarn_beta_slow });
     opts.push_back({ "server/completion",                  "-nkvo, --no-kv-offload",                        "Disable KV offload" });
     opts.push_back({ "server/completion",                  "       --no-cache-prompt",                      "Disable caching prompt" });
+    opts.push_back({ "server/completion",                  "       --cache-ram N",                          "Maximum size in MiB of host memory to stash the evicted prompt caches, which are restored instead of re-processing (default: %d, 0 = disabled)", params_.hs_params.cache_ram });
+    opts.push_back({ "server/completion",                  "       --cache-disk N",                         "Maximum size in MiB of disk to spill the prompt caches evicted from --cache-ram (default: %d, 0 = disabled)", params_.hs_params.cache_disk });
+    opts.push_back({ "server/completion",                  "       --cache-disk-path PATH",                 "Path to spill the prompt caches evicted from --cache-ram (default: according to OS)" });
     opts.push_back({ "server/completion",                  "-cmoe, --cpu-moe",                              "Keep all Mixture of Experts (MoE) weights in the CPU" });
     opts.push_back({ "server/completion",                  "-ncmoe, --n-cpu-moe N",                         "Keep the Mixture of Experts (MoE) weights of the first N layers in the CPU" });
     opts.push_back({ "server/completion",                  "-cmoed, --cpu-moe-draft",                       "Keep all Mixture of Experts (MoE) weights in the CPU for draft model" });
@@ -394,7 +400,7 @@ static void llama_box_params_print_usage(int, char ** argv, const llama_box_para
     opts.push_back({ "server/completion",                  "-ctk,  --cache-type-k TYPE",                    "KV cache data type for K, allowed values: %s (default: %s)", get_all_cache_kv_types_string().c_str(), ggml_type_name(llm_params.cache_type_k) });
     opts.push_back({ "server/completion",                  "-ctv,  --cache-type-v TYPE",                    "KV cache data type for V, allowed values: %s (default: %s)", get_all_cache_kv_types_string().c_str(), ggml_type_name(llm_params.cache_type_v) });
     opts.push_back({ "server/completion",                  "-dt,   --defrag-thold N",                       "KV cache defragmentation threshold (default: %.1f, < 0 - disabled)", (double)llm_params.defrag_thold });
-    opts.push_back({ "server/completion",                  "-np,   --parallel N",                           "(Deprecated, use --threads-http instead) Number of parallel sequences to decode (default: %d)", llm_params.n_parallel });
+    opts.push_back({ "server/completion",                  "-np,   --parallel N",                           "(Deprecated, use --slots instead) Number of parallel sequences to decode (default: %d)", llm_params.n_parallel });
     opts.push_back({ "server/completion",                  "       --mmproj FILE",                          "Path to a multimodal projector file for LLaVA" });
     if (llama_supports_mlock()) {
         opts.push_back({ "server/completion",              "       --mlock",                                "Force system to keep model in RAM rather than swapping or compressing" });
@@ -423,18 +429,27 @@ static void llama_box_params_print_usage(int, char ** argv, const llama_box_para
     opts.push_back({ "server/completion/speculative",      "       --draft-max, --draft, --draft-n N",      "Number of tokens to draft for speculative decoding (default: %d)", llm_params.speculative.n_max });
     opts.push_back({ "server/completion/speculative",      "       --draft-min, --draft-n-min N",           "Minimum number of draft tokens to use for speculative decoding (default: %d)", llm_params.speculative.n_min });
     opts.push_back({ "server/completion/speculative",      "       --draft-p-min N",                        "Minimum speculative decoding probability (greedy) (default: %.1f)", llm_params.speculative.p_min });
+    opts.push_back({ "server/completion/speculative",      "       --draft-branches N",                     "Number of branches to draft from the top candidates of the draft model, verified as a token tree within one decode, requires --kv-unified (default: %d, 1 = single chain)", params_.hs_params.draft_branches });
     opts.push_back({ "server/completion/speculative",      "-md,   --model-draft FNAME",                    "Draft model for speculative decoding (default: unused)" });
     opts.push_back({ "server/completion/speculative",      "-devd, --device-draft <dev1,dev2,...>",         "A comma-separated list of devices to use for offloading the draft model (none = don't offload)\n"
                                                                                                             "Use --list-devices to see a list of available devices" });
     opts.push_back({ "server/completion/speculative",      "-ngld, --gpu-layers-draft, --n-gpu-layers-draft N",
                                                                                                             "Number of layers to store in VRAM for the draft model" });
     opts.push_back({ "server/completion/speculative",      "       --lookup-ngram-min N",                   "Minimum n-gram size for lookup cache (default: %d, 0 = disabled)", params_.hs_params.lookup_ngram_min });
+    opts.push_back({ "server/completion/speculative",      "-lcs,  --lookup-cache-static FNAME",            "Path to a static lookup cache, which is mapped at startup and never updated, requires --lookup-ngram-min (default: unused)" });
+    opts.push_back({ "server/completion/speculative",      "-lcd,  --lookup-cache-dynamic FNAME",           "Path to a dynamic lookup cache, which learns from every finished request and is saved periodically, requires --lookup-ngram-min (default: unused)" });
+    opts.push_back({ "server/completion/speculative",      "       --lookup-cache-ram N",                   "Maximum size in MiB of host memory to keep the dynamic lookup cache, the least frequent n-grams are pruned beyond, requires --lookup-ngram-min (default: %d, 0 = unlimited)", params_.hs_params.lookup_cache_ram });
     // server // completion // speculative //
     // server // completion // multimodal //
     opts.push_back({ "server/completion/multimodal" });
     opts.push_back({ "server/completion/multimodal",       "       --visual-max-image-size N",              "Maximum image size when completion with vision, resize the image size automatically if exceed, must be larger than 224 and be multiples of 14 (default: %d, 0 = disabled)", params_.hs_params.max_image_size});
     opts.push_back({ "server/completion/multimodal",       "       --visual-max-image-cache N",             "(Deprecated, use --max-projected-cache instead) Specify how many images to cache after encoding, which is used to speed up chat completion (default: %d, 0 = disabled)", params_.hs_params.max_projected_cache});
     opts.push_back({ "server/completion/multimodal",       "       --max-projected-cache N",                "Specify how many projected embedding cache (default: %d, 0 = disabled)", params_.hs_params.max_projected_cache});
+    opts.push_back({ "server/completion/multimodal",       "       --projected-cache-ram N",                "Maximum size in MiB of host memory to cache the projected embedding, the least recently used ones are evicted beyond, requires --max-projected-cache (default: %d, 0 = unlimited)", params_.hs_params.projected_cache_ram});
+    opts.push_back({ "server/completion/multimodal",       "       --projected-cache-dir PATH",             "Path to persist the projected embedding by content hash, which survives restarts and is valid only for the same --mmproj, the directory has no size budget and is never pruned by the server (default: unused)" });
+    opts.push_back({ "server/completion/multimodal",       "       --threads-mmproj N",                     "Number of threads used to encode the multimodal projections, the encoder runs on a dedicated worker apart from the HTTP threads (default: %d, 0 = --threads)", params_.hs_params.n_threads_mmproj});
+    opts.push_back({ "server/completion/multimodal",       "       --cpu-mask-mmproj M",                    "Set CPU affinity mask of the multimodal encoder: arbitrarily long hex, the threads spawned by the encoding inherit it. Complements --cpu-range-mmproj (default: unset, Linux only)"});
+    opts.push_back({ "server/completion/multimodal",       "       --cpu-range-mmproj lo-hi",               "Range of CPUs for affinity of the multimodal encoder. Complements --cpu-mask-mmproj"});
     // server // completion // multimodal //
     // server // embedding //
     opts.push_back({ "server/embedding" });
@@ -689,6 +704,30 @@ static bool llama_box_params_parse(int argc, char ** argv, llama_box_params & pa
                 continue;
             }
 
+            if (!strcmp(flag, "--slots")) {  // extend
+                if (i == argc) {
+                    missing("--slots");
+                }
+                char * arg                = argv[i++];
+                params_.hs_params.n_slots = std::stoi(std::string(arg));
+                if (params_.hs_params.n_slots < 0 || params_.hs_params.n_slots > 64) {
+                    invalid("--slots, must be in range [0, 64]");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--threads-sampling")) {  // extend
+                if (i == argc) {
+                    missing("--threads-sampling");
+                }
+                char * arg                           = argv[i++];
+                params_.hs_params.n_threads_sampling = std::stoi(std::string(arg));
+                if (params_.hs_params.n_threads_sampling < 0) {
+                    invalid("--threads-sampling, must be greater than or equal to 0");
+                }
+                continue;
+            }
+
             if (!strcmp(flag, "--conn-idle")) {  // extend
                 if (i == argc) {
                     missing("--conn-idle");
@@ -1191,6 +1230,18 @@ static bool llama_box_params_parse(int argc, char ** argv, llama_box_params & pa
                 continue;
             }
 
+            if (!strcmp(flag, "--max-batched-tokens")) {
+                if (i == argc) {
+                    missing("--max-batched-tokens");
+                }
+                char * arg                           = argv[i++];
+                params_.hs_params.max_batched_tokens = std::stoi(std::string(arg));
+                if (params_.hs_params.max_batched_tokens < 0) {
+                    invalid("--max-batched-tokens");
+                }
+                continue;
+            }
+
             if (!strcmp(flag, "--keep")) {
                 if (i == argc) {
                     missing("--keep");
@@ -1594,6 +1645,46 @@ static bool llama_box_params_parse(int argc, char ** argv, llama_box_params & pa
                 continue;
             }
 
+            if (!strcmp(flag, "--cache-ram")) {
+                if (i == argc) {
+                    missing("--cache-ram");
+                }
+                char * arg                  = argv[i++];
+                params_.hs_params.cache_ram = std::stoi(std::string(arg));
+                if (params_.hs_params.cache_ram < 0) {
+                    invalid("--cache-ram");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--cache-disk")) {
+                if (i == argc) {
+                    missing("--cache-disk");
+                }
+                char * arg                   = argv[i++];
+                params_.hs_params.cache_disk = std::stoi(std::string(arg));
+                if (params_.hs_params.cache_disk < 0) {
+                    invalid("--cache-disk");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--cache-disk-path")) {
+                if (i == argc) {
+                    missing("--cache-disk-path");
+                }
+                char * arg = argv[i++];
+                if (arg[0] == '\0') {
+                    invalid("--cache-disk-path");
+                }
+                std::string p(arg);
+                if (p[p.size() - 1] != DIRECTORY_SEPARATOR) {
+                    p += DIRECTORY_SEPARATOR;
+                }
+                params_.hs_params.cache_disk_path = p;
+                continue;
+            }
+
             if (!strcmp(flag, "-cmoe") || !strcmp(flag, "--cpu-moe")) {
                 params_.hs_params.llm_params.tensor_buft_overrides.push_back(
                     { "\\.ffn_(up|down|gate)_exps", ggml_backend_cpu_buffer_type() });
@@ -1692,9 +1783,9 @@ static bool llama_box_params_parse(int argc, char ** argv, llama_box_params & pa
                 if (i == argc) {
                     missing("--parallel");
                 }
-                char * arg                                  = argv[i++];
-                params_.hs_params.llm_params.n_threads_http = std::stoi(std::string(arg));
-                if (params_.hs_params.llm_params.n_threads_http <= 0) {
+                char * arg                = argv[i++];
+                params_.hs_params.n_slots = std::stoi(std::string(arg));
+                if (params_.hs_params.n_slots <= 0 || params_.hs_params.n_slots > 64) {
                     invalid("--parallel");
                 }
                 continue;
@@ -1844,6 +1935,18 @@ static bool llama_box_params_parse(int argc, char ** argv, llama_box_params & pa
                 continue;
             }
 
+            if (!strcmp(flag, "--draft-branches")) {
+                if (i == argc) {
+                    missing("--draft-branches");
+                }
+                char * arg                       = argv[i++];
+                params_.hs_params.draft_branches = std::stoi(std::string(arg));
+                if (params_.hs_params.draft_branches < 1 || params_.hs_params.draft_branches > 8) {
+                    invalid("--draft-branches, must be in range [1, 8]");
+                }
+                continue;
+            }
+
             if (!strcmp(flag, "-md") || !strcmp(flag, "--model-draft")) {
                 if (i == argc) {
                     missing("--model-draft");
@@ -1887,6 +1990,42 @@ static bool llama_box_params_parse(int argc, char ** argv, llama_box_params & pa
                 continue;
             }
 
+            if (!strcmp(flag, "-lcs") || !strcmp(flag, "--lookup-cache-static")) {
+                if (i == argc) {
+                    missing("--lookup-cache-static");
+                }
+                char * arg = argv[i++];
+                if (arg[0] == '\0') {
+                    invalid("--lookup-cache-static");
+                }
+                params_.hs_params.lookup_cache_static = std::string(arg);
+                continue;
+            }
+
+            if (!strcmp(flag, "-lcd") || !strcmp(flag, "--lookup-cache-dynamic")) {
+                if (i == argc) {
+                    missing("--lookup-cache-dynamic");
+                }
+                char * arg = argv[i++];
+                if (arg[0] == '\0') {
+                    invalid("--lookup-cache-dynamic");
+                }
+                params_.hs_params.lookup_cache_dynamic = std::string(arg);
+                continue;
+            }
+
+            if (!strcmp(flag, "--lookup-cache-ram")) {
+                if (i == argc) {
+                    missing("--lookup-cache-ram");
+                }
+                char * arg                         = argv[i++];
+                params_.hs_params.lookup_cache_ram = std::stoi(std::string(arg));
+                if (params_.hs_params.lookup_cache_ram < 0) {
+                    invalid("--lookup-cache-ram");
+                }
+                continue;
+            }
+
             // server // completion // multimodal //
 
             if (!strcmp(flag, "--visual-max-image-size")) {
@@ -1922,6 +2061,70 @@ static bool llama_box_params_parse(int argc, char ** argv, llama_box_params & pa
                 continue;
             }
 
+            if (!strcmp(flag, "--projected-cache-ram")) {
+                if (i == argc) {
+                    missing("--projected-cache-ram");
+                }
+                char * arg                            = argv[i++];
+                params_.hs_params.projected_cache_ram = std::stoi(std::string(arg));
+                if (params_.hs_params.projected_cache_ram < 0) {
+                    invalid("--projected-cache-ram");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--projected-cache-dir")) {
+                if (i == argc) {
+                    missing("--projected-cache-dir");
+                }
+                char * arg = argv[i++];
+                if (arg[0] == '\0') {
+                    invalid("--projected-cache-dir");
+                }
+                std::string p(arg);
+                if (p[p.size() - 1] != DIRECTORY_SEPARATOR) {
+                    p += DIRECTORY_SEPARATOR;
+                }
+                params_.hs_params.projected_cache_dir = p;
+                continue;
+            }
+
+            if (!strcmp(flag, "--threads-mmproj")) {
+                if (i == argc) {
+                    missing("--threads-mmproj");
+                }
+                char * arg                         = argv[i++];
+                params_.hs_params.n_threads_mmproj = std::stoi(std::string(arg));
+                if (params_.hs_params.n_threads_mmproj < 0) {
+                    invalid("--threads-mmproj, must be greater than or equal to 0");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--cpu-mask-mmproj")) {
+                if (i == argc) {
+                    missing("--cpu-mask-mmproj");
+                }
+                char * arg                                    = argv[i++];
+                params_.hs_params.cpuparams_mmproj.mask_valid = true;
+                if (!parse_cpu_mask(arg, params_.hs_params.cpuparams_mmproj.cpumask)) {
+                    invalid("--cpu-mask-mmproj");
+                }
+                continue;
+            }
+
+            if (!strcmp(flag, "--cpu-range-mmproj")) {
+                if (i == argc) {
+                    missing("--cpu-range-mmproj");
+                }
+                char * arg                                    = argv[i++];
+                params_.hs_params.cpuparams_mmproj.mask_valid = true;
+                if (!parse_cpu_range(arg, params_.hs_params.cpuparams_mmproj.cpumask)) {
+                    invalid("--cpu-range-mmproj");
+                }
+                continue;
+            }
+
             // server // embedding //
 
             if (!strcmp(flag, "--pooling")) {
@@ -2349,8 +2552,23 @@ static bool llama_box_params_parse(int argc, char ** argv, llama_box_params & pa
     if (params_.hs_params.llm_params.n_threads_http <= 0) {
         params_.hs_params.llm_params.n_threads_http = params_.hs_params.llm_params.cpuparams.n_threads;
     }
-    if (params_.hs_params.llm_params.n_threads_http > 64) {
-        params_.hs_params.llm_params.n_threads_http = 64;
+    if (params_.hs_params.llm_params.n_threads_http > 1024) {
+        params_.hs_params.llm_params.n_threads_http = 1024;
+    }
+    if (params_.hs_params.n_slots <= 0) {
+        params_.hs_params.n_slots = std::min(params_.hs_params.llm_params.n_threads_http, 64);
+    }
+    if (params_.hs_params.llm_params.n_threads_http < params_.hs_params.n_slots) {
+        params_.hs_params.llm_params.n_threads_http = params_.hs_params.n_slots;
+    }
+    if (params_.hs_params.n_threads_sampling <= 0) {
+        params_.hs_params.n_threads_sampling = std::min(params_.hs_params.n_slots, 4);
+    }
+    if (params_.hs_params.n_threads_sampling > params_.hs_params.n_slots) {
+        params_.hs_params.n_threads_sampling = params_.hs_params.n_slots;
+    }
+    if (params_.hs_params.n_threads_mmproj <= 0) {
+        params_.hs_params.n_threads_mmproj = params_.hs_params.llm_params.cpuparams.n_threads;
     }
 
     if (!params_.hs_params.llm_params.kv_overrides.empty()) {
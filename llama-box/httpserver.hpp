@@ -2,6 +2,13 @@
 
 #include <atomic>
 #include <csignal>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iterator>
+#include <list>
+#include <map>
 #include <memory>
 #include <unordered_map>
 #include <utility>
@@ -44,14 +51,28 @@ struct httpserver_params {
     common_params          llm_params;
     stablediffusion_params sd_params;
 
-    bool    cache_prompt        = true;
-    bool    endpoint_images     = false;
-    int32_t conn_idle           = 60;  // connection idle in seconds
-    int32_t conn_keepalive      = 15;  // connection keep-alive in seconds
-    int32_t n_tps               = 0;   // maximum number of tokens per seconds
-    int32_t lookup_ngram_min    = 0;   // minimum n-gram size for lookup cache
-    int32_t max_image_size      = 0;   // maximum image size for vision image processing
-    int32_t max_projected_cache = 0;   // maximum number of projected embedding in cache
+    bool        cache_prompt         = true;
+    bool        endpoint_images      = false;
+    int32_t     conn_idle            = 60;  // connection idle in seconds
+    int32_t     conn_keepalive       = 15;  // connection keep-alive in seconds
+    int32_t     n_tps                = 0;   // maximum number of tokens per seconds
+    int32_t     n_slots              = 0;   // number of slots to decode concurrently, independent of the HTTP threads
+    int32_t     n_threads_sampling   = 0;   // number of threads to sample the decoded tasks of a batch concurrently
+    int32_t     n_threads_mmproj     = 0;   // number of threads to encode the multimodal projections
+    cpu_params  cpuparams_mmproj;           // cpu affinity of the multimodal encoder, the mask is applied if valid
+    int32_t     lookup_ngram_min     = 0;   // minimum n-gram size for lookup cache
+    int32_t     draft_branches       = 1;   // number of branches to draft for tree speculative decoding
+    std::string lookup_cache_static  = "";  // path to the static lookup cache, read only
+    std::string lookup_cache_dynamic = "";  // path to the dynamic lookup cache, learns from the finished requests
+    int32_t     lookup_cache_ram     = 64;  // maximum size in MiB of host memory to keep the dynamic lookup cache
+    int32_t     max_image_size       = 0;   // maximum image size for vision image processing
+    int32_t     max_projected_cache  = 0;   // maximum number of projected embedding in cache
+    int32_t     projected_cache_ram  = 0;   // maximum size in MiB of host memory to cache the projected embedding
+    std::string projected_cache_dir  = "";  // path to persist the projected embedding, survives restarts
+    int32_t     max_batched_tokens   = 0;   // maximum number of tokens to process within one batch step
+    int32_t     cache_ram            = 0;   // maximum size in MiB of host memory to stash the evicted prompt caches
+    int32_t     cache_disk           = 0;   // maximum size in MiB of disk to spill the stashed prompt caches
+    std::string cache_disk_path      = "";  // path to spill the stashed prompt caches
 };
 
 // implementations
@@ -103,11 +124,8 @@ static inline int32_t send_string(const httplib::Request & request, httplib::Res
     return response.status;
 }
 
-// send_event_json, close if given status is not 100.
-static inline int32_t send_event_json(httplib::DataSink & sink, httplib::StatusCode status, json & data) {
-    if (!sink.is_writable()) {
-        return httplib::RequestTimeout_408;
-    }
+// format_event_json, appends the event of the given data to the given buffer.
+static inline void format_event_json(std::string & buffer, httplib::StatusCode status, json & data) {
     std::string event;
     std::string message;
     if (status >= httplib::BadRequest_400) {
@@ -121,15 +139,26 @@ static inline int32_t send_event_json(httplib::DataSink & sink, httplib::StatusC
         event   = "data";
         message = data.dump(-1, ' ', false, json::error_handler_t::replace);
     }
-    const std::string str = event + ": " + message + "\n\n";
-    sink.write(str.c_str(), str.size());
+    buffer.append(event).append(": ").append(message).append("\n\n");
+}
+
+// send_event_json, finish the stream if given status is not 100.
+static inline int32_t send_event_json(httplib::DataSink & sink, httplib::StatusCode status, json & data) {
+    if (!sink.is_writable()) {
+        return httplib::RequestTimeout_408;
+    }
+    std::string str;
+    format_event_json(str, status, data);
+    if (!sink.write(str.c_str(), str.size())) {
+        return httplib::RequestTimeout_408;
+    }
     if (status != httplib::Continue_100) {
         sink.done();
     }
     return httplib::OK_200;
 }
 
-// send_event_string, close if given status is not 100.
+// send_event_string, finish the stream if given status is not 100.
 static inline int32_t send_event_string(httplib::DataSink & sink, httplib::StatusCode status,
                                         const std::string & message) {
     if (!sink.is_writable()) {
@@ -436,11 +465,10 @@ static inline bool equal_lora(const std::vector<common_adapter_lora_info> & l1,
     return true;
 }
 
-// get_token_probabilities, returns token probabilities.
-static inline std::vector<llama_token_data> get_token_probabilities(llama_context * ctx, int32_t idx) {
+// get_token_probabilities, returns token probabilities of the given logits row.
+static inline std::vector<llama_token_data> get_token_probabilities(const llama_vocab * vocab, const float * logits) {
     std::vector<llama_token_data> cur;
-    const auto *                  logits  = llama_get_logits_ith(ctx, idx);
-    const int32_t                 n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+    const int32_t                 n_vocab = llama_vocab_n_tokens(vocab);
 
     cur.resize(n_vocab);
     for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
@@ -492,6 +520,7 @@ enum req_type {
     REQ_RERANK,
     REQ_IMAGE_GENERATE,
     REQ_IMAGE_EDIT,
+    REQ_SLOTS,
     REQ_UNKNOWN,
 };
 
@@ -621,6 +650,7 @@ struct complete_req : breq {
     int32_t                  max_tokens = 0;
     int32_t                  logprobs   = -1;
     std::vector<std::string> stop;
+    llama_tokens             prediction;  // tokenized predicted outputs, drafted for speculative decoding
 
     // stream
     bool stream         = false;
@@ -656,6 +686,37 @@ struct legacy_complete_req : complete_req {
     // std::string user;
 };
 
+// get_prediction_tokens tokenizes the predicted outputs,
+// {"type": "content", "content": "..." | [{"type": "text", "text": "..."}]},
+// null or empty means no prediction.
+static inline llama_tokens get_prediction_tokens(const llama_context * llm_ctx, const json & prediction) {
+    if (prediction.empty()) {
+        return {};
+    }
+    if (!prediction.is_object() || json_value(prediction, "type", std::string()) != "content") {
+        throw std::invalid_argument(R"(Illegal param: "prediction" must be an object with "type": "content")");
+    }
+    if (!prediction.contains("content")) {
+        throw std::invalid_argument(R"(Illegal param: "prediction" must contain "content")");
+    }
+    const json & content = prediction.at("content");
+    std::string  text;
+    if (content.is_string()) {
+        text = content.get<std::string>();
+    } else if (content.is_array()) {
+        for (const json & part : content) {
+            if (!part.is_object() || json_value(part, "type", std::string()) != "text" || !part.contains("text")) {
+                throw std::invalid_argument(R"(Illegal param: "prediction.content" must be a list of text parts)");
+            }
+            text += part.at("text").get<std::string>();
+        }
+    } else {
+        throw std::invalid_argument(R"(Illegal param: "prediction.content" must be a string or a list of text parts)");
+    }
+    const llama_vocab * vocab = llama_model_get_vocab(llama_get_model(llm_ctx));
+    return common_tokenize(vocab, text, false, false);
+}
+
 static inline std::unique_ptr<legacy_complete_req> get_legacy_complete_req(const httplib::Request &  request,
                                                                            httplib::Response &       response,
                                                                            const httpserver_params & hparams,
@@ -758,6 +819,10 @@ static inline std::unique_ptr<legacy_complete_req> get_legacy_complete_req(const
             "Illegal param: \"max_tokens\" must be less than or equal to the model's context length");
     }
 
+    if (req.contains("prediction") && !req.at("prediction").is_null()) {
+        ptr->prediction = get_prediction_tokens(llm_ctx, req.at("prediction"));
+    }
+
     ptr->presence_penalty = json_value(req, "presence_penalty", params.sampling.penalty_present);
 
     ptr->seed = normalize_seed(json_value(req, "seed", params.sampling.seed));
@@ -873,6 +938,299 @@ static inline std::unique_ptr<clip_multimedia> get_clip_audio(std::vector<uint8_
     return std::make_unique<clip_multimedia>(std::move(ptr), std::move(hash), true);
 }
 
+// remote_fetcher, fetches the remote resources through the kept-alive connections per host,
+// and caches the responses by URL within a size budget, revalidating them with ETag or Last-Modified,
+// the asynchronous fetches run on a bounded worker pool shared by all requests, a few workers per host at most.
+struct remote_fetcher {
+    // cancellation, cancels the queued fetches on destruction.
+    struct cancellation {
+        std::shared_ptr<std::atomic<bool>> cancelled = std::make_shared<std::atomic<bool>>(false);
+
+        ~cancellation() { cancelled->store(true); }
+    };
+
+    ~remote_fetcher() {
+        if (workers != nullptr) {
+            workers->shutdown();
+        }
+    }
+
+    // fetch_async, fetches the given URL on the workers and converts the body by the given function,
+    // the queued fetch is skipped if cancelled before starting,
+    // the returned future does not block on destruction.
+    template <typename T>
+    std::future<T> fetch_async(const std::string & url, std::shared_ptr<std::atomic<bool>> cancelled,
+                               std::function<T(std::shared_ptr<const std::vector<uint8_t>>)> convert) {
+        std::string host, path;
+        split(url, host, path);
+
+        std::call_once(workers_once, [&]() { workers = std::make_unique<httplib::ThreadPool>(max_workers); });
+
+        auto job = std::make_shared<std::packaged_task<T()>>([this, url, cancelled, convert]() -> T {
+            if (cancelled->load()) {
+                throw std::runtime_error("cancelled");
+            }
+            return convert(fetch(url));
+        });
+        std::future<T> ret = job->get_future();
+        schedule(host, [job]() { (*job)(); });
+        return ret;
+    }
+
+    // fetch, returns the body of the given URL, throws if failed.
+    std::shared_ptr<const std::vector<uint8_t>> fetch(const std::string & url) {
+        std::string host, path;
+        split(url, host, path);
+
+        // revalidate the cached response if any
+        httplib::Headers headers;
+        cache_entry      cached;
+        {
+            std::lock_guard<std::mutex> lock(cache_mtx);
+            if (auto hit = cache_index.find(url); hit != cache_index.end()) {
+                cached = *hit->second;
+                if (!cached.etag.empty()) {
+                    headers.emplace("If-None-Match", cached.etag);
+                }
+                if (!cached.last_modified.empty()) {
+                    headers.emplace("If-Modified-Since", cached.last_modified);
+                }
+            }
+        }
+
+        // receive the body by ourselves, so that the oversized one can be aborted early
+        std::unique_ptr<httplib::Client> cli = acquire(host);
+        std::vector<uint8_t>             received;
+        bool                             oversized = false;
+        httplib::Result                  resp      = cli->Get(
+            path, headers,
+            [&](const httplib::Response & r) {
+                if (r.status == httplib::StatusCode::OK_200 && r.has_header("Content-Length")) {
+                    const std::string length = r.get_header_value("Content-Length");
+                    oversized                = std::strtoull(length.c_str(), nullptr, 10) > max_body_size;
+                }
+                return !oversized;
+            },
+            [&](const char * data, size_t data_length) {
+                if (received.size() + data_length > max_body_size) {
+                    oversized = true;
+                    return false;
+                }
+                received.insert(received.end(), data, data + data_length);
+                return true;
+            });
+        if (resp) {
+            release(host, std::move(cli));
+        }
+        if (oversized) {
+            throw std::invalid_argument(R"(Illegal param: invalid "url", the image from URL exceeds )" +
+                                        std::to_string(max_body_size >> 20) + " MiB: " + url);
+        }
+        if (resp && resp->status == httplib::StatusCode::NotModified_304 && cached.body != nullptr) {
+            touch(url);
+            return cached.body;
+        }
+        if (!resp || resp->status != httplib::StatusCode::OK_200) {
+            throw std::invalid_argument(R"(Illegal param: invalid "url", failed to fetch image from URL: )" + url +
+                                        ", status: " + std::to_string(resp ? resp->status : -1) +
+                                        ", reason: " + (resp ? resp->reason : "unknown"));
+        }
+
+        auto body = std::make_shared<const std::vector<uint8_t>>(std::move(received));
+        if (resp->has_header("ETag") || resp->has_header("Last-Modified")) {
+            put({ url, resp->get_header_value("ETag"), resp->get_header_value("Last-Modified"), body });
+        }
+        return body;
+    }
+
+  private:
+    static constexpr size_t max_workers               = 8;
+    static constexpr size_t max_workers_per_host      = 2;  // a slow host can not hold all the workers
+    static constexpr size_t max_idle_hosts            = 64;
+    static constexpr size_t max_idle_clients_per_host = 8;
+    static constexpr int    max_idle_seconds          = 60;
+    static constexpr size_t max_body_size             = 32 << 20;   // 32 MiB
+    static constexpr size_t max_cache_size            = 128 << 20;  // 128 MiB
+
+    struct host_fetches {
+        size_t                            n_fetching = 0;
+        std::deque<std::function<void()>> pending;  // waiting for a worker of the host
+    };
+
+    struct idle_clients {
+        std::vector<std::unique_ptr<httplib::Client>> clients;
+        std::chrono::steady_clock::time_point         last_used;
+    };
+
+    struct cache_entry {
+        std::string                                 url;
+        std::string                                 etag;
+        std::string                                 last_modified;
+        std::shared_ptr<const std::vector<uint8_t>> body;
+    };
+
+    std::once_flag                       workers_once;
+    std::unique_ptr<httplib::ThreadPool> workers;
+
+    std::mutex                                    hosts_mtx;
+    std::unordered_map<std::string, host_fetches> hosts;  // fetching per host
+
+    std::mutex                                    clients_mtx;
+    std::unordered_map<std::string, idle_clients> clients;  // idle clients per host
+
+    std::mutex                                                        cache_mtx;
+    std::list<cache_entry>                                            cache;  // most recently used first
+    std::unordered_map<std::string, std::list<cache_entry>::iterator> cache_index;
+    size_t                                                            cache_size = 0;
+
+    // split, splits the given URL into the host and the path, throws if failed.
+    static void split(const std::string & url, std::string & host, std::string & path) {
+        size_t pos = url.find("://");
+        if (pos == std::string::npos) {
+            throw std::invalid_argument("Illegal param: \"url\" must be a data URI or a valid URL");
+        }
+        pos = url.find('/', pos + 3);
+        if (pos == std::string::npos) {
+            host = url;
+            path = "/";
+        } else {
+            host = url.substr(0, pos);
+            path = url.substr(pos);
+        }
+    }
+
+    // schedule, runs the given job on the workers,
+    // or parks it until a fetching of the same host finishes if the host has taken enough workers.
+    void schedule(const std::string & host, std::function<void()> && job) {
+        {
+            std::lock_guard<std::mutex> lock(hosts_mtx);
+            host_fetches &              fetches = hosts[host];
+            if (fetches.n_fetching >= max_workers_per_host) {
+                fetches.pending.push_back(std::move(job));
+                return;
+            }
+            fetches.n_fetching++;
+        }
+        workers->enqueue([this, host, job = std::move(job)]() {
+            job();
+            finish(host);
+        });
+    }
+
+    // finish, hands the worker over to the next parked job of the host if any.
+    void finish(const std::string & host) {
+        std::function<void()> next;
+        {
+            std::lock_guard<std::mutex> lock(hosts_mtx);
+            auto                        it = hosts.find(host);
+            if (!it->second.pending.empty()) {
+                next = std::move(it->second.pending.front());
+                it->second.pending.pop_front();
+            } else if (--it->second.n_fetching == 0) {
+                hosts.erase(it);
+            }
+        }
+        if (next) {
+            workers->enqueue([this, host, next = std::move(next)]() {
+                next();
+                finish(host);
+            });
+        }
+    }
+
+    std::unique_ptr<httplib::Client> acquire(const std::string & host) {
+        {
+            std::lock_guard<std::mutex> lock(clients_mtx);
+            if (auto it = clients.find(host); it != clients.end() && !it->second.clients.empty()) {
+                std::unique_ptr<httplib::Client> cli = std::move(it->second.clients.back());
+                it->second.clients.pop_back();
+                return cli;
+            }
+        }
+
+        auto cli = std::make_unique<httplib::Client>(host);
+        cli->set_connection_timeout(15, 0);                  // 15 seconds
+        cli->set_read_timeout(30, 0);                        // 30 seconds
+        cli->set_keep_alive(true);                           // reuse connection across requests
+        cli->set_follow_location(true);                      // follow redirects
+        cli->set_default_headers({
+            { "User-Agent", "llama-box" }
+        });               // set user-agent
+        cli->set_url_encode(true);                           // encode URL
+        cli->set_tcp_nodelay(true);                          // disable Nagle's algorithm
+#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
+        cli->enable_server_certificate_verification(false);  // disable SSL verification
+#endif
+        return cli;
+    }
+
+    // release, keeps the client for reusing,
+    // and drops the hosts idled too long or the least recently used hosts beyond the limit.
+    void release(const std::string & host, std::unique_ptr<httplib::Client> && cli) {
+        const auto                                    now = std::chrono::steady_clock::now();
+        std::vector<std::unique_ptr<httplib::Client>> dropped;  // close the connections outside the lock
+        {
+            std::lock_guard<std::mutex> lock(clients_mtx);
+            idle_clients &              idle = clients[host];
+            idle.last_used                   = now;
+            if (idle.clients.size() < max_idle_clients_per_host) {
+                idle.clients.push_back(std::move(cli));
+            } else {
+                dropped.push_back(std::move(cli));
+            }
+            while (true) {
+                auto oldest = clients.end();
+                for (auto it = clients.begin(); it != clients.end(); ++it) {
+                    if (oldest == clients.end() || it->second.last_used < oldest->second.last_used) {
+                        oldest = it;
+                    }
+                }
+                if (oldest == clients.end()) {
+                    break;
+                }
+                const bool exceeded = clients.size() > max_idle_hosts;
+                const bool expired  = now - oldest->second.last_used >= std::chrono::seconds(max_idle_seconds);
+                if (!exceeded && !expired) {
+                    break;
+                }
+                std::move(oldest->second.clients.begin(), oldest->second.clients.end(), std::back_inserter(dropped));
+                clients.erase(oldest);
+            }
+        }
+    }
+
+    void touch(const std::string & url) {
+        std::lock_guard<std::mutex> lock(cache_mtx);
+        if (auto hit = cache_index.find(url); hit != cache_index.end()) {
+            cache.splice(cache.begin(), cache, hit->second);
+        }
+    }
+
+    void put(cache_entry && entry) {
+        const size_t size = entry.body->size();
+        if (size > max_cache_size) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(cache_mtx);
+        if (auto hit = cache_index.find(entry.url); hit != cache_index.end()) {
+            cache_size -= hit->second->body->size();
+            cache.erase(hit->second);
+            cache_index.erase(hit);
+        }
+        while (!cache.empty() && cache_size + size > max_cache_size) {
+            cache_size -= cache.back().body->size();
+            cache_index.erase(cache.back().url);
+            cache.pop_back();
+        }
+        cache.push_front(std::move(entry));
+        cache_index[cache.front().url] = cache.begin();
+        cache_size += size;
+    }
+};
+
+static remote_fetcher remote_images;
+
 struct chat_complete_req : complete_req {
     explicit chat_complete_req(const std::string & id) : complete_req(id, REQ_CHAT_COMPLETE) {}
 
@@ -896,7 +1254,7 @@ struct chat_complete_req : complete_req {
     // int32_t max_tokens = -1;                                         // inherit // migrate "max_completion_tokens"
     // int32_t n = 1;                                                   // inherit
     // std::vector<std::string> modalities;
-    // json prediction;
+    // llama_tokens prediction;                                         // inherit
     // json audio;
     float                         presence_penalty = 0.0f;
     json                          response_format;
@@ -968,6 +1326,13 @@ static inline std::unique_ptr<chat_complete_req> get_chat_complete_req(
     ptr->model = json_value(req, "model", params.model_alias);
 
     {
+        // at most max_fetching_images are in flight per request,
+        // the queued fetches are cancelled once leaving this scope, e.g. failed to parse the rest.
+        constexpr size_t max_fetching_images = 4;
+        std::vector<std::pair<size_t, std::future<std::unique_ptr<clip_multimedia>>>> fetching_images;
+        size_t                                                                        n_fetched_images = 0;
+        remote_fetcher::cancellation                                                  fetching_cancellation;
+
         json messages = req.at("messages");
         for (const json & msg : messages) {
             std::string role = json_value(msg, "role", std::string());
@@ -1025,42 +1390,19 @@ static inline std::unique_ptr<chat_complete_req> get_chat_complete_req(
                                         "Illegal param: \"url\" must be a valid base64-encoded image");
                                 }
                             } else {
-                                std::string host, path;
-                                if (size_t pos = url.find("://"); pos == std::string::npos) {
-                                    throw std::invalid_argument(
-                                        "Illegal param: \"url\" must be a data URI or a valid URL");
-                                } else {
-                                    pos = url.find('/', pos + 3);
-                                    if (pos == std::string::npos) {
-                                        host = url;
-                                        path = "/";
-                                    } else {
-                                        host = url.substr(0, pos);
-                                        path = url.substr(pos);
-                                    }
-                                }
-                                httplib::Client cli(host);
-                                cli.set_connection_timeout(15, 0);                  // 15 seconds
-                                cli.set_read_timeout(300, 0);                       // 5 minutes
-                                cli.set_keep_alive(false);                          // close connection after request
-                                cli.set_follow_location(true);                      // follow redirects
-                                cli.set_default_headers({
-                                    { "User-Agent", "llama-box" }
-                                });               // set user-agent
-                                cli.set_url_encode(true);                           // encode URL
-                                cli.set_tcp_nodelay(true);                          // disable Nagle's algorithm
-#ifdef CPPHTTPLIB_OPENSSL_SUPPORT
-                                cli.enable_server_certificate_verification(false);  // disable SSL verification
-#endif
-                                httplib::Result resp = cli.Get(path);
-                                if (!resp || resp->status != httplib::StatusCode::OK_200) {
-                                    throw std::invalid_argument(
-                                        R"(Illegal param: invalid "url", failed to fetch image from URL: )" + url +
-                                        ", status: " + std::to_string(resp ? resp->status : -1) +
-                                        ", reason: " + (resp ? resp->reason : "unknown"));
+                                // fetch and decode concurrently, fill in the placeholder after parsing all messages
+                                while (fetching_images.size() - n_fetched_images >= max_fetching_images) {
+                                    fetching_images[n_fetched_images].second.wait();
+                                    n_fetched_images++;
                                 }
-                                std::vector<uint8_t> img_buff(resp->body.begin(), resp->body.end());
-                                ptr->multimedias.push_back(get_clip_image(std::move(img_buff)));
+                                fetching_images.emplace_back(
+                                    ptr->multimedias.size(),
+                                    remote_images.fetch_async<std::unique_ptr<clip_multimedia>>(
+                                        url, fetching_cancellation.cancelled,
+                                        [](std::shared_ptr<const std::vector<uint8_t>> body) {
+                                            return get_clip_image(std::vector<uint8_t>(body->begin(), body->end()));
+                                        }));
+                                ptr->multimedias.emplace_back(nullptr);
                             }
                             n_mtmd++;
                         }
@@ -1157,6 +1499,10 @@ static inline std::unique_ptr<chat_complete_req> get_chat_complete_req(
                 throw std::invalid_argument("Illegal param: missing 'content' or 'tool_calls' in \"messages\" item");
             }
         }
+
+        for (auto & [idx, fetching] : fetching_images) {
+            ptr->multimedias[idx] = fetching.get();
+        }
     }
 
     ptr->frequency_penalty = json_value(req, "frequency_penalty", params.sampling.penalty_freq);
@@ -1215,6 +1561,10 @@ static inline std::unique_ptr<chat_complete_req> get_chat_complete_req(
             R"(Illegal param: "max_completion_tokens" or "max_tokens" must be less than or equal to the model's context length)");
     }
 
+    if (req.contains("prediction") && !req.at("prediction").is_null()) {
+        ptr->prediction = get_prediction_tokens(llm_ctx, req.at("prediction"));
+    }
+
     ptr->presence_penalty = json_value(req, "presence_penalty", params.sampling.penalty_present);
 
     if (req.contains("response_format")) {
@@ -2039,19 +2389,84 @@ static inline std::unique_ptr<image_edit_req> get_image_edit_req(const httplib::
     return ptr;
 }
 
-enum process_type {
-    PROCESS_PREFILL,
-    PROCESS_DECODE,
-    PROCESS_UNKNOWN,
+struct slots_req : breq {
+    explicit slots_req(const std::string & id) : breq(id, REQ_SLOTS) {}
+
+    /* LLAMA BOX */
+
+    int32_t     id_slot = -1;
+    std::string action  = "list";  // list, save, restore, erase
+    std::string filename;
 };
 
+static inline std::unique_ptr<slots_req> get_slots_req(const httplib::Request & request, httplib::Response & response,
+                                                       const httpserver_params & hparams) {
+    const common_params & params = hparams.llm_params;
+
+    const std::string rid = response.get_header_value(HEADER_X_REQUEST_ID);
+
+    std::unique_ptr<slots_req> ptr = std::make_unique<slots_req>(rid.c_str());
+
+    ptr->model = params.model_alias;
+
+    // list
+    if (request.method == "GET") {
+        return ptr;
+    }
+
+    try {
+        ptr->id_slot = std::stoi(request.path_params.at("id"));
+    } catch (...) {
+        throw std::invalid_argument("Illegal param: slot id must be a number");
+    }
+    if (ptr->id_slot < 0 || ptr->id_slot >= hparams.n_slots) {
+        throw std::invalid_argument("Illegal param: slot id must be in range [0, " +
+                                    std::to_string(hparams.n_slots) + ")");
+    }
+
+    ptr->action = request.get_param_value("action");
+    if (ptr->action != "save" && ptr->action != "restore" && ptr->action != "erase") {
+        throw std::invalid_argument("Illegal param: \"action\" must be one of 'save', 'restore' or 'erase'");
+    }
+    if (ptr->action == "erase") {
+        return ptr;
+    }
+
+    if (params.slot_save_path.empty()) {
+        throw std::invalid_argument("Illegal param: \"action\" requires --slot-save-path");
+    }
+    const json req = request.body.empty() ? json::object() : json::parse(request.body);
+    if (!req.contains("filename")) {
+        throw std::invalid_argument("Illegal param: \"filename\" is required");
+    }
+    ptr->filename = req.at("filename").get<std::string>();
+    if (!fs_validate_filename(ptr->filename)) {
+        throw std::invalid_argument("Illegal param: \"filename\" is invalid");
+    }
+
+    // print32_t the request for debugging
+    if (common_log_verbosity_thold > 1) {
+        SRV_INF("rid %s | %s\n", rid.c_str(), req.dump(-1, ' ', false, json::error_handler_t::replace).c_str());
+    }
+
+    return ptr;
+}
+
 enum task_type {
     TASK_COMPLETIONS,
     TASK_EMBEDDINGS,
     TASK_IMAGES,
+    TASK_SLOTS,
     TASK_UNKNOWN,
 };
 
+struct btask_result {
+    explicit btask_result(httplib::StatusCode && status, json && result) : status(status), result(std::move(result)) {}
+
+    httplib::StatusCode status = httplib::Continue_100;  // 100 continue (streaming), others finished.
+    json                result;
+};
+
 struct btask {
   protected:
     int32_t   id     = -1;
@@ -2062,7 +2477,6 @@ struct btask {
     explicit btask(int32_t id, task_type type, const std::function<bool()> & is_connection_closed) :
         id(id),
         type(type),
-        seq_id(id),
         is_connection_closed(is_connection_closed) {}
 
     virtual ~btask() = default;
@@ -2097,6 +2511,9 @@ struct btask {
     std::function<bool()> is_connection_closed = []() {
         return true;
     };
+
+    // results of the task, routed back to the connection which requests
+    std::shared_ptr<BlockingReaderWriterQueue<std::unique_ptr<btask_result>>> results;
 };
 
 struct completions_task : btask {
@@ -2136,6 +2553,7 @@ struct completions_task : btask {
     llama_pos          pos_discard     = 0;  // count the discard position
     int32_t            i_batch_seq_end = 0;  // indicate the index of the batch seq end
     llama_tokens       processed_tokens;     // stores prompt tokens (if not prompt with images) and generated tokens
+    llama_tokens       staged_prompt_tokens;         // stores prompt tokens staged for matching the prompt cache
     int32_t            n_processed_detokenized = 0;  // indicate how many processed tokens are detokenized
     std::string        generated_finish_reason;      // indicate the reason of finish
     size_t             generated_text_keep_pos = std::string::npos;  // erase after call to_json
@@ -2150,6 +2568,7 @@ struct completions_task : btask {
     int32_t n_prefilling_request = 0;  // indicate how many tokens need to be prefilled
     int32_t n_prefilled          = 0;  // indicate how many tokens have been prefilled
     int32_t n_prefilled_cached   = 0;  // indicate how many prefilled tokens are cached
+    int32_t i_prefilling_prompt  = 0;  // indicate the index of the prompt which is prefilling
     int64_t t_start_prefill      = 0;  // indicate the time when prefilling starts
     double  t_prefilled          = 0;  // indicate the time(ms) spent on prefilling
     double  p_prefilled_tps      = 0;
@@ -2176,20 +2595,111 @@ struct completions_task : btask {
     int32_t                 n_drafted          = 0;  // indicate how many tokens are drafted
     int32_t                 n_drafted_accepted = 0;  // indicate how many drafted tokens are accepted
     double                  p_drafted_apt      = 0;
+    double                  p_drafted_ema      = -1;  // running acceptance rate per drafted token, -1 means unknown
+    int32_t                 n_draft_limit      = 0;   // indicate how many tokens can be drafted in the current round
+    int32_t                 pos_verifying      = 0;   // indicate the position before verifying the drafted tokens
+    int32_t                 branch_verified    = -1;  // indicate the accepted branch of the drafted tree, -1 means none
+    std::mt19937            rng_verify;              // seeded by request, for accepting or rejecting drafted tokens
     ////// draft-model speculative decoding
     struct common_sampler * sampler_draft      = nullptr;
+    std::vector<std::vector<llama_token_data>> drafted_probs;  // store the draft distribution of drafted tokens,
+                                                               // the tokens drafted by lookup are not included
+    std::vector<llama_tokens> drafted_branches;      // store the other branches forked from the first drafted token
+    std::vector<int32_t>      i_batch_seq_branches;  // indicate the index of the batch seq begin of the branches
+    ////// predicted outputs speculative decoding
+    int32_t                 i_prediction          = 0;     // indicate the index of the next expected prediction token
+    int32_t                 n_prediction_followed = 0;     // indicate how many processed tokens are followed
+    bool                    prediction_aligned    = true;  // indicate whether the generated tokens match the prediction
     ////// model-free speculative decoding
-    common_ngram_cache      ngram_cache;
+    common_ngram_cache              ngram_cache;
+    std::future<common_ngram_cache> ngram_cache_seeding;  // index the prompt in background, join before lookup
+
+    // draft_prediction drafts the following tokens of the predicted outputs,
+    // it follows the prediction while the generated tokens match,
+    // otherwise, re-aligns by searching the prediction for the longest generated suffix.
+    void draft_prediction(int32_t n_draft) {
+        const llama_tokens & prediction   = req->prediction;
+        const auto           n_prediction = int32_t(prediction.size());
+        const auto           n_processed  = int32_t(processed_tokens.size());
+
+        // follow
+        n_prediction_followed = std::max(n_prediction_followed, n_prefilling_request);
+        for (; n_prediction_followed < n_processed; n_prediction_followed++) {
+            if (prediction_aligned && i_prediction < n_prediction &&
+                prediction[i_prediction] == processed_tokens[n_prediction_followed]) {
+                i_prediction++;
+                continue;
+            }
+            prediction_aligned = false;
+        }
+
+        // re-align, search around the lost position first
+        if (!prediction_aligned) {
+            const int32_t n_generated = n_processed - n_prefilling_request;
+            for (int32_t m = std::min(n_generated, 8); m >= std::min(n_generated, 2) && m > 0; m--) {
+                const auto suffix = processed_tokens.end() - m;
+                auto       from   = prediction.begin() + std::max(0, std::min(i_prediction, n_prediction) - m);
+                auto       it     = std::search(from, prediction.end(), suffix, processed_tokens.end());
+                if (it == prediction.end()) {
+                    it = std::search(prediction.begin(), prediction.end(), suffix, processed_tokens.end());
+                }
+                if (it != prediction.end()) {
+                    i_prediction       = int32_t(it - prediction.begin()) + m;
+                    prediction_aligned = true;
+                    break;
+                }
+            }
+            if (!prediction_aligned) {
+                return;
+            }
+        }
+
+        // draft
+        for (int32_t i = i_prediction; i < n_prediction && int32_t(drafted_tokens.size()) < n_draft; i++) {
+            drafted_tokens.push_back(prediction[i]);
+        }
+        n_drafted += int32_t(drafted_tokens.size());
+    }
+
+    // stage flattens the prompts into the tokens for matching the prompt cache ahead of batching,
+    // the multimedia are represented by their dummy tokens.
+    void stage() {
+        staged_prompt_tokens.clear();
+        // get tokens of plain text
+        if (!tokenized_prompts_include_multimedias) {
+            staged_prompt_tokens = std::get<llama_tokens>(tokenized_prompts[0]);
+            return;
+        }
+        // get tokens of multimedia
+        for (const auto & tokenized_prompt : tokenized_prompts) {
+            if (std::holds_alternative<llama_tokens>(tokenized_prompt)) {
+                const llama_tokens & tokenized_text = std::get<llama_tokens>(tokenized_prompt);
+                staged_prompt_tokens.insert(staged_prompt_tokens.end(), tokenized_text.begin(), tokenized_text.end());
+            } else {
+                const llama_multimodal_tokens & tokenized_mtmd = std::get<llama_multimodal_tokens>(tokenized_prompt);
+                staged_prompt_tokens.insert(staged_prompt_tokens.end(), tokenized_mtmd.n_pos,
+                                            tokenized_mtmd.dummy_token);
+            }
+        }
+    }
+
+    // on_drafted_verified updates the running acceptance rate per drafted token,
+    // the drafted tokens are verified in order, so the first rejected one ends the trials.
+    void on_drafted_verified(int32_t n_drafted_step, int32_t n_accepted_step) {
+        const int32_t n_trials = n_accepted_step < n_drafted_step ? n_accepted_step + 1 : n_accepted_step;
+        const double  p        = double(n_accepted_step) / double(n_trials);
+        p_drafted_ema          = p_drafted_ema < 0 ? p : p_drafted_ema * 0.8 + p * 0.2;
+    }
 
-    void push_generated_token(llama_context * llm_ctx, int32_t tok_idx, llama_token tok) {
+    void push_generated_token(const llama_vocab * vocab, const float * logits, llama_token tok) {
         // store tokens
         processed_tokens.push_back(tok);
 
         // top logprobs
         if (req->logprobs > 0) {
-            const std::vector<llama_token_data> cur = get_token_probabilities(llm_ctx, tok_idx);
-            const size_t n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(llm_ctx)));
-            const size_t n_probs = req->logprobs;
+            const std::vector<llama_token_data> cur     = get_token_probabilities(vocab, logits);
+            const size_t                        n_vocab = llama_vocab_n_tokens(vocab);
+            const size_t                        n_probs = req->logprobs;
             // set probability for sampled token
             for (size_t i = 0; i < n_vocab; i++) {
                 if (cur[i].id == tok) {
@@ -2579,11 +3089,16 @@ struct images_task : btask {
     }
 };
 
-struct btask_result {
-    explicit btask_result(httplib::StatusCode && status, json && result) : status(status), result(std::move(result)) {}
+struct slots_task : btask {
+    explicit slots_task(int32_t id, const std::function<bool()> & is_connection_closed) :
+        btask(id, TASK_SLOTS, is_connection_closed) {}
 
-    httplib::StatusCode status = httplib::Continue_100;  // 100 continue (streaming), others finished.
-    json                result;
+    [[nodiscard]] std::string get_r_id() const override { return req->get_id(); }
+
+    [[nodiscard]] req_type get_r_type() const override { return req->get_type(); }
+
+    // input
+    std::unique_ptr<slots_req> req;
 };
 
 // implementations // httpserver
@@ -2646,16 +3161,37 @@ struct httpserver {
     explicit httpserver(httpserver_params & params) : params(params) {
         process_tasks =
             std::make_unique<BlockingConcurrentQueue<std::unique_ptr<btask>>>(params.llm_params.n_threads_http);
-        process_task_results.resize(params.llm_params.n_threads_http);
-        for (int32_t i = 0; i < params.llm_params.n_threads_http; i++) {
-            process_task_results[i] = std::make_unique<BlockingReaderWriterQueue<std::unique_ptr<btask_result>>>();
-        }
 
         llama_numa_init(params.llm_params.numa);
         llama_backend_init();
     }
 
     ~httpserver() {
+        if (sampling_workers != nullptr) {
+            sampling_workers->shutdown();
+        }
+        if (mtmd_workers != nullptr) {
+            mtmd_workers->shutdown();
+        }
+        if (lookup_index_workers != nullptr) {
+            lookup_index_workers->shutdown();
+        }
+        if (lookup_cache_workers != nullptr) {
+            lookup_cache_workers->shutdown();
+        }
+        if (lookup_cache_dynamic_dirty && !params.lookup_cache_dynamic.empty()) {
+            save_lookup_cache(lookup_cache_dynamic);
+        }
+        for (const cache_prompt_state_entry & state : cache_prompt_states) {
+            if (!state.path.empty()) {
+                std::error_code ec;
+                std::filesystem::remove(state.path, ec);
+            }
+        }
+        if (params.cache_disk > 0 && !params.cache_disk_path.empty()) {
+            std::error_code ec;
+            std::filesystem::remove(params.cache_disk_path, ec);  // only if empty
+        }
         llama_batch_free(batch_text);
         llama_batch_free(batch_text_temp);
         if (llm_ctx != nullptr) {
@@ -2768,14 +3304,85 @@ struct httpserver {
             }
             llm_ctx_clip_v = llm_init_clip.ctx_v;
             llm_ctx_clip_a = llm_init_clip.ctx_a;
+            mtmd_workers   = std::make_unique<httplib::ThreadPool>(1);
+            SRV_INF("multimodal encoder, n_threads = %d\n", params.n_threads_mmproj);
+            if (params.cpuparams_mmproj.mask_valid) {
+#if defined(linux) || defined(__linux) || defined(__linux__)
+                // pin the encoder worker, the threads spawned by the encoding inherit its affinity
+                mtmd_workers->enqueue([this]() {
+                    cpu_set_t cpu_mask;
+                    CPU_ZERO(&cpu_mask);
+                    for (int32_t i = 0; i < GGML_MAX_N_THREADS && i < CPU_SETSIZE; i++) {
+                        if (params.cpuparams_mmproj.cpumask[i]) {
+                            CPU_SET(i, &cpu_mask);
+                        }
+                    }
+                    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_mask) != 0) {
+                        SRV_WRN("%s", "multimodal encoder, failed to set cpu affinity\n");
+                    }
+                });
+#else
+                SRV_WRN("%s", "multimodal encoder, cpu affinity is not supported on this platform, ignored\n");
+#endif
+            }
+            if (params.max_projected_cache > 0) {
+                cache_multimodals = llama_multimodal_cache(size_t(params.max_projected_cache),
+                                                           size_t(params.projected_cache_ram) << 20);
+                SRV_INF("projected embedding cache, max_entries = %d, max_size = %d mib\n",
+                        params.max_projected_cache, params.projected_cache_ram);
+            }
+            if (!params.projected_cache_dir.empty()) {
+                if (!fs_create_directory_with_parents(params.projected_cache_dir)) {
+                    SRV_ERR("failed to create projected cache directory: %s\n", params.projected_cache_dir.c_str());
+                    return false;
+                }
+                // identify the projector by its whole content rather than its path or modified time,
+                // so that the same projector downloaded again or mounted elsewhere keeps the persisted ones valid,
+                // while a fine-tuned one sharing the same header and size does not.
+                // the content is hashed per chunk once at starting, and then the chunk hashes are hashed.
+                std::string identity;
+                try {
+                    std::ifstream ifs(params.llm_params.mmproj.path, std::ios::binary);
+                    ifs.exceptions(std::ifstream::badbit);
+                    std::vector<uint8_t> chunk(16 << 20);
+                    while (ifs) {
+                        ifs.read((char *) chunk.data(), std::streamsize(chunk.size()));
+                        const auto n_read = size_t(ifs.gcount());
+                        if (n_read == 0) {
+                            break;
+                        }
+                        identity += hash_fnv(chunk.data(), n_read);
+                    }
+                    identity += "/" + std::to_string(params.max_image_size);
+                } catch (const std::exception & e) {
+                    SRV_ERR("failed to identify multimodal projection model: %s\n", e.what());
+                    return false;
+                }
+                cache_multimodals_identity =
+                    std::stoull(hash_fnv((const uint8_t *) identity.data(), identity.size()), nullptr, 16);
+                SRV_INF("projected embedding persisting enabled, path = %s\n", params.projected_cache_dir.c_str());
+            }
         }
 
         // load the draft model if needed.
         if (!params.llm_params.speculative.model.path.empty() && params.llm_params.speculative.n_max > 0) {
             SRV_INF("loading draft model '%s'\n", params.llm_params.speculative.model.path.c_str());
 
+            // NB(thxCode): the drafted branches are placed at the sequences after the slots,
+            // which share the cells of the slot sequence, so a unified kv cache is required.
+            if (params.draft_branches > 1) {
+                if (!params.llm_params.kv_unified) {
+                    SRV_WRN("%s", "tree speculative decoding requires --kv-unified, fallback to single chain\n");
+                    params.draft_branches = 1;
+                } else if (params.n_slots * params.draft_branches > int32_t(llama_max_parallel_sequences())) {
+                    SRV_WRN("tree speculative decoding requires %d sequences, exceeds %d, fallback to single chain\n",
+                            params.n_slots * params.draft_branches, int32_t(llama_max_parallel_sequences()));
+                    params.draft_branches = 1;
+                }
+            }
+
             common_params llm_params_draft         = params.llm_params;
-            llm_params_draft.n_parallel            = params.llm_params.n_threads_http;
+            llm_params_draft.n_parallel            = params.n_slots * params.draft_branches;
             llm_params_draft.embedding             = false;
             llm_params_draft.model                 = params.llm_params.speculative.model;
             llm_params_draft.n_gpu_layers          = params.llm_params.speculative.n_gpu_layers;
@@ -2796,8 +3403,12 @@ struct httpserver {
             batch_text_draft = llama_batch_init(int32_t(llama_n_ctx(llm_ctx_draft)), 0, 1);
         }
 
+        if (llm_ctx_draft == nullptr) {
+            params.draft_branches = 1;
+        }
+
         common_params llm_params = params.llm_params;
-        llm_params.n_parallel    = params.llm_params.n_threads_http;
+        llm_params.n_parallel    = params.n_slots * params.draft_branches;
         llm_init                 = common_init_from_params(llm_params);
         llm_model                = llm_init.model.get();
         llm_ctx                  = llm_init.context.get();
@@ -2807,7 +3418,7 @@ struct httpserver {
         }
         llm_vocab            = llama_model_get_vocab(llm_model);
         llm_ctx_size         = int32_t(llama_n_ctx(llm_ctx));
-        llm_slot_ctx_size    = llm_ctx_size / llm_params.n_parallel;
+        llm_slot_ctx_size    = llm_ctx_size / params.n_slots;
         llm_ctx_embed_size   = llama_model_n_embd(llm_model);
         llm_kv_cache_limit   = llm_slot_ctx_size - 1;
         llm_kv_cache_shift   = llama_memory_can_shift(llama_get_memory(llm_ctx));
@@ -2817,6 +3428,7 @@ struct httpserver {
         llm_model_n_swa      = llama_model_n_swa(llm_model);
         llm_model_arch_name  = llama_model_arch_name(llm_model);  // llama_model_arch_name is a patch.
         batch_view_max       = int32_t(llama_n_batch(llm_ctx));
+        batch_step_max       = batch_view_max;
         batch_text           = llama_batch_init(llm_ctx_size, 0, 1);
         batch_text_temp      = llama_batch_init(llm_ctx_size, 0, 1);
 
@@ -2920,14 +3532,91 @@ struct httpserver {
         // prompt cache
         cache_prompt = params.cache_prompt && llm_kv_cache_shift && llama_get_memory(llm_ctx) != nullptr;
         if (cache_prompt) {
-            cache_prompts.resize(params.llm_params.n_threads_http);
+            cache_prompts.resize(params.n_slots);
         }
         SRV_INF("prompt caching %s\n", cache_prompt ? "enabled" : (params.cache_prompt ? "unsupported" : "disabled"));
+        if (cache_prompt && params.cache_ram > 0) {
+            SRV_INF("prompt cache stashing enabled, ram = %d MiB\n", params.cache_ram);
+            if (params.cache_disk > 0) {
+                if (params.cache_disk_path.empty()) {
+                    params.cache_disk_path = fs_get_cache_directory() + "prompt/";
+                }
+                // identify the states by the models and the kv cache types, which are checked before restoring,
+                // and spill into a directory owned by this server endpoint,
+                // so that the processes sharing the path never overwrite or drop the others' states.
+                char desc[256];
+                llama_model_desc(llm_model, desc, sizeof(desc));
+                std::string identity = std::string(desc) + "/" + std::to_string(llama_model_size(llm_model)) + "/" +
+                                       std::to_string(llama_model_n_params(llm_model)) + "/" +
+                                       ggml_type_name(params.llm_params.cache_type_k) + "/" +
+                                       ggml_type_name(params.llm_params.cache_type_v);
+                if (llm_model_draft != nullptr) {
+                    llama_model_desc(llm_model_draft, desc, sizeof(desc));
+                    identity += "/" + std::string(desc) + "/" + std::to_string(llama_model_size(llm_model_draft));
+                }
+                const std::string endpoint = params.llm_params.hostname + ":" + std::to_string(params.llm_params.port);
+                const std::string identity_hash = hash_fnv((const uint8_t *) identity.data(), identity.size());
+                cache_prompt_states_identity    = std::stoull(identity_hash, nullptr, 16);
+                params.cache_disk_path += identity_hash + "-" +
+                                          hash_fnv((const uint8_t *) endpoint.data(), endpoint.size()) +
+                                          DIRECTORY_SEPARATOR;
+                if (!fs_create_directory_with_parents(params.cache_disk_path)) {
+                    SRV_ERR("failed to create prompt cache directory: %s\n", params.cache_disk_path.c_str());
+                    return false;
+                }
+                SRV_INF("prompt cache spilling enabled, disk = %d MiB, path = %s\n", params.cache_disk,
+                        params.cache_disk_path.c_str());
+            }
+        }
 
         // context shift
         shift_context = params.llm_params.ctx_shift && llm_kv_cache_shift;
         SRV_INF("context shifting %s\n", shift_context ? "enabled" : "disabled");
 
+        // lookup cache
+        if (params.lookup_ngram_min > 0) {
+            if (!params.lookup_cache_static.empty()) {
+                if (!load_lookup_cache(params.lookup_cache_static, lookup_cache_static)) {
+                    SRV_ERR("failed to load static lookup cache: %s\n", params.lookup_cache_static.c_str());
+                    return false;
+                }
+                SRV_INF("static lookup cache loaded, n_ngrams = %zu\n", lookup_cache_static.size());
+            }
+            if (!params.lookup_cache_dynamic.empty() && std::filesystem::exists(params.lookup_cache_dynamic)) {
+                if (!load_lookup_cache(params.lookup_cache_dynamic, lookup_cache_dynamic)) {
+                    SRV_WRN("failed to load dynamic lookup cache: %s, starting from empty\n",
+                            params.lookup_cache_dynamic.c_str());
+                    lookup_cache_dynamic.clear();
+                }
+                for (const auto & [ngram, part] : lookup_cache_dynamic) {
+                    lookup_cache_dynamic_size += lookup_ngram_size + part.size() * lookup_token_size;
+                }
+                prune_lookup_cache();
+                SRV_INF("dynamic lookup cache loaded, n_ngrams = %zu\n", lookup_cache_dynamic.size());
+            }
+            lookup_cache_dynamic_view      = std::make_shared<common_ngram_cache>(lookup_cache_dynamic);
+            lookup_cache_workers           = std::make_unique<httplib::ThreadPool>(1);
+            lookup_index_workers           = std::make_unique<httplib::ThreadPool>(size_t(std::min(params.n_slots, 4)));
+            lookup_cache_dynamic_saved     = ggml_time_us();
+            lookup_cache_dynamic_published = ggml_time_us();
+        } else if (!params.lookup_cache_static.empty() || !params.lookup_cache_dynamic.empty()) {
+            SRV_WRN("%s", "lookup cache requires --lookup-ngram-min, ignored\n");
+        }
+
+        // sampling workers
+        if (params.n_threads_sampling > 1) {
+            sampling_workers = std::make_unique<httplib::ThreadPool>(params.n_threads_sampling - 1);
+        }
+        SRV_INF("sampling concurrency, n_threads = %d\n", std::max(params.n_threads_sampling, 1));
+
+        // batch step budget
+        if (params.max_batched_tokens > batch_view_max) {
+            SRV_WRN("max batched tokens is larger than the batch size, capping to %d\n", batch_view_max);
+        } else if (params.max_batched_tokens > 0) {
+            batch_step_max = params.max_batched_tokens;
+        }
+        SRV_INF("batch step budget, n_tokens = %d\n", batch_step_max);
+
         // chat template
         {
             chat_templates = common_chat_templates_init(llm_model, params.llm_params.chat_template);
@@ -3201,6 +3890,10 @@ struct httpserver {
             if (support_reranking()) {
                 server->Post("/v1/rerank", HANDLER(handle_rerank));
             }
+            if (cache_prompt) {
+                server->Get("/slots", HANDLER(handle_slots));
+                server->Post("/slots/:id", HANDLER(handle_slots));
+            }
         }
 #undef _HANDLER
 
@@ -3333,11 +4026,24 @@ struct httpserver {
 
     httpserver_params                                                                      params;
     httpserver_metrics                                                                     metrics;
-    std::unique_ptr<BlockingConcurrentQueue<std::unique_ptr<btask>>>                       process_tasks;
-    std::vector<std::unique_ptr<BlockingReaderWriterQueue<std::unique_ptr<btask_result>>>> process_task_results;
+    std::unique_ptr<BlockingConcurrentQueue<std::unique_ptr<btask>>> process_tasks;
+
+    // scheduling, the active tasks stay in the scheduler across steps,
+    // only the arrived tasks come through the process_tasks queue,
+    // the per step vectors are reused to avoid reallocating
+    std::vector<std::unique_ptr<btask>> active_task_ptrs;  // requeued by the current step
+    std::vector<std::unique_ptr<btask>> staged_task_ptrs;  // arrived during the previous decoding
+    std::vector<std::unique_ptr<btask>> reconcile_task_ptrs;
+    std::vector<std::unique_ptr<btask>> reconcile_batch_task_ptrs;
+    std::vector<std::unique_ptr<btask>> reconcile_drafting_task_ptrs;
+    std::vector<completions_task *>     reconcile_sampling_tasks;
+    std::vector<uint8_t>                reconcile_sampling_send_texts;
+    std::vector<const float *>          reconcile_sampling_logits_rows;
 
     // lora
     std::vector<common_adapter_lora_info> lora_adapters;
+    int32_t                               lora_adapters_steps = 0;  // indicate how many batches keep the applied
+                                                                    // lora adapters while others are waiting
 
     /* STABLE DIFFUSION */
 
@@ -3357,6 +4063,7 @@ struct httpserver {
     int32_t             llm_ctx_embed_size    = 0;
     int32_t             llm_kv_cache_used     = 0;  // include llm_kv_cache_inactive
     int32_t             llm_kv_cache_inactive = 0;
+    int32_t             llm_kv_cache_reserved = 0;  // admitted but not prefilled yet
     int32_t             llm_kv_cache_limit    = 0;
     bool                llm_kv_cache_shift    = false;
     bool                llm_model_casual      = true;
@@ -3364,6 +4071,7 @@ struct httpserver {
     int32_t             llm_model_n_swa       = 0;
     std::string         llm_model_arch_name   = "";
     int32_t             batch_view_max        = 0;
+    int32_t             batch_step_max        = 0;  // maximum number of tokens to process within one step
     llama_batch         batch_text            = {};
     llama_batch         batch_text_temp       = {};
 
@@ -3376,23 +4084,160 @@ struct httpserver {
         llama_pos    pos_discard = 0;  // count the discard position
     };
 
+    // cache_prompt_radix_tree indexes the cached prompts of all sequences,
+    // each edge holds a run of tokens and the bitmask of sequences whose kv cache covers the run,
+    // so that the longest cached prefix can be found within O(prompt length).
+    struct cache_prompt_radix_tree {
+        struct node {
+            llama_tokens                                           tokens;
+            uint64_t                                               seqs = 0;
+            std::unordered_map<llama_token, std::unique_ptr<node>> children;
+        };
+
+        node root;
+
+        // insert indexes the first n tokens as the cached prefix of the given sequence,
+        // replacing the previous prefix of the sequence.
+        void insert(const llama_seq_id seq_id, const llama_tokens & tokens, size_t n) {
+            erase(seq_id);
+
+            const uint64_t seq = uint64_t(1) << seq_id;
+            n                  = std::min(n, tokens.size());
+            node * cur         = &root;
+            size_t i           = 0;
+            while (i < n) {
+                auto it = cur->children.find(tokens[i]);
+                if (it == cur->children.end()) {
+                    auto child = std::make_unique<node>();
+                    child->tokens.assign(tokens.begin() + int64_t(i), tokens.begin() + int64_t(n));
+                    child->seqs = seq;
+                    cur->children.emplace(tokens[i], std::move(child));
+                    return;
+                }
+                node *       nxt = it->second.get();
+                const size_t m   = std::min(nxt->tokens.size(), n - i);
+                size_t       l   = 1;
+                while (l < m && nxt->tokens[l] == tokens[i + l]) {
+                    l++;
+                }
+                // split the edge at the divergence
+                if (l < nxt->tokens.size()) {
+                    auto tail = std::make_unique<node>();
+                    tail->tokens.assign(nxt->tokens.begin() + int64_t(l), nxt->tokens.end());
+                    tail->seqs = nxt->seqs;
+                    tail->children.swap(nxt->children);
+                    nxt->tokens.resize(l);
+                    const llama_token key = tail->tokens[0];
+                    nxt->children.emplace(key, std::move(tail));
+                }
+                nxt->seqs |= seq;
+                cur = nxt;
+                i += l;
+            }
+        }
+
+        // erase drops the prefix of the given sequence.
+        void erase(const llama_seq_id seq_id) { erase(&root, uint64_t(1) << seq_id); }
+
+        // match returns the length of the longest cached prefix of the given tokens,
+        // and the bitmask of sequences holding it.
+        std::pair<size_t, uint64_t> match(const llama_tokens & tokens) const {
+            const node * cur  = &root;
+            size_t       i    = 0;
+            uint64_t     seqs = 0;
+            while (i < tokens.size()) {
+                auto it = cur->children.find(tokens[i]);
+                if (it == cur->children.end()) {
+                    break;
+                }
+                const node * nxt = it->second.get();
+                const size_t m   = std::min(nxt->tokens.size(), tokens.size() - i);
+                size_t       l   = 1;
+                while (l < m && nxt->tokens[l] == tokens[i + l]) {
+                    l++;
+                }
+                seqs = nxt->seqs;
+                i += l;
+                if (l < nxt->tokens.size()) {
+                    break;
+                }
+                cur = nxt;
+            }
+            return { i, seqs };
+        }
+
+        void clear() { root.children.clear(); }
+
+      private:
+        static void erase(node * cur, const uint64_t seq) {
+            for (auto it = cur->children.begin(); it != cur->children.end(); ++it) {
+                node * child = it->second.get();
+                if ((child->seqs & seq) == 0) {
+                    continue;
+                }
+                child->seqs &= ~seq;
+                if (child->seqs == 0) {
+                    cur->children.erase(it);
+                    return;
+                }
+                erase(child, seq);
+                // merge with the only child if both are held by the same sequences
+                if (child->children.size() == 1 && child->children.begin()->second->seqs == child->seqs) {
+                    std::unique_ptr<node> grand = std::move(child->children.begin()->second);
+                    child->tokens.insert(child->tokens.end(), grand->tokens.begin(), grand->tokens.end());
+                    child->children = std::move(grand->children);
+                }
+                // a sequence holds one path only
+                return;
+            }
+        }
+    };
+
     bool                            cache_prompt  = false;
     bool                            shift_context = false;
     common_chat_templates_ptr       chat_templates;
     std::vector<cache_prompt_entry> cache_prompts;
+    cache_prompt_radix_tree         cache_prompt_tree;
+    uint64_t                        slots_busy = 0;  // bit i indicates the slot i is held by a request,
+                                                     // rebuilt per step from the active tasks
+
+    struct cache_prompt_state_entry {
+        llama_tokens         tokens;
+        std::vector<uint8_t> state;        // serialized kv cache of the model
+        std::vector<uint8_t> state_draft;  // serialized kv cache of the draft model
+        size_t               size       = 0;
+        size_t               size_draft = 0;
+        std::string          path       = "";  // spilled file, empty if in host memory
+    };
+
+    // the header of a spilled state file, checked before restoring
+    struct cache_prompt_state_file_header {
+        uint32_t magic      = 0x4c425350;  // LBSP
+        uint32_t version    = 1;
+        uint64_t identity   = 0;  // identity of the models and the kv cache types
+        uint64_t n_tokens   = 0;
+        uint64_t size       = 0;  // size of the model state
+        uint64_t size_draft = 0;  // size of the draft model state
+    };
+
+    std::list<cache_prompt_state_entry> cache_prompt_states;  // most recently used first
+    size_t                              cache_prompt_states_ram      = 0;
+    size_t                              cache_prompt_states_disk     = 0;
+    uint64_t                            cache_prompt_states_identity = 0;
 
     // clip model
-    std::mutex       llm_ctx_clip_mtx;
     clip_init_result llm_init_clip  = {};
     clip_ctx *       llm_ctx_clip_v = nullptr;
     clip_ctx *       llm_ctx_clip_a = nullptr;
 
-    struct cache_multimodal_entry {
-        std::vector<llama_multimodal_tokens> tokens;
-        int64_t                              last_used = 0;
-    };
+    // multimodal encoder worker, the only one to run the clip contexts,
+    // so the encoding neither holds the http threads nor shares the decoding threads
+    std::unique_ptr<httplib::ThreadPool> mtmd_workers;
 
-    std::unordered_map<std::string, cache_multimodal_entry> cache_multimodals;
+    // projected embedding cache,
+    // the persisted ones are valid only if saved by the same projector with the same preprocessing
+    llama_multimodal_cache cache_multimodals;
+    uint64_t               cache_multimodals_identity = 0;
 
     // speculative decoding
     common_init_result  llm_init_draft;
@@ -3401,11 +4246,76 @@ struct httpserver {
     const llama_vocab * llm_vocab_draft  = nullptr;
     llama_batch         batch_text_draft = {};
 
+    // decode_cost_estimator fits the decoding time of a batch as t = a + b * n_tokens,
+    // in exponentially weighted least squares, so that the recent decodes weigh more.
+    struct decode_cost_estimator {
+        static constexpr double decay = 0.95;
+
+        double s_w  = 0;
+        double s_n  = 0;
+        double s_t  = 0;
+        double s_nn = 0;
+        double s_nt = 0;
+
+        void observe(int32_t n, double t) {
+            s_w  = s_w * decay + 1;
+            s_n  = s_n * decay + n;
+            s_t  = s_t * decay + t;
+            s_nn = s_nn * decay + double(n) * n;
+            s_nt = s_nt * decay + double(n) * t;
+        }
+
+        bool ready() const { return s_w >= 4; }
+
+        // fit returns the fixed cost a and the cost per token b,
+        // if the observed sizes are too close to fit, treat the decoding time as fixed.
+        std::pair<double, double> fit() const {
+            const double m_n = s_n / s_w;
+            const double m_t = s_t / s_w;
+            const double v_n = s_nn / s_w - m_n * m_n;
+            if (v_n < 1) {
+                return { m_t, 0.0 };
+            }
+            const double b = std::max(0.0, (s_nt / s_w - m_n * m_t) / v_n);
+            const double a = std::max(0.0, m_t - b * m_n);
+            return { a, b };
+        }
+
+        // estimate returns the decoding time of n tokens.
+        double estimate(int32_t n) const {
+            const auto [a, b] = fit();
+            return a + b * n;
+        }
+
+        // marginal returns the decoding time of one more token in the batch.
+        double marginal() const { return fit().second; }
+    };
+
+    decode_cost_estimator decode_cost_llm;
+    decode_cost_estimator decode_cost_draft;
+
+    // model-free speculative decoding
+    common_ngram_cache                   lookup_cache_static;
+    common_ngram_cache                   lookup_cache_dynamic;  // learnt on the lookup cache workers only
+    size_t                               lookup_cache_dynamic_size      = 0;  // the approximate size in bytes
+    bool                                 lookup_cache_dynamic_dirty     = false;
+    int64_t                              lookup_cache_dynamic_saved     = 0;  // the time in us of the last saving
+    int64_t                              lookup_cache_dynamic_published = 0;  // the time in us of the last publishing
+    std::atomic<int32_t>                 lookup_cache_dynamic_pending   = 0;  // the merges queued on the workers
+    std::mutex                           lookup_cache_dynamic_mtx;
+    std::shared_ptr<common_ngram_cache>  lookup_cache_dynamic_latest;  // published by the workers, guarded by the mutex
+    std::shared_ptr<common_ngram_cache>  lookup_cache_dynamic_view;    // read by the drafting, never modified
+    std::unique_ptr<httplib::ThreadPool> lookup_cache_workers;         // learn, prune and save in background
+    std::unique_ptr<httplib::ThreadPool> lookup_index_workers;         // index the prefilled prompts in background
+
     // thread pool
     ggml_backend_reg_t reg_cpu          = nullptr;
     ggml_threadpool_t  threadpool       = nullptr;
     ggml_threadpool_t  threadpool_batch = nullptr;
 
+    // sampling workers, help the reconcile thread to sample the decoded tasks of a batch
+    std::unique_ptr<httplib::ThreadPool> sampling_workers;
+
     // tool calls
     bool                     support_tool_calls                   = false;
     bool                     support_parallel_tool_calls          = true;
@@ -3428,12 +4338,8 @@ struct httpserver {
     std::string reasoning_end_word    = "";
 
     static inline int32_t get_task_id() {
-        thread_local static int32_t id = -1;
-        if (id == -1) {
-            static std::atomic<int32_t> next{ 0 };
-            id = next++;
-        }
-        return id;
+        static std::atomic<int32_t> next{ 0 };
+        return next++;
     }
 
     inline bool support_tokenize() const { return llm_vocab != nullptr; }
@@ -3460,7 +4366,7 @@ struct httpserver {
         if (cache_prompt) {
             int32_t cache_id  = -1;
             int32_t cache_pos = 0;
-            for (int32_t i = 0; i < params.llm_params.n_threads_http; i++) {
+            for (int32_t i = 0; i < params.n_slots; i++) {
                 cache_prompt_entry & cache = cache_prompts.at(i);
                 if (!cache.used && cache.pos > cache_pos) {
                     cache_id  = i;
@@ -3468,6 +4374,8 @@ struct httpserver {
                 }
             }
             if (cache_id != -1) {
+                stash_cache_prompt(cache_id);
+
                 const int32_t n_keep    = params.llm_params.n_keep + 1;
                 const int32_t n_left    = cache_pos - n_keep;
                 int32_t       n_discard = std::min(n_left >> 2, params.llm_params.n_ubatch);
@@ -3500,6 +4408,8 @@ struct httpserver {
                 cache.pos_discard += n_discard;
                 llm_kv_cache_used -= n_discard;
                 llm_kv_cache_inactive -= n_discard;
+                // only the tokens before n_keep are still in place
+                cache_prompt_tree.insert(cache_id, cache.tokens, std::min(n_keep, cache.pos));
                 return;
             }
         }
@@ -3534,6 +4444,409 @@ struct httpserver {
         task->pos -= n_discard;
         task->pos_discard += n_discard;
         llm_kv_cache_used -= n_discard;
+        if (cache_prompt) {
+            cache_prompt_tree.erase(seq_id);
+        }
+    }
+
+    inline std::list<cache_prompt_state_entry>::iterator drop_cache_prompt_state(
+        std::list<cache_prompt_state_entry>::iterator it) {
+        if (it->path.empty()) {
+            cache_prompt_states_ram -= it->size + it->size_draft;
+        } else {
+            cache_prompt_states_disk -= it->size + it->size_draft;
+            std::error_code ec;
+            std::filesystem::remove(it->path, ec);
+        }
+        return cache_prompt_states.erase(it);
+    }
+
+    inline bool spill_cache_prompt_state(cache_prompt_state_entry & state) {
+        const size_t size   = state.size + state.size_draft;
+        const size_t budget = size_t(params.cache_disk) << 20;
+        if (size > budget) {
+            return false;
+        }
+
+        // drop the least recently used spilled states
+        for (auto it = cache_prompt_states.end(); cache_prompt_states_disk + size > budget &&
+                                                  it != cache_prompt_states.begin();) {
+            --it;
+            if (!it->path.empty()) {
+                it = drop_cache_prompt_state(it);
+            }
+        }
+
+        const std::string path =
+            params.cache_disk_path +
+            hash_fnv((const uint8_t *) state.tokens.data(), state.tokens.size() * sizeof(llama_token));
+        cache_prompt_state_file_header header;
+        header.identity   = cache_prompt_states_identity;
+        header.n_tokens   = state.tokens.size();
+        header.size       = state.size;
+        header.size_draft = state.size_draft;
+        try {
+            std::ofstream ofs(path, std::ios::binary);
+            ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+            ofs.write((const char *) &header, sizeof(header));
+            ofs.write((const char *) state.state.data(), std::streamsize(state.size));
+            ofs.write((const char *) state.state_draft.data(), std::streamsize(state.size_draft));
+        } catch (const std::exception & e) {
+            SRV_WRN("spill prompt cache, failed to write %s: %s\n", path.c_str(), e.what());
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            return false;
+        }
+        cache_prompt_states_ram -= size;
+        cache_prompt_states_disk += size;
+        state.path = path;
+        std::vector<uint8_t>().swap(state.state);
+        std::vector<uint8_t>().swap(state.state_draft);
+        SRV_INFV(2, "spill prompt cache, n_tokens = %zu, size = %.2f MiB, disk = %.2f MiB\n", state.tokens.size(),
+                 double(size) / 1024.0 / 1024.0, double(cache_prompt_states_disk) / 1024.0 / 1024.0);
+        return true;
+    }
+
+    // stash_cache_prompt serializes the kv cache of the given unused sequence into host memory before overwriting,
+    // the least recently used states are spilled to disk, or dropped, once exceeding the budget.
+    inline void stash_cache_prompt(const int32_t seq_id) {
+        const cache_prompt_entry & cache = cache_prompts.at(seq_id);
+        if (params.cache_ram <= 0 || cache.used || cache.pos_discard > 0 || cache.pos <= 1) {
+            return;
+        }
+
+        const auto         n_tokens = std::min(size_t(cache.pos), cache.tokens.size());
+        const llama_tokens tokens(cache.tokens.begin(), cache.tokens.begin() + int64_t(n_tokens));
+        for (auto it = cache_prompt_states.begin(); it != cache_prompt_states.end();) {
+            const size_t lcp_l = common_lcp(it->tokens, tokens);
+            // already stashed
+            if (lcp_l == tokens.size()) {
+                cache_prompt_states.splice(cache_prompt_states.begin(), cache_prompt_states, it);
+                return;
+            }
+            // drop the stashed prefix, which is covered by the new one
+            if (lcp_l == it->tokens.size()) {
+                it = drop_cache_prompt_state(it);
+                continue;
+            }
+            ++it;
+        }
+
+        const size_t             budget = size_t(params.cache_ram) << 20;
+        cache_prompt_state_entry state;
+        state.size = llama_state_seq_get_size(llm_ctx, seq_id);
+        if (llm_ctx_draft != nullptr) {
+            state.size_draft = llama_state_seq_get_size(llm_ctx_draft, seq_id);
+        }
+        if (state.size + state.size_draft > budget) {
+            SRV_WRN("stash prompt cache, seq = %d, skipped as the size %.2f MiB exceeds the budget\n", seq_id,
+                    double(state.size + state.size_draft) / 1024.0 / 1024.0);
+            return;
+        }
+        state.state.resize(state.size);
+        if (llama_state_seq_get_data(llm_ctx, state.state.data(), state.size, seq_id) != state.size) {
+            SRV_WRN("stash prompt cache, seq = %d, failed to get state\n", seq_id);
+            return;
+        }
+        if (llm_ctx_draft != nullptr) {
+            state.state_draft.resize(state.size_draft);
+            if (llama_state_seq_get_data(llm_ctx_draft, state.state_draft.data(), state.size_draft, seq_id) !=
+                state.size_draft) {
+                SRV_WRN("stash prompt cache, seq = %d, failed to get draft state\n", seq_id);
+                return;
+            }
+        }
+        state.tokens = tokens;
+        cache_prompt_states_ram += state.size + state.size_draft;
+        SRV_INFV(2, "stash prompt cache, seq = %d, n_tokens = %zu, size = %.2f MiB, ram = %.2f MiB\n", seq_id,
+                 n_tokens, double(state.size + state.size_draft) / 1024.0 / 1024.0,
+                 double(cache_prompt_states_ram) / 1024.0 / 1024.0);
+        cache_prompt_states.push_front(std::move(state));
+
+        // spill or drop the least recently used states in host memory
+        for (auto it = cache_prompt_states.end(); cache_prompt_states_ram > budget &&
+                                                  it != cache_prompt_states.begin();) {
+            --it;
+            if (!it->path.empty()) {
+                continue;
+            }
+            if (params.cache_disk <= 0 || !spill_cache_prompt_state(*it)) {
+                it = drop_cache_prompt_state(it);
+            }
+        }
+    }
+
+    // restore_cache_prompt restores the stashed state sharing the longest prefix with the given tokens into the given
+    // sequence, returns the length of the restored prefix, 0 if no one is longer than n_cached,
+    // or -1 if failed to restore, in which case the sequence is cleaned.
+    inline int32_t restore_cache_prompt(const int32_t seq_id, const llama_tokens & tokens, const size_t n_cached) {
+        auto   state_it = cache_prompt_states.end();
+        size_t state_l  = n_cached;
+        for (auto it = cache_prompt_states.begin(); it != cache_prompt_states.end(); ++it) {
+            const size_t lcp_l = common_lcp(it->tokens, tokens);
+            if (lcp_l > state_l) {
+                state_it = it;
+                state_l  = lcp_l;
+            }
+        }
+        if (state_it == cache_prompt_states.end()) {
+            return 0;
+        }
+
+        // load the spilled state
+        if (!state_it->path.empty()) {
+            try {
+                std::ifstream ifs(state_it->path, std::ios::binary);
+                ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+                cache_prompt_state_file_header header;
+                ifs.read((char *) &header, sizeof(header));
+                const cache_prompt_state_file_header expected;
+                if (header.magic != expected.magic || header.version != expected.version ||
+                    header.identity != cache_prompt_states_identity || header.n_tokens != state_it->tokens.size() ||
+                    header.size != state_it->size || header.size_draft != state_it->size_draft) {
+                    throw std::runtime_error("mismatched header");
+                }
+                state_it->state.resize(state_it->size);
+                state_it->state_draft.resize(state_it->size_draft);
+                ifs.read((char *) state_it->state.data(), std::streamsize(state_it->size));
+                ifs.read((char *) state_it->state_draft.data(), std::streamsize(state_it->size_draft));
+            } catch (const std::exception & e) {
+                SRV_WRN("restore prompt cache, failed to read %s: %s\n", state_it->path.c_str(), e.what());
+                drop_cache_prompt_state(state_it);
+                return 0;
+            }
+        }
+
+        bool restored = llama_state_seq_set_data(llm_ctx, state_it->state.data(), state_it->size, seq_id) ==
+                        state_it->size;
+        if (restored && llm_ctx_draft != nullptr) {
+            restored = llama_state_seq_set_data(llm_ctx_draft, state_it->state_draft.data(), state_it->size_draft,
+                                                seq_id) == state_it->size_draft;
+        }
+        if (!restored) {
+            SRV_WRN("restore prompt cache, seq = %d, failed to set state\n", seq_id);
+            llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, -1, -1);
+            if (llm_ctx_draft != nullptr) {
+                llama_memory_seq_rm(llama_get_memory(llm_ctx_draft), seq_id, -1, -1);
+            }
+        }
+        // the restored state lives in the sequence now
+        drop_cache_prompt_state(state_it);
+        return restored ? int32_t(state_l) : -1;
+    }
+
+    struct slot_file_header {
+        uint32_t magic       = 0x4c425354;  // LBST
+        uint32_t version     = 1;
+        int32_t  n_tokens    = 0;
+        int32_t  pos         = 0;
+        int32_t  pos_discard = 0;
+        int32_t  reserved    = 0;
+        uint64_t size        = 0;  // size of the model state
+        uint64_t size_draft  = 0;  // size of the draft model state
+    };
+
+    // save_slot writes the tokens and the kv cache of the given unused sequence into a file within a single write.
+    inline httplib::StatusCode save_slot(const int32_t seq_id, const std::string & filename, json & result) {
+        const cache_prompt_entry & cache    = cache_prompts.at(seq_id);
+        const std::string          filepath = params.llm_params.slot_save_path + filename;
+        const int64_t              t_start  = ggml_time_us();
+
+        slot_file_header header;
+        header.n_tokens    = std::min(cache.pos, llama_pos(cache.tokens.size()));
+        header.pos         = cache.pos;
+        header.pos_discard = cache.pos_discard;
+        header.size        = llama_state_seq_get_size(llm_ctx, seq_id);
+        if (llm_ctx_draft != nullptr) {
+            header.size_draft = llama_state_seq_get_size(llm_ctx_draft, seq_id);
+        }
+
+        const size_t         size_tokens = header.n_tokens * sizeof(llama_token);
+        std::vector<uint8_t> buf(sizeof(header) + size_tokens + header.size + header.size_draft);
+        uint8_t *            ptr = buf.data();
+        memcpy(ptr, &header, sizeof(header));
+        ptr += sizeof(header);
+        memcpy(ptr, cache.tokens.data(), size_tokens);
+        ptr += size_tokens;
+        if (llama_state_seq_get_data(llm_ctx, ptr, header.size, seq_id) != header.size) {
+            result = { { "message", "failed to get the slot state" } };
+            return httplib::InternalServerError_500;
+        }
+        ptr += header.size;
+        if (llm_ctx_draft != nullptr &&
+            llama_state_seq_get_data(llm_ctx_draft, ptr, header.size_draft, seq_id) != header.size_draft) {
+            result = { { "message", "failed to get the slot draft state" } };
+            return httplib::InternalServerError_500;
+        }
+        try {
+            std::ofstream ofs(filepath, std::ios::binary | std::ios::trunc);
+            ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+            ofs.write((const char *) buf.data(), std::streamsize(buf.size()));
+        } catch (const std::exception & e) {
+            result = { { "message", "failed to write the slot file: " + std::string(e.what()) } };
+            return httplib::InternalServerError_500;
+        }
+
+        result = {
+            { "id_slot",   seq_id                                                    },
+            { "filename",  filename                                                  },
+            { "n_saved",   header.n_tokens                                           },
+            { "n_written", buf.size()                                                },
+            { "timings",   { { "save_ms", double(ggml_time_us() - t_start) / 1.e3 } } },
+        };
+        return httplib::OK_200;
+    }
+
+    // restore_slot maps the given file and restores the tokens and the kv cache into the given unused sequence,
+    // the overwritten prompt cache is stashed if possible.
+    inline httplib::StatusCode restore_slot(const int32_t seq_id, const std::string & filename, json & result) {
+        cache_prompt_entry & cache    = cache_prompts.at(seq_id);
+        const std::string    filepath = params.llm_params.slot_save_path + filename;
+        const int64_t        t_start  = ggml_time_us();
+
+        const mmap_file file(filepath);
+        if (!file.valid()) {
+            result = { { "message", "failed to map the slot file" } };
+            return httplib::NotFound_404;
+        }
+        slot_file_header header;
+        if (file.size < sizeof(header)) {
+            result = { { "message", "invalid slot file" } };
+            return httplib::BadRequest_400;
+        }
+        memcpy(&header, file.data(), sizeof(header));
+        const slot_file_header expected;
+        const size_t           size_tokens = size_t(std::max(header.n_tokens, 0)) * sizeof(llama_token);
+        if (header.magic != expected.magic || header.version != expected.version || header.n_tokens < 0 ||
+            file.size != sizeof(header) + size_tokens + header.size + header.size_draft) {
+            result = { { "message", "invalid slot file" } };
+            return httplib::BadRequest_400;
+        }
+        if ((llm_ctx_draft != nullptr) != (header.size_draft > 0)) {
+            result = { { "message", "incompatible slot file, the draft model state is mismatched" } };
+            return httplib::BadRequest_400;
+        }
+        if (header.pos < 0 || header.pos > llm_slot_ctx_size || header.pos_discard < 0) {
+            result = { { "message", "incompatible slot file, the position is out of the slot context" } };
+            return httplib::BadRequest_400;
+        }
+
+        // release the current prompt cache
+        stash_cache_prompt(seq_id);
+        llm_kv_cache_used -= cache.pos;
+        llm_kv_cache_inactive -= cache.pos;
+        cache.tokens.clear();
+        cache_prompt_tree.erase(seq_id);
+        cache.pos         = 0;
+        cache.pos_discard = 0;
+
+        const uint8_t * ptr    = file.data() + sizeof(header);
+        const auto *    tokens = (const llama_token *) ptr;
+        ptr += size_tokens;
+        bool restored = llama_state_seq_set_data(llm_ctx, ptr, header.size, seq_id) == header.size;
+        ptr += header.size;
+        if (restored && llm_ctx_draft != nullptr) {
+            restored = llama_state_seq_set_data(llm_ctx_draft, ptr, header.size_draft, seq_id) == header.size_draft;
+        }
+        // the recorded position must continue the restored kv cache, which the following decoding appends to
+        if (restored && header.pos != llama_memory_seq_pos_max(llama_get_memory(llm_ctx), seq_id) + 1) {
+            restored = false;
+        }
+        if (!restored) {
+            llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, -1, -1);
+            if (llm_ctx_draft != nullptr) {
+                llama_memory_seq_rm(llama_get_memory(llm_ctx_draft), seq_id, -1, -1);
+            }
+            result = { { "message", "failed to set the slot state, the slot file may not match the model" } };
+            return httplib::BadRequest_400;
+        }
+
+        cache.tokens.assign(tokens, tokens + header.n_tokens);
+        cache.pos         = header.pos;
+        cache.pos_discard = header.pos_discard;
+        llm_kv_cache_used += cache.pos;
+        llm_kv_cache_inactive += cache.pos;
+        cache_prompt_tree.insert(seq_id, cache.tokens,
+                                 cache.pos_discard > 0 ? std::min(params.llm_params.n_keep + 1, cache.pos) :
+                                                         cache.pos);
+
+        result = {
+            { "id_slot",    seq_id                                                       },
+            { "filename",   filename                                                     },
+            { "n_restored", header.n_tokens                                              },
+            { "n_read",     file.size                                                    },
+            { "timings",    { { "restore_ms", double(ggml_time_us() - t_start) / 1.e3 } } },
+        };
+        return httplib::OK_200;
+    }
+
+    // erase_slot drops the tokens and the kv cache of the given unused sequence.
+    inline httplib::StatusCode erase_slot(const int32_t seq_id, json & result) {
+        cache_prompt_entry & cache    = cache_prompts.at(seq_id);
+        const llama_pos      n_erased = cache.pos;
+
+        llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, -1, -1);
+        if (llm_ctx_draft != nullptr) {
+            llama_memory_seq_rm(llama_get_memory(llm_ctx_draft), seq_id, -1, -1);
+        }
+        llm_kv_cache_used -= cache.pos;
+        llm_kv_cache_inactive -= cache.pos;
+        cache.tokens.clear();
+        cache_prompt_tree.erase(seq_id);
+        cache.pos         = 0;
+        cache.pos_discard = 0;
+
+        result = {
+            { "id_slot",  seq_id   },
+            { "n_erased", n_erased },
+        };
+        return httplib::OK_200;
+    }
+
+    inline void process_slots_task(std::unique_ptr<btask> && task_ptr) {
+        auto *            task = static_cast<slots_task *>(task_ptr.get());
+        const std::string rid  = task->get_r_id();
+        const slots_req * req  = task->req.get();
+
+        httplib::StatusCode status = httplib::OK_200;
+        json                result;
+        if (req->action == "list") {
+            result = json::array();
+            for (int32_t i = 0; i < params.n_slots; i++) {
+                const cache_prompt_entry & cache = cache_prompts.at(i);
+                result.push_back({
+                    { "id",          i                 },
+                    { "used",        cache.used        },
+                    { "n_ctx",       llm_slot_ctx_size },
+                    { "n_tokens",    cache.pos         },
+                    { "n_discarded", cache.pos_discard },
+                });
+            }
+        } else if (cache_prompts.at(req->id_slot).used) {
+            status = httplib::Conflict_409;
+            result = { { "message", "slot is processing a request, try again later" } };
+        } else if (req->action == "save") {
+            status = save_slot(req->id_slot, req->filename, result);
+        } else if (req->action == "restore") {
+            status = restore_slot(req->id_slot, req->filename, result);
+        } else {
+            status = erase_slot(req->id_slot, result);
+        }
+        SRV_INFV(2, "rid %s | slots, action = %s, id_slot = %d, status = %d\n", rid.c_str(), req->action.c_str(),
+                 req->id_slot, status);
+
+        task->results->enqueue(std::make_unique<btask_result>(std::move(status), std::move(result)));
+    }
+
+    static inline int32_t get_batch_task_priority(const std::unique_ptr<btask> & task_ptr) {
+        // priorities:
+        // 0 decoding completions,
+        // 1 others.
+        if (task_ptr->get_type() != TASK_COMPLETIONS) {
+            return 1;
+        }
+        const auto * task = static_cast<const completions_task *>(task_ptr.get());
+        return task->n_decoded > 0 ? 0 : 1;
     }
 
     inline int32_t decode_completion_task_batch(llama_context * input_ctx, llama_batch & input_batch,
@@ -3595,7 +4908,7 @@ struct httpserver {
                 completions_task * task       = nullptr;
                 int32_t            target_pos = -1;
                 for (const std::unique_ptr<btask> & task_ptr : batch_task_ptrs) {
-                    auto * candidate = dynamic_cast<completions_task *>(task_ptr.get());
+                    auto * candidate = static_cast<completions_task *>(task_ptr.get());
                     if (candidate->n_decoded > 0 && candidate->pos > target_pos) {
                         task       = candidate;
                         target_pos = candidate->pos;
@@ -3622,185 +4935,1369 @@ struct httpserver {
         return decoded;
     }
 
-    //
-    // Logics
-    //
-#if defined(linux) || defined(__linux) || defined(__linux__)
-#    define PIN_THREAD                                                        \
-        cpu_set_t cpu_mask;                                                   \
-        CPU_ZERO(&cpu_mask);                                                  \
-        CPU_SET(sched_getcpu(), &cpu_mask);                                   \
-        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_mask); \
-        sched_param cpu_sched_param{ 80 };                                    \
-        pthread_setschedparam(pthread_self(), SCHED_FIFO, &cpu_sched_param);
-#else
-#    define PIN_THREAD
-#endif
-
-    void reconcile_loop(const std::shared_ptr<httplib::Server> & server) {
-        PIN_THREAD;
+    // acquire_slot returns a free slot for the arriving task, or -1 if all the slots are held,
+    // with prompt caching, the prefix matching decides the slot later, only the availability is checked here.
+    inline int32_t acquire_slot() {
+        for (int32_t i = 0; i < params.n_slots; i++) {
+            if (cache_prompt ? cache_prompts.at(i).used : (slots_busy >> i & 1) != 0) {
+                continue;
+            }
+            slots_busy |= uint64_t(1) << i;
+            return i;
+        }
+        return -1;
+    }
 
-        while (server->is_running()) {
-            reconcile();
+    // release_slot gives back the slot taken by acquire_slot for a task which does not keep its prompt cached.
+    inline void release_slot(const int32_t seq_id) {
+        if (cache_prompt) {
+            cache_prompts.at(seq_id).used = false;
         }
+        slots_busy &= ~(uint64_t(1) << seq_id);
     }
 
-    void reconcile() {
-        // dequeue tasks
-        std::vector<std::unique_ptr<btask>> task_ptrs;
-        task_ptrs.resize(params.llm_params.n_threads_http);
-        size_t n_dequeue_tasks =
-            process_tasks->wait_dequeue_bulk_timed(task_ptrs.data(), params.llm_params.n_threads_http, 3000000);
-        if (n_dequeue_tasks == 0) {
-            return;
+    // stage_tasks takes the arrived tasks while the batch is decoding in flight,
+    // and prepares their prompts ahead, so that the next batching only needs to place them.
+    // it must not touch the contexts or the kv cache, which are in use by the decoding.
+    inline void stage_tasks() {
+        staged_task_ptrs.resize(params.llm_params.n_threads_http);
+        const size_t n_staged = process_tasks->try_dequeue_bulk(staged_task_ptrs.data(), staged_task_ptrs.size());
+        staged_task_ptrs.resize(n_staged);
+        for (const std::unique_ptr<btask> & task_ptr : staged_task_ptrs) {
+            if (task_ptr->get_type() != TASK_COMPLETIONS) {
+                continue;
+            }
+            auto * task = static_cast<completions_task *>(task_ptr.get());
+            if (cache_prompt && task->n_prefilled == 0 && task->staged_prompt_tokens.empty()) {
+                task->stage();
+            }
         }
+    }
 
-        // batch tasks
-        task_type                           batch_task_type    = TASK_UNKNOWN;
-        process_type                        batch_process_type = PROCESS_UNKNOWN;
-        std::vector<std::unique_ptr<btask>> batch_task_ptrs;
-        batch_task_ptrs.reserve(n_dequeue_tasks);
-        for (auto & task_ptr : task_ptrs) {
-            if (task_ptr == nullptr) {
-                break;
+    // get_draft_branch_seq_id returns the sequence of the given drafted branch(> 0) forked from the slot sequence.
+    inline llama_seq_id get_draft_branch_seq_id(llama_seq_id seq_id, int32_t branch) const {
+        return params.n_slots + seq_id * (params.draft_branches - 1) + branch - 1;
+    }
+
+    // plan_draft_length returns how many tokens the given task should draft in this round,
+    // it maximizes the expected accepted tokens per decoding time charged to the task,
+    // (1 - a^(k+1)) / (1 - a) / (T(N) / N + b * k + (k+1) * D(M) / M),
+    // where a is the running acceptance rate of the task, T(N) / N is the share of the task in a step of N tokens,
+    // b is the marginal cost of one more token in the step, and D(M) / M is the share in a draft depth of M tasks,
+    // returns 0 if plain decoding is faster, but probes periodically to refresh the rate.
+    inline int32_t plan_draft_length(const completions_task * task, int32_t n_batch, int32_t n_drafting) const {
+        const int32_t n_max = params.llm_params.speculative.n_max;
+        if (!decode_cost_llm.ready() || (llm_ctx_draft != nullptr && !decode_cost_draft.ready())) {
+            return n_max;
+        }
+
+        double a = task->p_drafted_ema < 0 ? double(params.llm_params.speculative.p_min) : task->p_drafted_ema;
+        a        = std::clamp(a, 0.0, 0.99);
+
+        n_batch          = std::max(1, n_batch);
+        n_drafting       = std::max(1, n_drafting);
+        const double t_s = decode_cost_llm.estimate(n_batch) / n_batch;
+        const double t_b = decode_cost_llm.marginal();
+        const double t_d = llm_ctx_draft != nullptr ? decode_cost_draft.estimate(n_drafting) / n_drafting : 0.0;
+
+        int32_t k_best  = 0;
+        double  tp_best = 1.0 / std::max(1.e-3, t_s);
+        double  a_k     = 1.0;
+        double  e_k     = 1.0;
+        for (int32_t k = 1; k <= n_max; k++) {
+            a_k *= a;
+            e_k += a_k;
+            const double tp = e_k / (t_s + t_b * k + (k + 1) * t_d);
+            if (tp > tp_best) {
+                k_best  = k;
+                tp_best = tp;
             }
+        }
+        if (k_best == 0 && task->n_decoded % 16 == 0) {
+            k_best = std::max(1, params.llm_params.speculative.n_min);
+        }
+        return k_best;
+    }
 
-            const int32_t     tid   = task_ptr->get_id();
-            const task_type   ttype = task_ptr->get_type();
-            const std::string rid   = task_ptr->get_r_id();
-            const req_type    rtype = task_ptr->get_r_type();
+    // draft_completion_task_batch drafts the tokens of the given tasks in lockstep with the draft model,
+    // each depth decodes the last drafted token of all the active tasks within a single decode,
+    // the task drops out once the drafted token is not confident enough, or reaches the end of generation.
+    // with tree speculative decoding, the first depth forks into several branches from the top candidates,
+    // and each branch drafts in its own sequence.
+    inline void draft_completion_task_batch(const std::vector<std::unique_ptr<btask>> & task_ptrs) {
+        struct drafting {
+            completions_task * task    = nullptr;
+            int32_t            i_logit = 0;  // index of the logits within the draft batch
+            int32_t            branch  = 0;  // index of the drafted branch, 0 means the drafted tokens
+        };
 
-            // filter
-            if (batch_task_type == TASK_UNKNOWN) {
-                batch_task_type = ttype;
+        const float p_min = params.llm_params.speculative.p_min;
+
+        std::vector<drafting> active;
+        std::vector<drafting> next;
+        active.reserve(task_ptrs.size() * params.draft_branches);
+        next.reserve(task_ptrs.size() * params.draft_branches);
+
+        // clean batch for later adding
+        common_batch_clear(batch_text_draft);
+        for (const auto & task_ptr : task_ptrs) {
+            auto *             task   = static_cast<completions_task *>(task_ptr.get());
+            const llama_seq_id seq_id = task->get_seq_id();
+            // catch up the tokens which were not decoded by the draft model while the task stopped drafting
+            const auto         n_tokens = int32_t(task->processed_tokens.size());
+            const llama_pos    pos_max  = llama_memory_seq_pos_max(llama_get_memory(llm_ctx_draft), seq_id);
+            for (llama_pos pos = std::max(pos_max + 1, task->pos - n_tokens + 1); pos < task->pos; pos++) {
+                common_batch_add(batch_text_draft, task->processed_tokens[n_tokens - 1 - (task->pos - pos)], pos,
+                                 { seq_id }, false);
+            }
+            active.push_back({ task, batch_text_draft.n_tokens, 0 });
+            common_batch_add(batch_text_draft, task->processed_tokens.back(), task->pos, { seq_id }, true);
+        }
 
-                //// completions or embeddings
-                if (batch_task_type != TASK_IMAGES) {
-                    // set batch task type
-                    llama_set_embeddings(llm_ctx, batch_task_type == TASK_EMBEDDINGS);
-                    // apply lora adapters, only need to do it once per batch
-                    if (!equal_lora(task_ptr->get_lora_adapters(), lora_adapters)) {
-                        lora_adapters = task_ptr->get_lora_adapters();  // copy
-                        try {
-                            common_set_adapter_lora(llm_ctx, lora_adapters);
-                        } catch (const std::exception & e) {
-                            SRV_ERR("rid %s | batching, failed to apply lora %s\n", rid.c_str(), e.what());
+        for (int32_t depth = 0; batch_text_draft.n_tokens > 0; depth++) {
+            const int64_t t_start_draft = ggml_time_us();
+            const int32_t decoded_draft = llama_decode(llm_ctx_draft, batch_text_draft);
+            if (decoded_draft != 0) {
+                SRV_WRN("decode draft in lockstep, failed to decode, depth = %d, result = %d\n", depth, decoded_draft);
+                break;
+            }
+            llama_synchronize(llm_ctx_draft);
+            decode_cost_draft.observe(batch_text_draft.n_tokens, double(ggml_time_us() - t_start_draft) / 1.e3);
+            if (active.empty()) {
+                break;
+            }
+            // clean batch for later adding
+            common_batch_clear(batch_text_draft);
+            next.clear();
+            for (const drafting & d : active) {
+                completions_task *             task   = d.task;
+                const llama_seq_id             seq_id = task->get_seq_id();
+                const llama_token              tok    = common_sampler_sample2(task->sampler_draft, llm_ctx_draft,
+                                                                               d.i_logit);
+                const llama_token_data_array * cur_p  = common_sampler_get_candidates(task->sampler_draft);
+                // fork, take the top candidates as the roots of the branches,
+                // until the branches are confident enough together
+                if (depth == 0 && params.draft_branches > 1) {
+                    llama_tokens roots;
+                    float        p_sum = 0.0f;
+                    for (size_t i = 0; i < cur_p->size && int32_t(roots.size()) < params.draft_branches; i++) {
+                        if (llama_vocab_is_eog(llm_vocab_draft, cur_p->data[i].id)) {
+                            continue;
+                        }
+                        roots.push_back(cur_p->data[i].id);
+                        p_sum += cur_p->data[i].p;
+                        if (p_sum >= p_min) {
+                            break;
                         }
                     }
-                    // clean batch for later adding
-                    common_batch_clear(batch_text);
-                    if (llm_ctx_draft != nullptr) {
-                        common_batch_clear(batch_text_draft);
+                    if (p_sum < p_min) {
+                        continue;
                     }
+                    common_sampler_accept(task->sampler_draft, roots[0], true);
+                    for (int32_t branch = 0, n_roots = int32_t(roots.size()); branch < n_roots; branch++) {
+                        llama_seq_id branch_seq = seq_id;
+                        if (branch == 0) {
+                            task->drafted_tokens.push_back(roots[branch]);
+                        } else {
+                            task->drafted_branches.push_back({ roots[branch] });
+                            branch_seq = get_draft_branch_seq_id(seq_id, branch);
+                            llama_memory_seq_rm(llama_get_memory(llm_ctx_draft), branch_seq, -1, -1);
+                            llama_memory_seq_cp(llama_get_memory(llm_ctx_draft), seq_id, branch_seq, -1, -1);
+                        }
+                        task->n_drafted++;
+                        const bool more = task->n_draft_limit > 1;
+                        if (more) {
+                            next.push_back({ task, batch_text_draft.n_tokens, branch });
+                        }
+                        common_batch_add(batch_text_draft, roots[branch], task->pos + 1, { branch_seq }, more);
+                    }
+                    continue;
                 }
-
-                //// images
-                else {
-                    // apply lora adapters, only need to do it once per batch
-                    if (!equal_lora(task_ptr->get_lora_adapters(), lora_adapters)) {
-                        lora_adapters = task_ptr->get_lora_adapters();  // copy
-                        try {
-                            sd_ctx->apply_lora_adapters(lora_adapters);
-                        } catch (const std::exception & e) {
-                            SRV_ERR("rid %s | batching, failed to apply lora %s\n", rid.c_str(), e.what());
+                if (cur_p->data[0].p < p_min) {
+                    continue;
+                }
+                task->n_drafted++;
+                if (llama_vocab_is_eog(llm_vocab_draft, tok)) {
+                    continue;
+                }
+                llama_tokens & drafted    = d.branch == 0 ? task->drafted_tokens : task->drafted_branches[d.branch - 1];
+                llama_seq_id   branch_seq = d.branch == 0 ? seq_id : get_draft_branch_seq_id(seq_id, d.branch);
+                drafted.push_back(tok);
+                if (d.branch == 0) {
+                    common_sampler_accept(task->sampler_draft, tok, true);
+                }
+                // the branches are verified by matching the sampled tokens, which doesn't need the distribution
+                if (params.draft_branches == 1) {
+                    std::vector<llama_token_data> probs;
+                    probs.reserve(cur_p->size);
+                    for (size_t i = 0; i < cur_p->size; i++) {
+                        if (cur_p->data[i].p > 0.0f) {
+                            probs.push_back(cur_p->data[i]);
                         }
                     }
+                    task->drafted_probs.push_back(std::move(probs));
                 }
-            } else if (batch_task_type != ttype) {
-                SRV_DBG(
-                    "rid %s | "
-                    "batching, waiting previous batch finished: not the same kind batch\n",
-                    rid.c_str());
-                process_tasks->enqueue(std::move(task_ptr));
-                continue;
-            } else if (!equal_lora(task_ptr->get_lora_adapters(), lora_adapters)) {
-                SRV_DBG(
-                    "rid %s | "
-                    "batching, waiting previous batch finished: lora adapters not matched\n",
-                    rid.c_str());
-                process_tasks->enqueue(std::move(task_ptr));
-                continue;
+                // decode the last drafted token without sampling,
+                // so that the draft kv cache keeps the same as the model kv cache after accepting
+                const auto n_drafted = int32_t(drafted.size());
+                const bool more      = n_drafted < task->n_draft_limit;
+                if (more) {
+                    next.push_back({ task, batch_text_draft.n_tokens, d.branch });
+                }
+                common_batch_add(batch_text_draft, tok, task->pos + n_drafted, { branch_seq }, more);
             }
+            active.swap(next);
+        }
 
-            // batch
-            int32_t seq_id = task_ptr->get_seq_id();
+        // ignore if less than n_min
+        for (const auto & task_ptr : task_ptrs) {
+            auto * task      = static_cast<completions_task *>(task_ptr.get());
+            auto   n_drafted = int32_t(task->drafted_tokens.size());
+            for (const llama_tokens & branch : task->drafted_branches) {
+                n_drafted = std::max(n_drafted, int32_t(branch.size()));
+            }
+            if (n_drafted < params.llm_params.speculative.n_min) {
+                task->drafted_tokens.clear();
+                task->drafted_probs.clear();
+                task->drafted_branches.clear();
+            }
+        }
+    }
 
-            if (batch_task_type != TASK_IMAGES) {
-                /**
-                 * completions
-                 */
+    // verify_drafted_token verifies the j-th drafted token of the given task in speculative sampling,
+    // the drafted token is accepted with probability min(1, p_target/p_draft),
+    // otherwise, a token is resampled from the residual distribution max(0, p_target - p_draft),
+    // so that the output keeps the same distribution as the target model sampling.
+    // the sampler of the task must have sampled at the drafted position, the sampled token is used as fallback.
+    inline llama_token verify_drafted_token(completions_task * task, int32_t j, llama_token sampled) {
+        const llama_token              drafted = task->drafted_tokens[j];
+        const llama_token_data_array * cur_p   = common_sampler_get_candidates(task->sampler);
 
-                if (batch_task_type == TASK_COMPLETIONS) {
-                    auto * task = dynamic_cast<completions_task *>(task_ptr.get());
-                    if (task->processed_tokens.capacity() == 0) {
-                        task->processed_tokens.reserve(task->n_decoding_budget >= INT32_MAX ?
-                                                           task->n_prefilling_request :
-                                                           task->n_decoding_budget);
+        // the distribution of the lookup drafted token is deterministic
+        const std::vector<llama_token_data> * q = j < int32_t(task->drafted_probs.size()) ? &task->drafted_probs[j] :
+                                                                                            nullptr;
+        auto p_draft = [&](llama_token id) -> float {
+            if (q == nullptr) {
+                return id == drafted ? 1.0f : 0.0f;
+            }
+            for (const llama_token_data & d : *q) {
+                if (d.id == id) {
+                    return d.p;
+                }
+            }
+            return 0.0f;
+        };
+
+        float p_target = 0.0f;
+        for (size_t i = 0; i < cur_p->size; i++) {
+            if (cur_p->data[i].id == drafted) {
+                p_target = cur_p->data[i].p;
+                break;
+            }
+        }
+
+        // accept
+        std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+        const float                           pd = p_draft(drafted);
+        if (p_target > 0.0f && (pd <= 0.0f || uniform(task->rng_verify) * pd < p_target)) {
+            return drafted;
+        }
+
+        // reject, resample from the residual distribution
+        std::vector<float> residual(cur_p->size);
+        float              sum = 0.0f;
+        for (size_t i = 0; i < cur_p->size; i++) {
+            const llama_token_data & t = cur_p->data[i];
+            if (t.p <= 0.0f || t.id == drafted) {
+                continue;
+            }
+            residual[i] = std::max(0.0f, t.p - p_draft(t.id));
+            sum += residual[i];
+        }
+        if (sum <= 0.0f) {
+            return sampled;
+        }
+        float r = uniform(task->rng_verify) * sum;
+        for (size_t i = 0; i < cur_p->size; i++) {
+            if (residual[i] <= 0.0f) {
+                continue;
+            }
+            r -= residual[i];
+            if (r <= 0.0f) {
+                return cur_p->data[i].id;
+            }
+        }
+        return sampled;
+    }
+
+    // load_lookup_cache maps the given file saved by common_ngram_cache_save, and loads it into the given cache.
+    static bool load_lookup_cache(const std::string & path, common_ngram_cache & cache) {
+        const mmap_file file(path);
+        if (!file.valid()) {
+            return false;
+        }
+        const uint8_t * ptr = file.data();
+        const uint8_t * end = ptr + file.size;
+        while (ptr < end) {
+            common_ngram ngram;
+            int32_t      n_tokens = 0;
+            if (size_t(end - ptr) < sizeof(common_ngram) + sizeof(int32_t)) {
+                return false;
+            }
+            memcpy(&ngram, ptr, sizeof(common_ngram));
+            ptr += sizeof(common_ngram);
+            memcpy(&n_tokens, ptr, sizeof(int32_t));
+            ptr += sizeof(int32_t);
+            if (n_tokens <= 0 || size_t(end - ptr) < size_t(n_tokens) * (sizeof(llama_token) + sizeof(int32_t))) {
+                return false;
+            }
+            common_ngram_cache_part & part = cache[ngram];
+            for (int32_t i = 0; i < n_tokens; i++) {
+                llama_token token = LLAMA_TOKEN_NULL;
+                int32_t     count = 0;
+                memcpy(&token, ptr, sizeof(llama_token));
+                ptr += sizeof(llama_token);
+                memcpy(&count, ptr, sizeof(int32_t));
+                ptr += sizeof(int32_t);
+                part[token] += count;
+            }
+        }
+        return true;
+    }
+
+    // the approximate sizes of an n-gram and a token in the lookup cache, including the hash node overheads.
+    static constexpr size_t lookup_ngram_size =
+        sizeof(common_ngram) + sizeof(common_ngram_cache_part) + 2 * sizeof(void *);
+    static constexpr size_t lookup_token_size = sizeof(llama_token) + sizeof(int32_t) + 2 * sizeof(void *);
+
+    // merge_lookup_cache learns the n-grams of the finished task into the dynamic lookup cache,
+    // it accounts the size of the new entries, and prunes the cache if exceeding,
+    // NB(thxCode): it runs on the lookup cache workers, which own the dynamic lookup cache after loading.
+    inline void merge_lookup_cache(const common_ngram_cache & ngram_cache) {
+        for (const auto & [ngram, part] : ngram_cache) {
+            auto [hit, inserted] = lookup_cache_dynamic.try_emplace(ngram);
+            if (inserted) {
+                lookup_cache_dynamic_size += lookup_ngram_size;
+            }
+            for (const auto & [token, count] : part) {
+                auto [pos, added] = hit->second.try_emplace(token, 0);
+                pos->second += count;
+                if (added) {
+                    lookup_cache_dynamic_size += lookup_token_size;
+                }
+            }
+        }
+        lookup_cache_dynamic_dirty = true;
+        prune_lookup_cache();
+    }
+
+    // prune_lookup_cache drops the least frequent n-grams of the dynamic lookup cache if exceeding the budget,
+    // it shrinks to 3/4 of the budget, so that the pruning does not happen after every finished task.
+    inline void prune_lookup_cache() {
+        const size_t budget = size_t(params.lookup_cache_ram) << 20;
+        if (budget == 0 || lookup_cache_dynamic_size <= budget) {
+            return;
+        }
+
+        const int64_t t_start  = ggml_time_us();
+        const size_t  n_ngrams = lookup_cache_dynamic.size();
+
+        // order by the total count of the following tokens, the least frequent first
+        std::vector<std::pair<int64_t, common_ngram_cache::iterator>> ngrams;
+        ngrams.reserve(n_ngrams);
+        for (auto it = lookup_cache_dynamic.begin(); it != lookup_cache_dynamic.end(); ++it) {
+            int64_t total = 0;
+            for (const auto & [token, count] : it->second) {
+                total += count;
+            }
+            ngrams.emplace_back(total, it);
+        }
+        std::sort(ngrams.begin(), ngrams.end(), [](const auto & a, const auto & b) { return a.first < b.first; });
+
+        for (const auto & [total, it] : ngrams) {
+            if (lookup_cache_dynamic_size <= budget / 4 * 3) {
+                break;
+            }
+            lookup_cache_dynamic_size -= lookup_ngram_size + it->second.size() * lookup_token_size;
+            lookup_cache_dynamic.erase(it);
+        }
+        SRV_INFV(2, "pruned dynamic lookup cache, n_ngrams = %zu -> %zu, elapsed = %.2fms\n", n_ngrams,
+                 lookup_cache_dynamic.size(), double(ggml_time_us() - t_start) / 1.e3);
+    }
+
+    // save_lookup_cache saves the given dynamic lookup cache,
+    // it writes into a temporary file first, then renames it, so that the previous one keeps valid during writing,
+    // NB(thxCode): it runs on the lookup cache workers, or after they are shut down.
+    inline void save_lookup_cache(const common_ngram_cache & cache) {
+        const int64_t     t_start = ggml_time_us();
+        const std::string path    = params.lookup_cache_dynamic + ".tmp";
+        std::error_code   ec;
+        {
+            // NB(thxCode): write in the format of common_ngram_cache_save, which does not report the writing failures,
+            // so that a short writing never replaces the previous one.
+            std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+            for (const auto & [ngram, part] : cache) {
+                const auto n_tokens = int32_t(part.size());
+                if (n_tokens == 0) {
+                    continue;
+                }
+                ofs.write((const char *) &ngram, sizeof(common_ngram));
+                ofs.write((const char *) &n_tokens, sizeof(int32_t));
+                for (const auto & [token, count] : part) {
+                    ofs.write((const char *) &token, sizeof(llama_token));
+                    ofs.write((const char *) &count, sizeof(int32_t));
+                }
+            }
+            ofs.flush();
+            if (!ofs.good()) {
+                ec = std::make_error_code(std::errc::io_error);
+            }
+        }
+        if (!ec) {
+            std::filesystem::rename(path, params.lookup_cache_dynamic, ec);
+        }
+        if (ec) {
+            lookup_cache_dynamic_dirty = true;
+            SRV_WRN("failed to save dynamic lookup cache: %s, %s\n", params.lookup_cache_dynamic.c_str(),
+                    ec.message().c_str());
+            std::filesystem::remove(path, ec);
+            return;
+        }
+        SRV_INFV(2, "saved dynamic lookup cache, n_ngrams = %zu, elapsed = %.2fms\n", cache.size(),
+                 double(ggml_time_us() - t_start) / 1.e3);
+    }
+
+    // learn_lookup_cache hands the n-grams of the finished task over to the lookup cache workers,
+    // which merge them into the dynamic lookup cache, publish a copy for drafting and save it periodically,
+    // so that the reconcile thread never walks or copies the whole cache.
+    // the copy is published once the workers catch up, or at least once per second under pressure,
+    // and the cache is saved at most once per minute.
+    inline void learn_lookup_cache(common_ngram_cache && ngram_cache) {
+        auto learnt = std::make_shared<common_ngram_cache>(std::move(ngram_cache));
+        lookup_cache_dynamic_pending++;
+        lookup_cache_workers->enqueue([this, learnt]() {
+            merge_lookup_cache(*learnt);
+            const int64_t now = ggml_time_us();
+            if (--lookup_cache_dynamic_pending == 0 || now - lookup_cache_dynamic_published >= 1000000LL) {
+                lookup_cache_dynamic_published = now;
+                auto latest                    = std::make_shared<common_ngram_cache>(lookup_cache_dynamic);
+                std::lock_guard<std::mutex> lock(lookup_cache_dynamic_mtx);
+                lookup_cache_dynamic_latest.swap(latest);
+            }
+            if (!params.lookup_cache_dynamic.empty() && lookup_cache_dynamic_dirty &&
+                now - lookup_cache_dynamic_saved >= 60 * 1000000LL) {
+                // avoid retrying after every finished request even if failed
+                lookup_cache_dynamic_saved = now;
+                lookup_cache_dynamic_dirty = false;
+                save_lookup_cache(lookup_cache_dynamic);
+            }
+        });
+    }
+
+    // refresh_lookup_cache takes the latest copy of the dynamic lookup cache published by the workers for drafting,
+    // and retires the previous one on the workers, as freeing a large cache is not cheap either.
+    inline void refresh_lookup_cache() {
+        std::shared_ptr<common_ngram_cache> latest;
+        {
+            std::lock_guard<std::mutex> lock(lookup_cache_dynamic_mtx);
+            latest.swap(lookup_cache_dynamic_latest);
+        }
+        if (latest == nullptr) {
+            return;
+        }
+        std::shared_ptr<common_ngram_cache> retired = std::move(lookup_cache_dynamic_view);
+        lookup_cache_dynamic_view                   = std::move(latest);
+        lookup_cache_workers->enqueue([retired]() {});
+    }
+
+    // sample_completion_task samples the tokens of the given decoded task, verifies the drafted tokens if any,
+    // and postprocesses the generated text, returns true if the generated text can be sent.
+    // it only touches the states of the task and reads the resolved logits rows, indexed by the batch position,
+    // so that the tasks of a batch can be sampled concurrently,
+    // the kv cache of the rejected drafted tokens is cleaned by settle_completion_task later.
+    inline bool sample_completion_task(completions_task * task, const std::vector<const float *> & logits_rows) {
+        const std::string rid = task->get_r_id();
+
+        // sample token
+        const auto    n_drafted_step       = int32_t(task->drafted_tokens.size());
+        const int32_t n_drafted_accepted_s = task->n_drafted_accepted;
+        task->pos_verifying                = task->pos;
+        task->branch_verified              = -1;
+        //// default
+        if (task->drafted_tokens.empty()) {
+            const int32_t     tok_idx = task->i_batch_seq_end;
+            const llama_token tok     = common_sampler_sample2(task->sampler, llm_vocab, logits_rows[tok_idx]);
+            common_sampler_accept(task->sampler, tok, true);
+            task->push_generated_token(llm_vocab, logits_rows[tok_idx], tok);
+            task->n_decoded++;
+            task->n_decoding_budget--;
+        }
+        //// include drafted tree
+        else if (!task->drafted_branches.empty()) {
+            // follow the branch whose root matches the sampled token,
+            // then accept the drafted tokens of the branch until mismatching
+            const int32_t s        = int32_t(task->drafted_tokens.size());
+            const int32_t pos_root = task->pos - s - 1;
+            int32_t       b        = -1;  // index of the accepted branch
+            int32_t       j        = 0;   // number of the accepted tokens
+            int32_t       tok_idx  = task->i_batch_seq_end - s;
+            while (true) {
+                const llama_token tok = common_sampler_sample2(task->sampler, llm_vocab, logits_rows[tok_idx]);
+                common_sampler_accept(task->sampler, tok, true);
+                task->push_generated_token(llm_vocab, logits_rows[tok_idx], tok);
+                task->n_decoded++;
+                task->n_decoding_budget--;
+                if (j == 0) {
+                    if (tok == task->drafted_tokens[0]) {
+                        b = 0;
+                    } else {
+                        for (int32_t k = 0, n = int32_t(task->drafted_branches.size()); k < n; k++) {
+                            if (tok == task->drafted_branches[k][0]) {
+                                b = k + 1;
+                                break;
+                            }
+                        }
+                    }
+                }
+                if (b < 0) {
+                    break;
+                }
+                const llama_tokens & branch = b == 0 ? task->drafted_tokens : task->drafted_branches[b - 1];
+                if (j >= int32_t(branch.size()) || tok != branch[j]) {
+                    break;
+                }
+                task->n_drafted_accepted++;
+                tok_idx = (b == 0 ? task->i_batch_seq_end - s + 1 : task->i_batch_seq_branches[b - 1]) + j;
+                j++;
+            }
+            // keep the accepted path, the others are dropped by settle_completion_task
+            const int32_t pos = pos_root + 1 + j;
+            if (pos < task->pos) {
+                const int32_t d = task->pos - pos;
+                // stats drafted tokens size
+                task->n_decoded += d;
+                task->n_decoding_budget -= d;
+            }
+            task->branch_verified = b;
+            task->pos             = pos;
+        }
+        //// include drafted tokens
+        else {
+            // +1 for main model decoded token
+            for (int32_t j = 0, s = int32_t(task->drafted_tokens.size()); j < s + 1; ++j) {
+                const int32_t tok_idx = task->i_batch_seq_end - s + j;
+                llama_token   tok     = common_sampler_sample2(task->sampler, llm_vocab, logits_rows[tok_idx]);
+                if (j < s) {
+                    tok = verify_drafted_token(task, j, tok);
+                }
+                common_sampler_accept(task->sampler, tok, true);
+                task->push_generated_token(llm_vocab, logits_rows[tok_idx], tok);
+                task->n_decoded++;
+                task->n_decoding_budget--;
+                if (j < s) {
+                    if (tok != task->drafted_tokens[j]) {
+                        int32_t d = s - j;
+                        // back pos to the correct position
+                        task->pos -= d;
+                        // stats drafted tokens size
+                        task->n_decoded += d;
+                        task->n_decoding_budget -= d;
+                        break;
+                    }
+                    task->n_drafted_accepted++;
+                }
+            }
+        }
+        if (n_drafted_step > 0) {
+            task->on_drafted_verified(n_drafted_step, task->n_drafted_accepted - n_drafted_accepted_s);
+        }
+        // speculative - lookup
+        if (params.lookup_ngram_min > 0) {
+            if (task->ngram_cache_seeding.valid()) {
+                task->ngram_cache = task->ngram_cache_seeding.get();
+            }
+            common_ngram_cache_update(task->ngram_cache, params.lookup_ngram_min, LLAMA_NGRAM_MAX,
+                                      task->processed_tokens, 1, false);
+        }
+
+        // postprocess
+        bool          send_text            = false;
+        const int32_t n_generated_tokens_s = task->n_processed_detokenized;
+        const int32_t n_generated_tokens_e = int32_t(task->processed_tokens.size());
+        std::string   sampled_str;
+        for (; task->n_processed_detokenized < n_generated_tokens_e; task->n_processed_detokenized++) {
+            llama_token tok = task->processed_tokens[task->n_processed_detokenized];
+            // accept special token
+            bool        special =
+                params.llm_params.special || task->req->sampling.preserved_tokens.find(tok) !=
+                                                 task->req->sampling.preserved_tokens.end();
+            // has reasoning
+            if (support_reasoning && !task->reasoning_finished) {
+                // find reasoning begin [in token]
+                if (!task->reasoning_start_found) {
+                    if (reasoning_start_token != LLAMA_TOKEN_NULL) {
+                        task->reasoning_start_found = tok == reasoning_start_token;
+                        if (task->reasoning_start_found) {
+                            // ignore reasoning start content if needed
+                            if (!reasoning_in_content) {
+                                continue;
+                            }
+                        }
+                        // finish reasoning analysis as not found any available start
+                        else {
+                            task->reasoning_finished = true;
+                        }
+                    }
+                }
+                // find reasoning end [in token]
+                else if (!task->reasoning_end_found) {
+                    if (reasoning_end_token != LLAMA_TOKEN_NULL) {
+                        task->n_reasoning++;
+                        task->reasoning_end_found = tok == reasoning_end_token;
+                        if (task->reasoning_end_found) {
+                            // ignore reasoning end content if needed
+                            if (!reasoning_in_content) {
+                                continue;
+                            }
+                        }
+                    }
+                }
+                // finish
+                else if (!task->reasoning_finished) {
+                    task->reasoning_finished = true;
+                    // avoid to remember the thinking content
+                    if (!task->is_stream() && !reasoning_in_content) {
+                        task->generated_reasoning_text.swap(task->generated_text);
+                    } else {
+                        task->generated_text.clear();
+                    }
+                }
+            }
+            sampled_str += common_token_to_piece(llm_ctx, tok, special);
+        }
+        task->generated_text += sampled_str;
+        send_text = get_position_of_utf8(task->generated_text) == task->generated_text.size();
+        if (send_text && common_log_verbosity_thold > 5) {
+            SRV_DBG("rid %s | sampled str: %s\n", rid.c_str(), escape_string(sampled_str).c_str());
+        }
+        // check stop
+        //// check stop word or tool call
+        if (send_text) {
+            // has stop words
+            for (const std::string & word : task->req->stop) {
+                size_t pos =
+                    task->generated_text.find(word, task->generated_text.size() - sampled_str.size());
+                if (pos != std::string::npos) {
+                    SRV_DBG("rid %s | stopped by word\n", rid.c_str());
+                    task->generated_finish_reason = "stop";
+                    task->generated_text_keep_pos = pos;
+                    break;
+                }
+            }
+            // has reasoning
+            if (support_reasoning && !task->reasoning_finished &&
+                reasoning_start_token == LLAMA_TOKEN_NULL) {
+                // find reasoning begin [in word]
+                if (!task->reasoning_start_found) {
+                    send_text = false;  // avoid to send text before reasoning start
+                    task->reasoning_start_found =
+                        string_starts_with(task->generated_text, reasoning_start_word);
+                    if (task->reasoning_start_found) {
+                        send_text = true;
+                        task->n_reasoning++;
+                        // ignore reasoning start content if needed
+                        if (!reasoning_in_content) {
+                            task->generated_text.clear();
+                        }
+                    }
+                    // finish reasoning analysis as not found any available start
+                    else if (task->generated_text.length() > reasoning_start_word.length()) {
+                        task->reasoning_finished = true;
+                        send_text                = true;
+                    }
+                }
+                // find reasoning end [in word]
+                else if (!task->reasoning_end_found) {
+                    task->n_reasoning++;
+                    task->reasoning_end_found =
+                        string_ends_with(task->generated_text, reasoning_end_word);
+                    if (task->reasoning_end_found) {
+                        // ignore reasoning end content if needed
+                        if (!reasoning_in_content) {
+                            size_t pos = task->generated_text.rfind(reasoning_end_word);
+                            task->generated_text_keep_pos = pos;
+                            task->generated_text          = task->generated_text.erase(pos);
+                        }
+                    } else {
+                        send_text = reasoning_end_word.find(sampled_str) == std::string::npos;
+                    }
+                }
+            }
+            // find tool call
+            if (task->tokenized_prompts_include_tools && task->reasoning_finished) {
+                //// jinja
+                if (params.llm_params.use_jinja) {
+                    if (common_sampler_grammer_lazy_triggered(task->sampler)) {
+                        send_text                 = false;
+                        std::string functions_str = task->generated_text;
+                        if (!functions_str.empty()) {
+                            try {
+                                common_chat_msg msg = common_chat_parse(functions_str, false,
+                                                                        task->tokenized_prompts_syntax);
+                                if (!msg.tool_calls.empty()) {
+                                    for (const common_chat_tool_call & tc : msg.tool_calls) {
+                                        task->generated_tool_calls.push_back({
+                                            { "type",     "function"                                },
+                                            { "function",
+                                             { { "name", tc.name }, { "arguments", tc.arguments } } },
+                                            { "id",       tc.id.empty() ? gen_call_id() : tc.id     },
+                                        });
+                                    }
+                                    if (task->tool_call_stop_fast) {
+                                        SRV_DBG("rid %s | stopped by tool call\n", rid.c_str());
+                                        task->generated_finish_reason =
+                                            "tool_calls";  // send_text = true;
+                                    }
+                                    // eat the rest of the text
+                                    task->generated_text_keep_pos = std::string::npos;
+                                    task->generated_text.clear();
+                                }
+                            } catch (const std::exception & e) {
+                                task->generated_text_keep_pos = 0;
+                            }
+                        }
+                    }
+                }
+                //// non-jinja
+                else {
+                    ////// found tool call start
+                    if (!task->tool_call_start_found) {
+                        if (!tool_call_start_tokens.empty()) {
+                            // stop sending text if the start token found
+                            for (int32_t i = n_generated_tokens_s; i < n_generated_tokens_e; i++) {
+                                for (const llama_token & token : tool_call_start_tokens) {
+                                    if (task->processed_tokens[i] == token) {
+                                        task->tool_call_start_found = true;
+                                        if (!sampled_str.empty() && tool_call_start_trim) {
+                                            // trim the start word if needed
+                                            for (const std::string & sw : tool_call_start_words) {
+                                                if (size_t sp = task->generated_text.find(sw);
+                                                    sp != std::string::npos) {
+                                                    task->generated_text_keep_pos = sp;
+                                                    // trim the start word
+                                                    task->generated_text = task->generated_text.erase(
+                                                        sp, sp + sw.length());
+                                                }
+                                            }
+                                        }
+                                        break;
+                                    }
+                                }
+                                if (task->tool_call_start_found) {
+                                    break;
+                                }
+                            }
+                        } else if (!tool_call_start_words.empty()) {
+                            // stop sending text if the start word found
+                            if (task->generated_text.size() <= tool_call_start_words_longest_length) {
+                                send_text = false;
+                            } else {
+                                for (const std::string & sw : tool_call_start_words) {
+                                    if (size_t sp = task->generated_text.find(sw);
+                                        sp != std::string::npos) {
+                                        task->tool_call_start_found   = true;
+                                        task->generated_text_keep_pos = sp;
+                                        if (tool_call_start_trim) {
+                                            // trim the start word
+                                            task->generated_text =
+                                                task->generated_text.erase(sp, sp + sw.length());
+                                        }
+                                        break;
+                                    }
+                                }
+                            }
+                        }
                     }
+                    ////// found tool call end
+                    else {
+                        send_text = false;
+                        std::string functions_str;
+                        if (!tool_call_end_tokens.empty()) {
+                            for (int32_t i = n_generated_tokens_e - 1; i >= n_generated_tokens_s; --i) {
+                                for (const llama_token & token : tool_call_end_tokens) {
+                                    if (task->processed_tokens[i] == token) {
+                                        size_t sp     = task->generated_text_keep_pos;
+                                        sp            = sp == std::string::npos ? 0 : sp;
+                                        functions_str = task->generated_text.substr(sp);
+                                        break;
+                                    }
+                                }
+                                if (!functions_str.empty()) {
+                                    if (tool_call_end_trim) {
+                                        for (const std::string & ew : tool_call_end_words) {
+                                            if (size_t ep = functions_str.rfind(ew);
+                                                ep != std::string::npos) {
+                                                functions_str = functions_str.substr(0, ep);
+                                            }
+                                        }
+                                    }
+                                    break;
+                                }
+                            }
+                        } else if (!tool_call_end_words.empty()) {
+                            for (const std::string & ew : tool_call_end_words) {
+                                if (size_t ep = task->generated_text.rfind(ew);
+                                    ep != std::string::npos) {
+                                    if (!tool_call_end_trim) {
+                                        ep += ew.length();
+                                    }
+                                    size_t sp     = task->generated_text_keep_pos;
+                                    sp            = sp == std::string::npos ? 0 : sp;
+                                    functions_str = task->generated_text.substr(sp, ep);
+                                    break;
+                                }
+                            }
+                        }
+                        if (!functions_str.empty()) {
+                            try {
+                                auto append_tool_calls = [&](json & function) {
+                                    if (!function.is_object()) {
+                                        throw std::runtime_error("function is an object");
+                                    }
+                                    if (!function.contains("name")) {
+                                        throw std::runtime_error("function does not contain \"name\"");
+                                    }
+                                    if (!function.contains("arguments")) {
+                                        throw std::runtime_error(
+                                            "function does not contain \"arguments\"");
+                                    }
+                                    if (!function.at("arguments").is_string()) {
+                                        function["arguments"] =
+                                            function.at("arguments")
+                                                .dump(-1, ' ', false, json::error_handler_t::replace);
+                                    }
+                                    json tool_call = {
+                                        { "type",     "function"    },
+                                        { "function", function      },
+                                        { "id",       gen_call_id() },
+                                    };
+                                    task->generated_tool_calls.push_back(tool_call);
+                                };
+                                // json
+                                if (tool_call_format == "json") {
+                                    json functions = json::parse(functions_str);
+                                    if (functions.is_array()) {
+                                        for (auto & function : functions) {
+                                            append_tool_calls(function);
+                                        }
+                                    } else {
+                                        append_tool_calls(functions);
+                                    }
+                                }
+                                // function
+                                else {
+                                    const std::string name_s = "function";
+                                    const std::string func_s = "```json\n";
+                                    const std::string func_e = "```";
+                                    size_t            sp     = functions_str.find(name_s);
+                                    for (; sp != std::string::npos;) {
+                                        sp += name_s.length();
+                                        size_t ep = functions_str.find(func_s, sp);
+                                        if (ep == std::string::npos) {
+                                            break;  // incomplete
+                                        }
+                                        json fn{};
+                                        fn["name"] = functions_str.substr(sp, ep - sp - 1);
+                                        sp         = ep + func_s.length();
+                                        ep         = functions_str.find(func_e, sp);
+                                        if (ep == std::string::npos) {
+                                            break;  // incomplete
+                                        }
+                                        fn["arguments"] = functions_str.substr(sp, ep - sp - 1);
+                                        append_tool_calls(fn);
+                                        sp = ep + func_e.length();
+                                        sp = functions_str.find(name_s, sp);
+                                    }
+                                }
+                                if (!task->generated_tool_calls.empty()) {
+                                    if (task->tool_call_stop_fast) {
+                                        SRV_DBG("rid %s | stopped by tool call\n", rid.c_str());
+                                        task->generated_finish_reason =
+                                            "tool_calls";  // send_text = true;
+                                    }
+                                    // eat the rest of the text
+                                    task->generated_text_keep_pos = std::string::npos;
+                                    task->generated_text.clear();
+                                }
+                            } catch (const std::exception & e) {
+                                task->generated_text_keep_pos = 0;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        //// check eog or budget
+        if (task->generated_finish_reason.empty()) {
+            // end of generation
+            if (llama_vocab_is_eog(llm_vocab, task->processed_tokens.back())) {
+                if (task->generated_tool_calls.empty()) {
+                    SRV_DBG("rid %s | stopped by EOG\n", rid.c_str());
+                    task->generated_finish_reason = "stop";
+                } else {
+                    SRV_DBG("rid %s | stopped by tool call\n", rid.c_str());
+                    task->generated_finish_reason = "tool_calls";
+                }
+                task->generated_text_keep_pos = task->generated_text.size();
+            }
+            // no enough budget
+            else if (task->n_decoding_budget <= 0) {
+                SRV_DBG("rid %s | stopped by length\n", rid.c_str());
+                task->generated_finish_reason = "length";
+                task->generated_text_keep_pos = task->generated_text.size();
+            }
+        }
+
+        return send_text;
+    }
 
-                    // prefill first (n_prefilled < n_prefilling_request)
-                    if (batch_process_type == PROCESS_UNKNOWN && task->n_prefilled < task->n_prefilling_request) {
+    // settle_completion_task cleans the kv cache of the rejected drafted tokens after sampling the given task,
+    // with tree speculative decoding, it copies the accepted branch back to the slot sequence and drops the others.
+    inline void settle_completion_task(completions_task * task) {
+        const std::string  rid    = task->get_r_id();
+        const llama_seq_id seq_id = task->get_seq_id();
+
+        //// include drafted tree
+        if (!task->drafted_branches.empty()) {
+            const int32_t s        = int32_t(task->drafted_tokens.size());
+            const int32_t pos_root = task->pos_verifying - s - 1;
+            const int32_t b        = task->branch_verified;
+            const int32_t j        = task->pos - pos_root - 1;
+            for (llama_context * ctx : { llm_ctx, llm_ctx_draft }) {
+                llama_memory_t mem = llama_get_memory(ctx);
+                if (b > 0 && j > 0) {
+                    llama_memory_seq_rm(mem, seq_id, pos_root + 1, -1);
+                    llama_memory_seq_cp(mem, get_draft_branch_seq_id(seq_id, b), seq_id, pos_root + 1, task->pos);
+                } else {
+                    llama_memory_seq_rm(mem, seq_id, task->pos, -1);
+                }
+                for (int32_t k = 1, n = int32_t(task->drafted_branches.size()); k <= n; k++) {
+                    llama_memory_seq_rm(mem, get_draft_branch_seq_id(seq_id, k), -1, -1);
+                }
+            }
+            SRV_INFV(2,
+                     "rid %s | decode in tree, "
+                     "accepted branch %d, clean kv cache, seq %d = [%d, end)\n",
+                     rid.c_str(), b, seq_id, task->pos);
+            llm_kv_cache_used += task->pos - task->pos_verifying;
+        }
+        //// include drafted tokens
+        else if (task->pos < task->pos_verifying) {
+            // clean kv cache
+            llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, task->pos, -1);
+            if (llm_ctx_draft != nullptr) {
+                llama_memory_seq_rm(llama_get_memory(llm_ctx_draft), seq_id, task->pos, -1);
+            }
+            SRV_INFV(2,
+                     "rid %s | decode, "
+                     "clean kv cache, seq %d = [%d, end)\n",
+                     rid.c_str(), seq_id, task->pos);
+            llm_kv_cache_used -= task->pos_verifying - task->pos;
+        }
+    }
+
+    // sample_completion_task_batch samples the given decoded tasks,
+    // the tasks are spread over the sampling workers and the reconcile thread, and joined before returning,
+    // the i-th element of send_texts indicates whether the generated text of the i-th task can be sent.
+    inline void sample_completion_task_batch(const std::vector<completions_task *> & tasks,
+                                             std::vector<uint8_t> &                  send_texts) {
+        const size_t n_tasks = tasks.size();
+        send_texts.assign(n_tasks, 0);
+        if (n_tasks == 0) {
+            return;
+        }
+
+        // llama_get_logits_ith synchronizes and updates the context, which must not be called by the samplers,
+        // resolve the logits rows that the tasks may read here, then the samplers only read the rows
+        std::vector<const float *> & logits_rows = reconcile_sampling_logits_rows;
+        logits_rows.clear();
+        auto resolve = [&](int32_t idx) {
+            if (idx >= int32_t(logits_rows.size())) {
+                logits_rows.resize(idx + 1, nullptr);
+            }
+            logits_rows[idx] = llama_get_logits_ith(llm_ctx, idx);
+        };
+        for (const completions_task * task : tasks) {
+            // the sampled token and the drafted tokens
+            const auto s = int32_t(task->drafted_tokens.size());
+            for (int32_t j = 0; j <= s; j++) {
+                resolve(task->i_batch_seq_end - s + j);
+            }
+            // the drafted branches if any
+            for (size_t k = 0; k < task->drafted_branches.size(); k++) {
+                for (int32_t j = 0, n = int32_t(task->drafted_branches[k].size()); j < n; j++) {
+                    resolve(task->i_batch_seq_branches[k] + j);
+                }
+            }
+        }
+
+        std::atomic<size_t> next{ 0 };
+        auto                work = [&]() {
+            for (size_t i = next.fetch_add(1); i < n_tasks; i = next.fetch_add(1)) {
+                send_texts[i] = sample_completion_task(tasks[i], logits_rows);
+            }
+        };
+
+        std::vector<std::future<void>> joins;
+        if (sampling_workers != nullptr) {
+            const size_t n_workers = std::min(n_tasks - 1, size_t(params.n_threads_sampling - 1));
+            joins.reserve(n_workers);
+            for (size_t i = 0; i < n_workers; i++) {
+                auto job = std::make_shared<std::packaged_task<void()>>(work);
+                joins.push_back(job->get_future());
+                sampling_workers->enqueue([job]() { (*job)(); });
+            }
+        }
+        work();
+        for (std::future<void> & join : joins) {
+            join.get();
+        }
+    }
+
+    //
+    // Logics
+    //
+#if defined(linux) || defined(__linux) || defined(__linux__)
+#    define PIN_THREAD                                                        \
+        cpu_set_t cpu_mask;                                                   \
+        CPU_ZERO(&cpu_mask);                                                  \
+        CPU_SET(sched_getcpu(), &cpu_mask);                                   \
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_mask); \
+        sched_param cpu_sched_param{ 80 };                                    \
+        pthread_setschedparam(pthread_self(), SCHED_FIFO, &cpu_sched_param);
+#else
+#    define PIN_THREAD
+#endif
+
+    void reconcile_loop(const std::shared_ptr<httplib::Server> & server) {
+        PIN_THREAD;
+
+        while (server->is_running()) {
+            reconcile();
+            // release the finished tasks, but keep the capacity for the next step
+            reconcile_batch_task_ptrs.clear();
+            reconcile_drafting_task_ptrs.clear();
+        }
+    }
+
+    void reconcile() {
+        // collect tasks, the active tasks stay in the scheduler across steps,
+        // then the tasks staged during the previous decoding, then the tasks arrived in the queue,
+        // only wait for the queue if there is nothing to do
+        std::vector<std::unique_ptr<btask>> & task_ptrs = reconcile_task_ptrs;
+        task_ptrs.clear();
+        task_ptrs.swap(active_task_ptrs);
+        std::move(staged_task_ptrs.begin(), staged_task_ptrs.end(), std::back_inserter(task_ptrs));
+        staged_task_ptrs.resize(params.llm_params.n_threads_http);
+        size_t n_arrived_tasks = 0;
+        if (task_ptrs.empty()) {
+            n_arrived_tasks = process_tasks->wait_dequeue_bulk_timed(staged_task_ptrs.data(),
+                                                                     staged_task_ptrs.size(), 3000000);
+        } else {
+            n_arrived_tasks = process_tasks->try_dequeue_bulk(staged_task_ptrs.data(), staged_task_ptrs.size());
+        }
+        std::move(staged_task_ptrs.begin(), staged_task_ptrs.begin() + int64_t(n_arrived_tasks),
+                  std::back_inserter(task_ptrs));
+        staged_task_ptrs.clear();
+        size_t n_dequeue_tasks = task_ptrs.size();
+        if (n_dequeue_tasks == 0) {
+            return;
+        }
+
+        // mark the slots held by the admitted tasks, the others wait for a free slot,
+        // and reserve the kv cache for the prompts which are still prefilling in chunks
+        slots_busy            = 0;
+        llm_kv_cache_reserved = 0;
+        for (const std::unique_ptr<btask> & task_ptr : task_ptrs) {
+            const task_type type = task_ptr->get_type();
+            if ((type == TASK_COMPLETIONS || type == TASK_EMBEDDINGS) && task_ptr->get_seq_id() >= 0) {
+                slots_busy |= uint64_t(1) << task_ptr->get_seq_id();
+            }
+            if (type == TASK_COMPLETIONS) {
+                const auto * task = static_cast<const completions_task *>(task_ptr.get());
+                if (task->n_prefilled > 0 && task->n_prefilled < task->n_prefilling_request) {
+                    llm_kv_cache_reserved += task->n_prefilling_request - task->n_prefilled;
+                }
+            }
+        }
+
+        // process slots tasks immediately, which are not batched
+        {
+            size_t n_batch_tasks = 0;
+            for (size_t i = 0; i < n_dequeue_tasks; i++) {
+                if (task_ptrs[i]->get_type() == TASK_SLOTS) {
+                    process_slots_task(std::move(task_ptrs[i]));
+                    task_ptrs[i].reset();
+                    continue;
+                }
+                if (i != n_batch_tasks) {
+                    task_ptrs[n_batch_tasks] = std::move(task_ptrs[i]);
+                }
+                n_batch_tasks++;
+            }
+            n_dequeue_tasks = n_batch_tasks;
+            if (n_dequeue_tasks == 0) {
+                return;
+            }
+        }
+
+        // sort tasks, let decoding get the budget before prefilling
+        std::stable_sort(task_ptrs.begin(), task_ptrs.begin() + int64_t(n_dequeue_tasks),
+                         [](const std::unique_ptr<btask> & a, const std::unique_ptr<btask> & b) {
+                             return get_batch_task_priority(a) < get_batch_task_priority(b);
+                         });
+
+        // group tasks by lora adapters, the first group is going to batch,
+        // prefer the applied lora adapters to avoid switching,
+        // but switch to the most waiting ones after a few batches, so that no adapters starve.
+        {
+            const auto begin = task_ptrs.begin();
+            const auto end   = task_ptrs.begin() + int64_t(n_dequeue_tasks);
+            bool       found = false;  // whether any task matches the applied lora adapters
+            size_t     i_max = n_dequeue_tasks;
+            size_t     n_max = 0;
+            // count each distinct lora adapters once, keyed by the adapters and their scales,
+            // and remember the first task of each group
+            std::map<std::vector<std::pair<llama_adapter_lora *, float>>, std::pair<size_t, size_t>> groups;
+            std::vector<std::pair<llama_adapter_lora *, float>>                                       key;
+            for (size_t i = 0; i < n_dequeue_tasks; i++) {
+                const std::vector<common_adapter_lora_info> & la = task_ptrs[i]->get_lora_adapters();
+                if (equal_lora(la, lora_adapters)) {
+                    found = true;
+                    continue;
+                }
+                key.clear();
+                for (const common_adapter_lora_info & l : la) {
+                    key.emplace_back(l.ptr, l.scale);
+                }
+                groups.try_emplace(key, i, 0).first->second.second++;
+            }
+            for (const auto & group : groups) {
+                const auto [i, n] = group.second;
+                if (n > n_max || (n == n_max && i < i_max)) {
+                    i_max = i;
+                    n_max = n;
+                }
+            }
+            if (i_max == n_dequeue_tasks) {
+                lora_adapters_steps = 0;
+            } else if (!found || ++lora_adapters_steps > 8) {
+                const std::vector<common_adapter_lora_info> la = task_ptrs[i_max]->get_lora_adapters();  // copy
+                std::stable_partition(begin, end, [&](const std::unique_ptr<btask> & t) {
+                    return equal_lora(t->get_lora_adapters(), la);
+                });
+                lora_adapters_steps = 0;
+            } else {
+                std::stable_partition(begin, end, [&](const std::unique_ptr<btask> & t) {
+                    return equal_lora(t->get_lora_adapters(), lora_adapters);
+                });
+            }
+        }
+
+        // batch tasks
+        task_type                           batch_task_type = TASK_UNKNOWN;
+        std::vector<std::unique_ptr<btask>> & batch_task_ptrs = reconcile_batch_task_ptrs;
+        batch_task_ptrs.clear();
+        for (auto & task_ptr : task_ptrs) {
+            if (task_ptr == nullptr) {
+                break;
+            }
+
+            const task_type   ttype = task_ptr->get_type();
+            const std::string rid   = task_ptr->get_r_id();
+            const req_type    rtype = task_ptr->get_r_type();
+
+            // filter
+            if (batch_task_type == TASK_UNKNOWN) {
+                batch_task_type = ttype;
+
+                //// completions or embeddings
+                if (batch_task_type != TASK_IMAGES) {
+                    // set batch task type
+                    llama_set_embeddings(llm_ctx, batch_task_type == TASK_EMBEDDINGS);
+                    // apply lora adapters, only need to do it once per batch
+                    if (!equal_lora(task_ptr->get_lora_adapters(), lora_adapters)) {
+                        lora_adapters = task_ptr->get_lora_adapters();  // copy
+                        try {
+                            common_set_adapter_lora(llm_ctx, lora_adapters);
+                        } catch (const std::exception & e) {
+                            SRV_ERR("rid %s | batching, failed to apply lora %s\n", rid.c_str(), e.what());
+                        }
+                    }
+                    // clean batch for later adding
+                    common_batch_clear(batch_text);
+                    if (llm_ctx_draft != nullptr) {
+                        common_batch_clear(batch_text_draft);
+                    }
+                }
+
+                //// images
+                else {
+                    // apply lora adapters, only need to do it once per batch
+                    if (!equal_lora(task_ptr->get_lora_adapters(), lora_adapters)) {
+                        lora_adapters = task_ptr->get_lora_adapters();  // copy
+                        try {
+                            sd_ctx->apply_lora_adapters(lora_adapters);
+                        } catch (const std::exception & e) {
+                            SRV_ERR("rid %s | batching, failed to apply lora %s\n", rid.c_str(), e.what());
+                        }
+                    }
+                }
+            } else if (batch_task_type != ttype) {
+                SRV_DBG(
+                    "rid %s | "
+                    "batching, waiting previous batch finished: not the same kind batch\n",
+                    rid.c_str());
+                active_task_ptrs.push_back(std::move(task_ptr));
+                continue;
+            } else if (!equal_lora(task_ptr->get_lora_adapters(), lora_adapters)) {
+                SRV_DBG(
+                    "rid %s | "
+                    "batching, waiting previous batch finished: lora adapters not matched\n",
+                    rid.c_str());
+                active_task_ptrs.push_back(std::move(task_ptr));
+                continue;
+            }
+
+            // batch
+            int32_t seq_id = task_ptr->get_seq_id();
+
+            if (batch_task_type != TASK_IMAGES) {
+                /**
+                 * completions
+                 */
+
+                if (batch_task_type == TASK_COMPLETIONS) {
+                    auto * task = static_cast<completions_task *>(task_ptr.get());
+                    if (task->processed_tokens.capacity() == 0) {
+                        task->processed_tokens.reserve(task->n_decoding_budget >= INT32_MAX ?
+                                                           task->n_prefilling_request :
+                                                           task->n_decoding_budget);
+                    }
+
+                    // prefill (n_prefilled < n_prefilling_request)
+                    if (task->n_prefilled < task->n_prefilling_request) {
                         // filter
-                        if (llm_kv_cache_used - llm_kv_cache_inactive + task->n_prefilling_request >
-                            llm_kv_cache_limit) {
+                        // the prompts admitted before may not be fully placed yet,
+                        // so check against their reservations too
+                        if (task->n_prefilled == 0 &&
+                            llm_kv_cache_used - llm_kv_cache_inactive + llm_kv_cache_reserved +
+                                    task->n_prefilling_request >
+                                llm_kv_cache_limit) {
                             SRV_DBG(
                                 "rid %s | "
                                 "batching, waiting previous batch finished: not enough space to place all tokens, "
-                                "kv_cache_used(%d) - kv_cache_inactive(%d) + prefill_t(%d) > "
+                                "kv_cache_used(%d) - kv_cache_inactive(%d) + kv_cache_reserved(%d) + prefill_t(%d) > "
                                 "kv_cache_limit(%d)\n",
-                                rid.c_str(), llm_kv_cache_used, llm_kv_cache_inactive, task->n_prefilling_request,
-                                llm_kv_cache_limit);
-                            process_tasks->enqueue(std::move(task_ptr));
+                                rid.c_str(), llm_kv_cache_used, llm_kv_cache_inactive, llm_kv_cache_reserved,
+                                task->n_prefilling_request, llm_kv_cache_limit);
+                            active_task_ptrs.push_back(std::move(task_ptr));
+                            continue;
+                        }
+                        const int32_t n_chunk = std::min(batch_step_max - batch_text.n_tokens,
+                                                         params.llm_params.n_ubatch);
+                        if (n_chunk <= 0) {
+                            SRV_DBG(
+                                "rid %s | "
+                                "batching, waiting previous batch finished: not enough budget to place tokens, "
+                                "batch_t(%d) >= batch_step_max(%d)\n",
+                                rid.c_str(), batch_text.n_tokens, batch_step_max);
+                            active_task_ptrs.push_back(std::move(task_ptr));
                             continue;
                         }
 
-                        batch_process_type = PROCESS_PREFILL;
+                        // take a free slot
+                        if (seq_id < 0) {
+                            seq_id = acquire_slot();
+                            if (seq_id < 0) {
+                                SRV_DBG(
+                                    "rid %s | "
+                                    "batching, waiting previous batch finished: no free slot, slots(%d)\n",
+                                    rid.c_str(), params.n_slots);
+                                active_task_ptrs.push_back(std::move(task_ptr));
+                                continue;
+                            }
+                            task->set_seq_id(seq_id);
+                        }
+
+                        // reserve the kv cache for the whole prompt, which is released as the chunks land
+                        if (task->n_prefilled == 0) {
+                            llm_kv_cache_reserved += task->n_prefilling_request;
+                        }
 
                         // prepare cache - prefix cache
                         if (task->n_prefilled == 0 && cache_prompt) {
+                            // take the tokens staged while the previous batch was decoding, or stage them now
+                            if (task->staged_prompt_tokens.empty()) {
+                                task->stage();
+                            }
                             llama_tokens tokens;
-                            // get tokens of plain text
-                            if (!task->tokenized_prompts_include_multimedias) {
-                                tokens = std::get<llama_tokens>(task->tokenized_prompts[0]);
+                            tokens.swap(task->staged_prompt_tokens);
+                            // find the longest prefix cached by any sequence
+                            auto [seq_lcp_l, seq_lcp_seqs] = cache_prompt_tree.match(tokens);
+                            // prefer the unused sequence holding the prefix, which can be taken directly,
+                            // otherwise, copy the prefix from a holder into the least valuable unused sequence
+                            int32_t seq_lcp_id = -1;
+                            seq_id             = -1;
+                            for (int32_t i = 0; i < params.n_slots; i++) {
+                                if ((seq_lcp_seqs >> i & 1) == 0) {
+                                    continue;
+                                }
+                                if (!cache_prompts.at(i).used) {
+                                    seq_lcp_id = i;
+                                    seq_id     = i;
+                                    break;
+                                }
+                                if (seq_lcp_id < 0) {
+                                    seq_lcp_id = i;
+                                }
                             }
-                            // get tokens of multimedia
-                            else {
-                                for (const auto & tokenized_prompt : task->tokenized_prompts) {
-                                    if (std::holds_alternative<llama_tokens>(tokenized_prompt)) {
-                                        llama_tokens tokenized_text = std::get<llama_tokens>(tokenized_prompt);
-                                        tokens.insert(tokens.end(), tokenized_text.begin(), tokenized_text.end());
-                                    } else {
-                                        llama_multimodal_tokens tokenized_mtmd =
-                                            std::get<llama_multimodal_tokens>(tokenized_prompt);
-                                        llama_tokens dummy_tokens(tokenized_mtmd.n_pos, tokenized_mtmd.dummy_token);
-                                        tokens.insert(tokens.end(), dummy_tokens.begin(), dummy_tokens.end());
+                            if (seq_id < 0) {
+                                llama_pos seq_pos = 0;
+                                for (int32_t i = 0; i < params.n_slots; i++) {
+                                    const cache_prompt_entry & cache = cache_prompts.at(i);
+                                    if (cache.used) {
+                                        SRV_DBG(
+                                            "rid %s | skip cache prompt in used "
+                                            "seq_id = %d\n",
+                                            rid.c_str(), i);
+                                        continue;
+                                    }
+                                    if (seq_id < 0 || cache.pos < seq_pos) {
+                                        seq_id  = i;
+                                        seq_pos = cache.pos;
                                     }
                                 }
                             }
-                            int32_t   seq_lcp_id          = -1;
-                            size_t    seq_lcp_l           = 0;
-                            llama_pos seq_lcp_pos         = 0;
-                            llama_pos seq_lcp_pos_discard = 0;
-                            for (int32_t i = 0; i < params.llm_params.n_threads_http; i++) {
-                                cache_prompt_entry & cache = cache_prompts.at(i);
-                                if (cache.used) {
-                                    SRV_DBG(
-                                        "rid %s | skip cache prompt in used "
-                                        "seq_id = %d\n",
-                                        rid.c_str(), i);
-                                    continue;
+                            // stash the prompt cache which is going to be overwritten,
+                            // and restore the stashed one if it is longer than the cached prefix by an ubatch at least
+                            bool seq_restored = false;
+                            if (params.cache_ram > 0) {
+                                const size_t n_ubatch = params.llm_params.n_ubatch;
+                                const size_t n_kept   = seq_lcp_id == seq_id ? seq_lcp_l : 0;
+                                if (size_t(cache_prompts.at(seq_id).pos) >= n_kept + n_ubatch) {
+                                    stash_cache_prompt(seq_id);
                                 }
-                                size_t lcp_l = common_lcp(cache.tokens, tokens);
-                                if (lcp_l > seq_lcp_l) {
-                                    seq_lcp_id          = i;
-                                    seq_lcp_l           = lcp_l;
-                                    seq_lcp_pos         = cache.pos;
-                                    seq_lcp_pos_discard = cache.pos_discard;
-                                } else if (seq_lcp_id < 0) {
-                                    seq_lcp_id = i;
+                                const int32_t n_restored =
+                                    restore_cache_prompt(seq_id, tokens, seq_lcp_l + n_ubatch - 1);
+                                if (n_restored != 0) {
+                                    seq_restored = n_restored > 0;
+                                    seq_lcp_id   = n_restored > 0 ? seq_id : -1;
+                                    seq_lcp_l    = n_restored > 0 ? size_t(n_restored) : 0;
+                                    SRV_INFV(2, "rid %s | %s prompt cache, seq = %d, n_tokens = %zu\n", rid.c_str(),
+                                             n_restored > 0 ? "restored" : "failed to restore", seq_id, seq_lcp_l);
                                 }
                             }
-                            seq_id = seq_lcp_id;
                             // miss cache
                             if (seq_lcp_l == 0) {
                                 SRV_INFV(2,
@@ -3811,15 +6308,13 @@ struct httpserver {
                             // hit cache
                             else {
                                 int32_t   cached = int32_t(seq_lcp_l) - 1;
-                                llama_pos pos    = std::min(seq_lcp_pos - 1, cached);
-                                // request the same longer prefill context again but the cache has discarded.
-                                if (seq_lcp_pos_discard > 0 && seq_lcp_l == tokens.size()) {
-                                    cached = 0;
-                                    pos    = 0;
-                                }
+                                llama_pos pos    = cached;
                                 // check whether the requested content is hitting the range discarded by SWA.
-                                else if (llm_model_n_swa > 0 && seq_lcp_pos > int32_t(seq_lcp_l)) {
-                                    const int32_t pos_min = llama_memory_seq_pos_min(llama_get_memory(llm_ctx), seq_id);
+                                if (llm_model_n_swa > 0 &&
+                                    llama_memory_seq_pos_max(llama_get_memory(llm_ctx), seq_lcp_id) + 1 >
+                                        int32_t(seq_lcp_l)) {
+                                    const int32_t pos_min =
+                                        llama_memory_seq_pos_min(llama_get_memory(llm_ctx), seq_lcp_id);
                                     if (pos_min < 0 || pos_min > std::max(0, pos - llm_model_n_swa)) {
                                         cached = 0;
                                         pos    = 0;
@@ -3834,6 +6329,11 @@ struct httpserver {
                                              "rid %s | hit prompt cache, but need to re-process, "
                                              "seq = %d, cached = 0, next_pos = 0\n",
                                              rid.c_str(), seq_id);
+                                } else if (seq_lcp_id != seq_id) {
+                                    SRV_INFV(2,
+                                             "rid %s | hit prompt cache, "
+                                             "seq = %d, cached = %d, next_pos = %d, copied from seq = %d\n",
+                                             rid.c_str(), seq_id, cached, pos, seq_lcp_id);
                                 } else {
                                     SRV_INFV(2,
                                              "rid %s | hit prompt cache, "
@@ -3841,14 +6341,81 @@ struct httpserver {
                                              rid.c_str(), seq_id, cached, pos);
                                 }
                             }
+                            // reuse the chunks of the cache after the common prefix by shifting the kv cache,
+                            // only for the sequence which is taken directly and keeps the positions
+                            if (params.llm_params.n_cache_reuse > 0 && llm_model_n_swa == 0 &&
+                                !task->tokenized_prompts_include_multimedias && !seq_restored &&
+                                (seq_lcp_id < 0 || seq_lcp_id == seq_id) && cache_prompts.at(seq_id).pos_discard == 0) {
+                                const cache_prompt_entry & cache         = cache_prompts.at(seq_id);
+                                const auto                 n_cache_reuse = size_t(params.llm_params.n_cache_reuse);
+                                const size_t               n_cache = std::min(size_t(cache.pos), cache.tokens.size());
+                                size_t                     head_c  = seq_lcp_l;  // head of cache
+                                size_t                     head_p  = seq_lcp_l;  // head of prompt
+                                while (head_c < n_cache && head_p < tokens.size()) {
+                                    size_t n_match = 0;
+                                    while (head_c + n_match < n_cache && head_p + n_match < tokens.size() &&
+                                           cache.tokens[head_c + n_match] == tokens[head_p + n_match]) {
+                                        n_match++;
+                                    }
+                                    if (n_match < n_cache_reuse) {
+                                        head_c++;
+                                        continue;
+                                    }
+                                    const auto kv_shift = llama_pos(head_p) - llama_pos(head_c);
+                                    llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, llama_pos(head_p),
+                                                        llama_pos(head_c));
+                                    llama_memory_seq_add(llama_get_memory(llm_ctx), seq_id, llama_pos(head_c),
+                                                         llama_pos(head_c + n_match), kv_shift);
+                                    if (llm_ctx_draft != nullptr) {
+                                        llama_memory_seq_rm(llama_get_memory(llm_ctx_draft), seq_id, llama_pos(head_p),
+                                                            llama_pos(head_c));
+                                        llama_memory_seq_add(llama_get_memory(llm_ctx_draft), seq_id,
+                                                             llama_pos(head_c), llama_pos(head_c + n_match), kv_shift);
+                                    }
+                                    SRV_DBG(
+                                        "rid %s | prefix cache, "
+                                        "reuse kv cache, seq %d = [%zu, %zu) -> [%zu, %zu)\n",
+                                        rid.c_str(), seq_id, head_c, head_c + n_match, head_p, head_p + n_match);
+                                    head_c += n_match;
+                                    head_p += n_match;
+                                }
+                                if (head_p > seq_lcp_l) {
+                                    // keep one token at least to process
+                                    const auto cached             = int32_t(std::min(head_p, tokens.size() - 1));
+                                    task->pos                     = cached;
+                                    task->n_processed_detokenized = cached;
+                                    task->n_prefilled             = cached;
+                                    task->n_prefilled_cached      = cached;
+                                    llm_kv_cache_reserved -= cached;
+                                    SRV_INFV(2,
+                                             "rid %s | reuse prompt cache chunks, "
+                                             "seq = %d, cached = %d, next_pos = %d\n",
+                                             rid.c_str(), seq_id, cached, cached);
+                                }
+                            }
                             // mask prompt cache
                             cache_prompt_entry & cache = cache_prompts.at(seq_id);
                             llm_kv_cache_used -= cache.pos;
                             llm_kv_cache_inactive -= cache.pos;
                             cache.used        = true;
                             cache.pos         = 0;
-                            cache.pos_discard = task->pos > 0 ? cache.pos_discard : 0;
+                            cache.pos_discard = 0;
+                            cache_prompt_tree.erase(seq_id);
                             task->set_seq_id(seq_id);
+                            // copy kv cache from the holder,
+                            // cross-stream copy only supports the whole sequence, so copy all and then clean the tail
+                            if (task->pos > 0 && seq_lcp_id >= 0 && seq_lcp_id != seq_id) {
+                                llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, -1, -1);
+                                llama_memory_seq_cp(llama_get_memory(llm_ctx), seq_lcp_id, seq_id, -1, -1);
+                                if (llm_ctx_draft != nullptr) {
+                                    llama_memory_seq_rm(llama_get_memory(llm_ctx_draft), seq_id, -1, -1);
+                                    llama_memory_seq_cp(llama_get_memory(llm_ctx_draft), seq_lcp_id, seq_id, -1, -1);
+                                }
+                                SRV_DBG(
+                                    "rid %s | prefix cache, "
+                                    "copy kv cache, seq %d -> %d = [0, %d)\n",
+                                    rid.c_str(), seq_lcp_id, seq_id, task->pos);
+                            }
                             // clean kv cache
                             llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, task->pos, -1);
                             if (llm_ctx_draft != nullptr) {
@@ -3862,145 +6429,144 @@ struct httpserver {
                         }
 
                         // batching
-                        const auto n_prompt    = int32_t(task->tokenized_prompts.size());
-                        int32_t    c_prefilled = 0;
-                        if (n_prompt > 1) {
-                            // process n-1 prompts
-                            for (int32_t i_prompt = 0; i_prompt < (n_prompt - 1); i_prompt++) {
-                                // text
-                                if (std::holds_alternative<llama_tokens>(task->tokenized_prompts[i_prompt])) {
-                                    llama_tokens tokenized_text =
-                                        std::get<llama_tokens>(task->tokenized_prompts[i_prompt]);
-                                    const auto    n_text   = int32_t(tokenized_text.size());
-                                    const int32_t n_text_s = task->n_prefilled - c_prefilled;
-                                    if (n_text_s < n_text) {
-                                        const int32_t n_text_d = n_text - n_text_s;
-                                        // in batch
-                                        for (int32_t i_text = n_text_s; i_text < n_text; i_text++) {
-                                            const llama_token tok = tokenized_text[i_text];
-                                            common_batch_add(batch_text_temp, tok, task->pos, { seq_id }, false);
-                                            task->pos++;
-                                        }
-                                        task->n_prefilled += n_text_d;
-                                        llm_kv_cache_used += n_text_d;
-                                        // decode immediately
-                                        const int32_t decoded_text =
-                                            decode_completion_task_batch(llm_ctx, batch_text_temp, batch_task_ptrs);
-                                        common_batch_clear(batch_text_temp);
-                                        if (decoded_text != 0) {
-                                            SRV_ERR(
-                                                "rid %s | decode vision text, failed to decode, try again, "
-                                                "increasing context size or reducing requests: result = %d\n",
-                                                rid.c_str(), decoded_text);
-                                            break;
-                                        }
+                        const auto n_prompt       = int32_t(task->tokenized_prompts.size());
+                        bool       prefill_failed = false;
+                        //// process the n-1 prompts immediately, one prompt(chunk) per step
+                        for (; task->i_prefilling_prompt < n_prompt - 1;) {
+                            // processed tokens include all the prefilled prompts before
+                            const auto    c_prefilled = int32_t(task->processed_tokens.size());
+                            const int32_t i_prompt    = task->i_prefilling_prompt;
+                            // text
+                            if (std::holds_alternative<llama_tokens>(task->tokenized_prompts[i_prompt])) {
+                                const llama_tokens & tokenized_text =
+                                    std::get<llama_tokens>(task->tokenized_prompts[i_prompt]);
+                                const auto    n_text   = int32_t(tokenized_text.size());
+                                const int32_t n_text_s = task->n_prefilled - c_prefilled;
+                                if (n_text_s < n_text) {
+                                    const int32_t n_text_d = std::min(n_text - n_text_s, n_chunk);
+                                    // in batch
+                                    for (int32_t i_text = n_text_s; i_text < n_text_s + n_text_d; i_text++) {
+                                        const llama_token tok = tokenized_text[i_text];
+                                        common_batch_add(batch_text_temp, tok, task->pos, { seq_id }, false);
+                                        task->pos++;
+                                    }
+                                    task->n_prefilled += n_text_d;
+                                    llm_kv_cache_used += n_text_d;
+                                    llm_kv_cache_reserved -= n_text_d;
+                                    // decode immediately
+                                    const int32_t decoded_text =
+                                        decode_completion_task_batch(llm_ctx, batch_text_temp, {});
+                                    common_batch_clear(batch_text_temp);
+                                    if (decoded_text != 0) {
+                                        SRV_ERR(
+                                            "rid %s | decode vision text, failed to decode, try again, "
+                                            "increasing context size or reducing requests: result = %d\n",
+                                            rid.c_str(), decoded_text);
+                                        prefill_failed = true;
+                                        break;
+                                    }
+                                    // wait for next step if incomplete
+                                    if (n_text_s + n_text_d < n_text) {
+                                        break;
                                     }
-                                    // accumulate prefilled
-                                    c_prefilled += n_text;
-                                    // append processed tokens
-                                    task->processed_tokens.insert(task->processed_tokens.end(), tokenized_text.begin(),
-                                                                  tokenized_text.end());
                                 }
-                                // multimedia
-                                else {
-                                    auto tokenized_mtmd =
-                                        std::get<llama_multimodal_tokens>(std::move(task->tokenized_prompts[i_prompt]));
-                                    const int32_t n_mtmd   = tokenized_mtmd.n_tokens;
-                                    const int32_t n_mtmd_s = task->n_prefilled - c_prefilled;
-                                    if (n_mtmd_s < tokenized_mtmd.n_pos) {
-                                        const int32_t                n_mtmd_d = tokenized_mtmd.n_pos;
-                                        // in batch
-                                        llama_multimodal_embed_batch batch_mtmd;
-                                        //// mrope
-                                        if (llm_model_rope_mrope) {
-                                            std::vector<llama_pos> pos(n_mtmd * 4);
-                                            // vision (2d)
-                                            if (!tokenized_mtmd.is_audio) {
-                                                clip_image_size & is = tokenized_mtmd.size;
-                                                const int32_t     ps = clip_get_patch_size(llm_ctx_clip_v) * 2;
-                                                const int32_t     ph = is.height / ps + (is.height % ps > 0);
-                                                const int32_t     pw = is.width / ps + (is.width % ps > 0);
-                                                for (int32_t y = 0; y < ph; y++) {
-                                                    for (int32_t x = 0; x < pw; x++) {
-                                                        const int i         = y * pw + x;
-                                                        pos[i]              = task->pos;
-                                                        pos[i + n_mtmd * 1] = task->pos + y;
-                                                        pos[i + n_mtmd * 2] = task->pos + x;
-                                                        pos[i + n_mtmd * 3] = 0;
-                                                    }
-                                                }
-                                            }
-                                            // audio (1d)
-                                            else {
-                                                for (int32_t i = 0; i < n_mtmd; i++) {
-                                                    pos[i]              = task->pos + i;
-                                                    pos[i + n_mtmd * 1] = task->pos + i;
-                                                    pos[i + n_mtmd * 2] = task->pos + i;
-                                                    pos[i + n_mtmd * 3] = 0;
-                                                }
+                                // append processed tokens
+                                task->processed_tokens.insert(task->processed_tokens.end(), tokenized_text.begin(),
+                                                              tokenized_text.end());
+                                task->i_prefilling_prompt++;
+                                // wait for next step if processed
+                                if (n_text_s < n_text) {
+                                    break;
+                                }
+                                continue;
+                            }
+                            // multimedia
+                            auto & tokenized_mtmd =
+                                std::get<llama_multimodal_tokens>(task->tokenized_prompts[i_prompt]);
+                            const int32_t n_mtmd   = tokenized_mtmd.n_tokens;
+                            const int32_t n_mtmd_s = task->n_prefilled - c_prefilled;
+                            if (n_mtmd_s < tokenized_mtmd.n_pos) {
+                                const int32_t                n_mtmd_d = tokenized_mtmd.n_pos;
+                                // in batch,
+                                // NB(thxCode): the batch never writes the embeddings, which may be shared with cache.
+                                auto *                       embd = const_cast<float *>(tokenized_mtmd.embed->data());
+                                llama_multimodal_embed_batch batch_mtmd;
+                                //// mrope
+                                if (llm_model_rope_mrope) {
+                                    std::vector<llama_pos> pos(n_mtmd * 4);
+                                    // vision (2d)
+                                    if (!tokenized_mtmd.is_audio) {
+                                        clip_image_size & is = tokenized_mtmd.size;
+                                        const int32_t     ps = clip_get_patch_size(llm_ctx_clip_v) * 2;
+                                        const int32_t     ph = is.height / ps + (is.height % ps > 0);
+                                        const int32_t     pw = is.width / ps + (is.width % ps > 0);
+                                        for (int32_t y = 0; y < ph; y++) {
+                                            for (int32_t x = 0; x < pw; x++) {
+                                                const int i         = y * pw + x;
+                                                pos[i]              = task->pos;
+                                                pos[i + n_mtmd * 1] = task->pos + y;
+                                                pos[i + n_mtmd * 2] = task->pos + x;
+                                                pos[i + n_mtmd * 3] = 0;
                                             }
-                                            batch_mtmd = llama_multimodal_embed_batch(tokenized_mtmd.embed.data(),
-                                                                                      n_mtmd, std::move(pos), seq_id);
-                                        }
-                                        //// non-mrope
-                                        else {
-                                            batch_mtmd = llama_multimodal_embed_batch(tokenized_mtmd.embed.data(),
-                                                                                      n_mtmd, task->pos, seq_id);
                                         }
-                                        task->pos += n_mtmd_d;
-                                        task->n_prefilled += n_mtmd_d;
-                                        llm_kv_cache_used += n_mtmd_d;
-                                        // decode immediately
-                                        if (llm_ctx_clip_v != nullptr && clip_is_gemma3(llm_ctx_clip_v)) {
-                                            llama_set_causal_attn(llm_ctx, false);
-                                        }
-                                        const int32_t decoded_image =
-                                            decode_completion_task_batch(llm_ctx, batch_mtmd.temp, batch_task_ptrs);
-                                        if (llm_ctx_clip_v != nullptr && clip_is_gemma3(llm_ctx_clip_v)) {
-                                            llama_set_causal_attn(llm_ctx, true);
-                                        }
-                                        if (decoded_image != 0) {
-                                            SRV_ERR(
-                                                "rid %s | decode vision image, failed to decode, try again, "
-                                                "increasing context size or reducing requests: result = %d\n",
-                                                rid.c_str(), decoded_image);
-                                            break;
+                                    }
+                                    // audio (1d)
+                                    else {
+                                        for (int32_t i = 0; i < n_mtmd; i++) {
+                                            pos[i]              = task->pos + i;
+                                            pos[i + n_mtmd * 1] = task->pos + i;
+                                            pos[i + n_mtmd * 2] = task->pos + i;
+                                            pos[i + n_mtmd * 3] = 0;
                                         }
                                     }
-                                    // accumulate prefilled
-                                    c_prefilled += tokenized_mtmd.n_pos;
-                                    // append processed tokens
-                                    llama_tokens dummy_tokens(tokenized_mtmd.n_pos, tokenized_mtmd.dummy_token);
-                                    task->processed_tokens.insert(task->processed_tokens.end(), dummy_tokens.begin(),
-                                                                  dummy_tokens.end());
+                                    batch_mtmd = llama_multimodal_embed_batch(embd, n_mtmd, std::move(pos), seq_id);
+                                }
+                                //// non-mrope
+                                else {
+                                    batch_mtmd = llama_multimodal_embed_batch(embd, n_mtmd, task->pos, seq_id);
+                                }
+                                task->pos += n_mtmd_d;
+                                task->n_prefilled += n_mtmd_d;
+                                llm_kv_cache_used += n_mtmd_d;
+                                llm_kv_cache_reserved -= n_mtmd_d;
+                                // decode immediately
+                                if (llm_ctx_clip_v != nullptr && clip_is_gemma3(llm_ctx_clip_v)) {
+                                    llama_set_causal_attn(llm_ctx, false);
+                                }
+                                const int32_t decoded_image =
+                                    decode_completion_task_batch(llm_ctx, batch_mtmd.temp, {});
+                                if (llm_ctx_clip_v != nullptr && clip_is_gemma3(llm_ctx_clip_v)) {
+                                    llama_set_causal_attn(llm_ctx, true);
+                                }
+                                if (decoded_image != 0) {
+                                    SRV_ERR(
+                                        "rid %s | decode vision image, failed to decode, try again, "
+                                        "increasing context size or reducing requests: result = %d\n",
+                                        rid.c_str(), decoded_image);
+                                    prefill_failed = true;
+                                    break;
                                 }
+                                // release the embedding asap, unless it is shared with the cache
+                                tokenized_mtmd.embed.reset();
                             }
-                        }
-                        llama_tokens  tokenized_text = std::get<llama_tokens>(task->tokenized_prompts[n_prompt - 1]);
-                        const auto    n_text         = int32_t(tokenized_text.size());
-                        const int32_t n_text_s       = task->n_prefilled - c_prefilled;
-                        const int32_t n_text_d       = n_text - n_text_s;
-                        // in batch
-                        for (int32_t i_text = n_text_s; i_text < n_text; i_text++) {
-                            const llama_token tok = tokenized_text[i_text];
-                            const bool        emb = i_text + 1 == n_text;
-                            common_batch_add(batch_text, tok, task->pos, { seq_id }, emb);
-                            if (llm_ctx_draft != nullptr) {
-                                common_batch_add(batch_text_draft, tok, task->pos, { seq_id }, emb);
+                            // append processed tokens
+                            task->processed_tokens.insert(task->processed_tokens.end(), tokenized_mtmd.n_pos,
+                                                          tokenized_mtmd.dummy_token);
+                            task->i_prefilling_prompt++;
+                            // wait for next step if processed
+                            if (n_mtmd_s < tokenized_mtmd.n_pos) {
+                                break;
                             }
-                            task->pos++;
                         }
-                        task->n_prefilled += n_text_d;
-                        llm_kv_cache_used += n_text_d;
-                        // abort if incomplete prefilling
-                        if (task->n_prefilled < task->n_prefilling_request) {
+                        //// abort if failed
+                        if (prefill_failed) {
                             // clean kv cache
                             llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, 0, -1);
                             if (llm_ctx_draft != nullptr) {
                                 llama_memory_seq_rm(llama_get_memory(llm_ctx_draft), seq_id, 0, -1);
                             }
                             SRV_DBG(
-                                "rid %s | prefill, incomplete, "
+                                "rid %s | prefill, failed, "
                                 "clean kv cache, seq %d = [0, end)\n",
                                 rid.c_str(), seq_id);
                             llm_kv_cache_used -= task->pos;
@@ -4008,6 +6574,7 @@ struct httpserver {
                             if (cache_prompt) {
                                 cache_prompt_entry & cache = cache_prompts.at(seq_id);
                                 cache.tokens.clear();
+                                cache_prompt_tree.erase(seq_id);
                                 cache.used        = false;
                                 cache.pos         = 0;
                                 cache.pos_discard = 0;
@@ -4022,41 +6589,131 @@ struct httpserver {
                                  "failed to prefill, try again, "
                                   "increasing context size or reducing requests" }
                             };
-                            process_task_results[tid]->enqueue(
+                            task->results->enqueue(
                                 std::make_unique<btask_result>(httplib::InternalServerError_500, std::move(data)));
                             continue;
                         }
-                        // append processed tokens
-                        task->processed_tokens.insert(task->processed_tokens.end(), tokenized_text.begin(),
-                                                      tokenized_text.end());
-                        // save for cache prompts,
-                        // so we need to mark the base in n_processed_detokenized
-                        task->n_processed_detokenized = task->n_prefilling_request;
-                        SRV_DBG("rid %s | batching, decode, seq = %d\n", rid.c_str(), seq_id);
-
-                        task->i_batch_seq_end = (batch_text.n_tokens + (batch_view_max - 1)) % batch_view_max;
+                        //// wait for next step if the n-1 prompts are processing
+                        if (task->i_prefilling_prompt < n_prompt - 1) {
+                            SRV_DBG("rid %s | batching, prefill in chunk, seq = %d, prefilled = %d/%d\n", rid.c_str(),
+                                    seq_id, task->n_prefilled, task->n_prefilling_request);
+                            active_task_ptrs.push_back(std::move(task_ptr));
+                            continue;
+                        }
+                        //// place the last prompt in chunk
+                        const llama_tokens & tokenized_text =
+                            std::get<llama_tokens>(task->tokenized_prompts[n_prompt - 1]);
+                        const auto    n_text   = int32_t(tokenized_text.size());
+                        const int32_t n_text_s = task->n_prefilled - int32_t(task->processed_tokens.size());
+                        const int32_t n_text_d = std::min(n_text - n_text_s, n_chunk);
+                        // in batch
+                        for (int32_t i_text = n_text_s; i_text < n_text_s + n_text_d; i_text++) {
+                            const llama_token tok = tokenized_text[i_text];
+                            const bool        emb = i_text + 1 == n_text;
+                            common_batch_add(batch_text, tok, task->pos, { seq_id }, emb);
+                            if (llm_ctx_draft != nullptr) {
+                                common_batch_add(batch_text_draft, tok, task->pos, { seq_id }, emb);
+                            }
+                            task->pos++;
+                        }
+                        task->n_prefilled += n_text_d;
+                        llm_kv_cache_used += n_text_d;
+                        llm_kv_cache_reserved -= n_text_d;
+                        // complete prefilling
+                        if (task->n_prefilled == task->n_prefilling_request) {
+                            // append processed tokens
+                            task->processed_tokens.insert(task->processed_tokens.end(), tokenized_text.begin(),
+                                                          tokenized_text.end());
+                            // save for cache prompts,
+                            // so we need to mark the base in n_processed_detokenized
+                            task->n_processed_detokenized = task->n_prefilling_request;
+                            // index the prompt for lookup in background,
+                            // which overlaps the decoding of the last chunk
+                            if (params.lookup_ngram_min > 0 && !task->tokenized_prompts_include_multimedias) {
+                                auto job = std::make_shared<std::packaged_task<common_ngram_cache()>>(
+                                    [tokens = task->processed_tokens, n_min = params.lookup_ngram_min]() mutable {
+                                        common_ngram_cache cache;
+                                        common_ngram_cache_update(cache, n_min, LLAMA_NGRAM_MAX, tokens,
+                                                                  int32_t(tokens.size()), false);
+                                        return cache;
+                                    });
+                                task->ngram_cache_seeding = job->get_future();
+                                lookup_index_workers->enqueue([job]() { (*job)(); });
+                            }
+                            SRV_DBG("rid %s | batching, decode, seq = %d\n", rid.c_str(), seq_id);
+                        } else {
+                            SRV_DBG("rid %s | batching, prefill in chunk, seq = %d, prefilled = %d/%d\n", rid.c_str(),
+                                    seq_id, task->n_prefilled, task->n_prefilling_request);
+                        }
+
+                        task->i_batch_seq_end = batch_text.n_tokens - 1;
                         batch_task_ptrs.push_back(std::move(task_ptr));
                     }
 
                     // decode next (n_decoded > 0)
-                    else if (batch_process_type != PROCESS_PREFILL && task->n_decoded > 0 &&
-                             batch_text.n_tokens + params.llm_params.speculative.n_max < batch_view_max) {
+                    else if (task->n_decoded > 0) {
+                        // filter
+                        int32_t n_decode_t = 1 + int32_t(task->drafted_tokens.size());
+                        for (const llama_tokens & branch : task->drafted_branches) {
+                            n_decode_t += int32_t(branch.size());
+                        }
+                        if (batch_text.n_tokens + n_decode_t > batch_step_max) {
+                            SRV_DBG(
+                                "rid %s | "
+                                "batching, waiting previous batch finished: not enough budget to place all tokens, "
+                                "batch_t(%d) + decode_t(%d) > batch_step_max(%d)\n",
+                                rid.c_str(), batch_text.n_tokens, n_decode_t, batch_step_max);
+                            active_task_ptrs.push_back(std::move(task_ptr));
+                            continue;
+                        }
                         // token throttling
                         if (task->token_bucket != nullptr) {
                             if (!task->token_bucket->try_acquire()) {
-                                process_tasks->enqueue(std::move(task_ptr));
+                                active_task_ptrs.push_back(std::move(task_ptr));
                                 continue;
                             }
                         }
 
-                        batch_process_type = PROCESS_DECODE;
-
                         // prepare cache - truncate cache
                         if (llm_kv_cache_used >= llm_kv_cache_limit) {
                             shift_completion_task_cache(task);
                         }
 
                         // batching
+                        //// tree, the last processed token is shared by all branches
+                        if (!task->drafted_branches.empty()) {
+                            const int32_t             pos_root  = task->pos;
+                            std::vector<llama_seq_id> root_seqs = { seq_id };
+                            for (int32_t b = 1, n = int32_t(task->drafted_branches.size()); b <= n; b++) {
+                                const llama_seq_id branch_seq = get_draft_branch_seq_id(seq_id, b);
+                                llama_memory_seq_rm(llama_get_memory(llm_ctx), branch_seq, -1, -1);
+                                llama_memory_seq_cp(llama_get_memory(llm_ctx), seq_id, branch_seq, -1, -1);
+                                root_seqs.push_back(branch_seq);
+                            }
+                            common_batch_add(batch_text, task->processed_tokens.back(), task->pos, root_seqs, true);
+                            task->pos++;
+                            llm_kv_cache_used++;
+                            for (const llama_token & tok : task->drafted_tokens) {
+                                common_batch_add(batch_text, tok, task->pos, { seq_id }, true);
+                                task->pos++;
+                                llm_kv_cache_used++;
+                            }
+                            task->i_batch_seq_end = batch_text.n_tokens - 1;
+                            // NB(thxCode): the tokens of other branches are not counted in kv cache used,
+                            // as they are dropped after verifying.
+                            task->i_batch_seq_branches.clear();
+                            for (int32_t b = 1, n = int32_t(task->drafted_branches.size()); b <= n; b++) {
+                                task->i_batch_seq_branches.push_back(batch_text.n_tokens);
+                                const llama_tokens & branch     = task->drafted_branches[b - 1];
+                                const llama_seq_id   branch_seq = get_draft_branch_seq_id(seq_id, b);
+                                for (int32_t j = 0, s = int32_t(branch.size()); j < s; j++) {
+                                    common_batch_add(batch_text, branch[j], pos_root + 1 + j, { branch_seq }, true);
+                                }
+                            }
+                            batch_task_ptrs.push_back(std::move(task_ptr));
+                            continue;
+                        }
+                        //// chain
                         common_batch_add(batch_text, task->processed_tokens.back(), task->pos, { seq_id }, true);
                         task->pos++;
                         llm_kv_cache_used++;
@@ -4080,9 +6737,9 @@ struct httpserver {
                     else {
                         SRV_DBG(
                             "rid %s | "
-                            "batching, waiting previous batch finished: different processing type\n",
+                            "batching, waiting previous batch finished: unknown processing state\n",
                             rid.c_str());
-                        process_tasks->enqueue(std::move(task_ptr));
+                        active_task_ptrs.push_back(std::move(task_ptr));
                     }
 
                     continue;
@@ -4092,7 +6749,7 @@ struct httpserver {
                  * embeddings
                  */
 
-                auto * task = dynamic_cast<embeddings_task *>(task_ptr.get());
+                auto * task = static_cast<embeddings_task *>(task_ptr.get());
 
                 // prefill first
                 const auto n_input = int32_t(task->tokenized_inputs.size());
@@ -4102,11 +6759,23 @@ struct httpserver {
                     // allow batch's tokens size be equal to llm_slot_ctx_size
                     if (batch_text.n_tokens + n_pos > llm_slot_ctx_size) {
                         SRV_INF("rid %s | batching, not enough space to fill, waiting\n", rid.c_str());
+                        active_task_ptrs.push_back(std::move(task_ptr));
                         continue;
                     }
-                    // avoid smaller batch size
-                    else if (batch_text.n_tokens + n_pos <= seq_id) {
-                        seq_id = batch_text.n_tokens + n_pos - 1;
+
+                    // take a free slot,
+                    // the slot is held until all the inputs are embedded,
+                    // as a completions task may hold any sequence while prefilling or waiting.
+                    if (seq_id < 0) {
+                        seq_id = acquire_slot();
+                        if (seq_id < 0) {
+                            SRV_DBG(
+                                "rid %s | "
+                                "batching, waiting previous batch finished: no free slot, slots(%d)\n",
+                                rid.c_str(), params.n_slots);
+                            active_task_ptrs.push_back(std::move(task_ptr));
+                            continue;
+                        }
                         task->set_seq_id(seq_id);
                     }
 
@@ -4117,7 +6786,8 @@ struct httpserver {
                         llm_kv_cache_used -= cache.pos;
                         llm_kv_cache_inactive -= cache.pos;
                         cache.tokens.clear();
-                        cache.used        = false;
+                        cache_prompt_tree.erase(seq_id);
+                        cache.used        = true;
                         cache.pos         = 0;
                         cache.pos_discard = 0;
                         // clean kv cache
@@ -4153,7 +6823,7 @@ struct httpserver {
              * images
              */
 
-            auto * task = dynamic_cast<images_task *>(task_ptr.get());
+            auto * task = static_cast<images_task *>(task_ptr.get());
 
             // forward
             const int32_t n_repeat = task->req->n;
@@ -4189,14 +6859,26 @@ struct httpserver {
             if (batch_task_type == TASK_COMPLETIONS) {
                 // decode
                 if (batch_text.n_tokens > 0) {
-                    const int32_t decoded = decode_completion_task_batch(llm_ctx, batch_text, batch_task_ptrs);
+                    const int64_t t_start_decode = ggml_time_us();
+                    const int32_t decoded        = decode_completion_task_batch(llm_ctx, batch_text, batch_task_ptrs);
+                    int64_t       t_decode       = ggml_time_us() - t_start_decode;
+                    if (decoded == 0) {
+                        stage_tasks();
+                    }
+                    if (decoded == 0 && (llm_ctx_draft != nullptr || params.lookup_ngram_min > 0)) {
+                        // restart the timer after staging, which is not a part of the decoding
+                        const int64_t t_start_sync = ggml_time_us();
+                        llama_synchronize(llm_ctx);
+                        t_decode += ggml_time_us() - t_start_sync;
+                        decode_cost_llm.observe(batch_text.n_tokens, double(t_decode) / 1.e3);
+                    }
                     if (decoded != 0) {
                         SRV_ERR(
                             "decode in batch, failed to decode, try again, "
                             "increasing context size or reducing parallel: result = %d\n",
                             decoded);
                         for (const std::unique_ptr<btask> & task_ptr : batch_task_ptrs) {
-                            auto *            task   = dynamic_cast<completions_task *>(task_ptr.get());
+                            auto *            task   = static_cast<completions_task *>(task_ptr.get());
                             const std::string rid    = task->get_r_id();
                             const int32_t     seq_id = task->get_seq_id();
                             // clean kv cache
@@ -4213,6 +6895,7 @@ struct httpserver {
                             if (cache_prompt) {
                                 cache_prompt_entry & cache = cache_prompts.at(seq_id);
                                 cache.tokens.clear();
+                                cache_prompt_tree.erase(seq_id);
                                 cache.used        = false;
                                 cache.pos         = 0;
                                 cache.pos_discard = 0;
@@ -4227,7 +6910,7 @@ struct httpserver {
                                  "failed to decode, try again, "
                                   "increasing context size or reducing parallel" }
                             };
-                            process_task_results[task->get_id()]->enqueue(
+                            task->results->enqueue(
                                 std::make_unique<btask_result>(httplib::InternalServerError_500, std::move(data)));
                         }
                         return;
@@ -4246,13 +6929,14 @@ struct httpserver {
                             "or reducing parallel: result = %d\n",
                             decoded_draft);
                         for (auto & task_ptr : batch_task_ptrs) {
-                            auto *            task   = dynamic_cast<completions_task *>(task_ptr.get());
+                            auto *            task   = static_cast<completions_task *>(task_ptr.get());
                             const std::string rid    = task->get_r_id();
                             const int32_t     seq_id = task->get_seq_id();
                             // clean prompt cache
                             if (cache_prompt) {
                                 cache_prompt_entry & cache = cache_prompts.at(seq_id);
                                 cache.tokens.clear();
+                                cache_prompt_tree.erase(seq_id);
                                 cache.used        = false;
                                 cache.pos         = 0;
                                 cache.pos_discard = 0;
@@ -4275,491 +6959,116 @@ struct httpserver {
                                  "failed to decode draft, try again, "
                                   "increasing context size or reducing parallel" }
                             };
-                            process_task_results[task_ptr->get_id()]->enqueue(
+                            task_ptr->results->enqueue(
                                 std::make_unique<btask_result>(httplib::InternalServerError_500, std::move(data)));
                         }
                         return;
                     }
                 }
-                // sample
+                // sample, the decoded tasks are sampled concurrently, then settled one by one
+                std::vector<completions_task *> & sampling_tasks      = reconcile_sampling_tasks;
+                std::vector<uint8_t> &            sampling_send_texts = reconcile_sampling_send_texts;
+                sampling_tasks.clear();
+                for (auto & task_ptr : batch_task_ptrs) {
+                    auto * task = static_cast<completions_task *>(task_ptr.get());
+                    if (task->n_prefilled >= task->n_prefilling_request) {
+                        sampling_tasks.push_back(task);
+                    }
+                }
+                sample_completion_task_batch(sampling_tasks, sampling_send_texts);
+                if (params.lookup_ngram_min > 0) {
+                    refresh_lookup_cache();
+                }
+                std::vector<std::unique_ptr<btask>> & drafting_task_ptrs = reconcile_drafting_task_ptrs;
+                size_t                                i_sampling_task    = 0;
+                drafting_task_ptrs.clear();
                 for (auto & task_ptr : batch_task_ptrs) {
-                    auto *            task   = dynamic_cast<completions_task *>(task_ptr.get());
-                    const int32_t     tid    = task->get_id();
+                    auto *            task   = static_cast<completions_task *>(task_ptr.get());
                     const std::string rid    = task->get_r_id();
                     const int32_t     seq_id = task->get_seq_id();
-                    // sample token
-                    //// default
-                    if (task->drafted_tokens.empty()) {
-                        const int32_t     tok_idx = task->i_batch_seq_end;
-                        const llama_token tok     = common_sampler_sample2(task->sampler, llm_ctx, tok_idx);
-                        common_sampler_accept(task->sampler, tok, true);
-                        task->push_generated_token(llm_ctx, tok_idx, tok);
-                        task->n_decoded++;
-                        task->n_decoding_budget--;
-                    }
-                    //// include drafted tokens
-                    else {
-                        // +1 for main model decoded token
-                        for (int32_t j = 0, s = int32_t(task->drafted_tokens.size()); j < s + 1; ++j) {
-                            // greedy verification only
-                            const int32_t     tok_idx = task->i_batch_seq_end - s + j;
-                            const llama_token tok     = common_sampler_sample2(task->sampler, llm_ctx, tok_idx);
-                            common_sampler_accept(task->sampler, tok, true);
-                            task->push_generated_token(llm_ctx, tok_idx, tok);
-                            task->n_decoded++;
-                            task->n_decoding_budget--;
-                            if (j < s) {
-                                if (tok != task->drafted_tokens[j]) {
-                                    int32_t d = s - j;
-                                    // back pos to the correct position
-                                    task->pos -= d;
-                                    // stats drafted tokens size
-                                    task->n_decoded += d;
-                                    task->n_decoding_budget -= d;
-                                    // clean kv cache
-                                    llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, task->pos, -1);
-                                    if (llm_ctx_draft != nullptr) {
-                                        llama_memory_seq_rm(llama_get_memory(llm_ctx_draft), seq_id, task->pos, -1);
-                                    }
-                                    SRV_INFV(2,
-                                             "rid %s | decode, "
-                                             "clean kv cache, seq %d = [%d, end)\n",
-                                             rid.c_str(), seq_id, task->pos);
-                                    llm_kv_cache_used -= d;
-                                    break;
-                                }
-                                task->n_drafted_accepted++;
-                            }
+                    // continue if prefilling in chunk
+                    if (task->n_prefilled < task->n_prefilling_request) {
+                        if (!task_ptr->is_connection_closed()) {
+                            active_task_ptrs.push_back(std::move(task_ptr));
+                            continue;
                         }
+                        // clean kv cache
+                        llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, 0, -1);
+                        if (llm_ctx_draft != nullptr) {
+                            llama_memory_seq_rm(llama_get_memory(llm_ctx_draft), seq_id, 0, -1);
+                        }
+                        SRV_INFV(2,
+                                 "rid %s | prefill in chunk, closed, "
+                                 "clean kv cache, seq %d = [0, end)\n",
+                                 rid.c_str(), seq_id);
+                        llm_kv_cache_used -= task->pos;
+                        // clean prompt cache
+                        if (cache_prompt) {
+                            cache_prompt_entry & cache = cache_prompts.at(seq_id);
+                            cache.tokens.clear();
+                            cache_prompt_tree.erase(seq_id);
+                            cache.used        = false;
+                            cache.pos         = 0;
+                            cache.pos_discard = 0;
+                            SRV_INFV(2,
+                                     "rid %s | released cache prompt, "
+                                     "seq = %d, kv_cache_used = %d, kv_cache_inactive = %d\n",
+                                     rid.c_str(), seq_id, llm_kv_cache_used, llm_kv_cache_inactive);
+                        }
+                        SRV_INF("rid %s | prefill_t = %d/%d, stop_r = closed\n", rid.c_str(), task->n_prefilled,
+                                task->n_prefilling_request);
+                        continue;
                     }
-                    // speculative - lookup
-                    if (params.lookup_ngram_min > 0) {
-                        common_ngram_cache_update(task->ngram_cache, params.lookup_ngram_min, LLAMA_NGRAM_MAX,
-                                                  task->processed_tokens, 1, false);
-                    }
+                    // settle the kv cache of the verified drafted tokens
+                    settle_completion_task(task);
                     // stats
                     if (task->n_decoded == 1) {
                         task->t_start_decode = ggml_time_us();
                         task->t_prefilled    = double(task->t_start_decode - task->t_start_prefill) / 1.e3;
                         metrics.on_tokens_prefilled(task->t_prefilled, task->n_prefilled);
                         task->p_prefilled_tps = 1.e3 / task->t_prefilled * task->n_prefilled;
-                    }
-                    // postprocess
-                    bool send_text = false;
-                    {
-                        const int32_t n_generated_tokens_s = task->n_processed_detokenized;
-                        const int32_t n_generated_tokens_e = int32_t(task->processed_tokens.size());
-                        std::string   sampled_str;
-                        for (; task->n_processed_detokenized < n_generated_tokens_e; task->n_processed_detokenized++) {
-                            llama_token tok = task->processed_tokens[task->n_processed_detokenized];
-                            // accept special token
-                            bool        special =
-                                params.llm_params.special || task->req->sampling.preserved_tokens.find(tok) !=
-                                                                 task->req->sampling.preserved_tokens.end();
-                            // has reasoning
-                            if (support_reasoning && !task->reasoning_finished) {
-                                // find reasoning begin [in token]
-                                if (!task->reasoning_start_found) {
-                                    if (reasoning_start_token != LLAMA_TOKEN_NULL) {
-                                        task->reasoning_start_found = tok == reasoning_start_token;
-                                        if (task->reasoning_start_found) {
-                                            // ignore reasoning start content if needed
-                                            if (!reasoning_in_content) {
-                                                continue;
-                                            }
-                                        }
-                                        // finish reasoning analysis as not found any available start
-                                        else {
-                                            task->reasoning_finished = true;
-                                        }
-                                    }
-                                }
-                                // find reasoning end [in token]
-                                else if (!task->reasoning_end_found) {
-                                    if (reasoning_end_token != LLAMA_TOKEN_NULL) {
-                                        task->n_reasoning++;
-                                        task->reasoning_end_found = tok == reasoning_end_token;
-                                        if (task->reasoning_end_found) {
-                                            // ignore reasoning end content if needed
-                                            if (!reasoning_in_content) {
-                                                continue;
-                                            }
-                                        }
-                                    }
-                                }
-                                // finish
-                                else if (!task->reasoning_finished) {
-                                    task->reasoning_finished = true;
-                                    // avoid to remember the thinking content
-                                    if (!task->is_stream() && !reasoning_in_content) {
-                                        task->generated_reasoning_text.swap(task->generated_text);
-                                    } else {
-                                        task->generated_text.clear();
-                                    }
-                                }
-                            }
-                            sampled_str += common_token_to_piece(llm_ctx, tok, special);
-                        }
-                        task->generated_text += sampled_str;
-                        send_text = get_position_of_utf8(task->generated_text) == task->generated_text.size();
-                        if (send_text && common_log_verbosity_thold > 5) {
-                            SRV_DBG("rid %s | sampled str: %s\n", rid.c_str(), escape_string(sampled_str).c_str());
-                        }
-                        // check stop
-                        //// check stop word or tool call
-                        if (send_text) {
-                            // has stop words
-                            for (const std::string & word : task->req->stop) {
-                                size_t pos =
-                                    task->generated_text.find(word, task->generated_text.size() - sampled_str.size());
-                                if (pos != std::string::npos) {
-                                    SRV_DBG("rid %s | stopped by word\n", rid.c_str());
-                                    task->generated_finish_reason = "stop";
-                                    task->generated_text_keep_pos = pos;
-                                    break;
-                                }
-                            }
-                            // has reasoning
-                            if (support_reasoning && !task->reasoning_finished &&
-                                reasoning_start_token == LLAMA_TOKEN_NULL) {
-                                // find reasoning begin [in word]
-                                if (!task->reasoning_start_found) {
-                                    send_text = false;  // avoid to send text before reasoning start
-                                    task->reasoning_start_found =
-                                        string_starts_with(task->generated_text, reasoning_start_word);
-                                    if (task->reasoning_start_found) {
-                                        send_text = true;
-                                        task->n_reasoning++;
-                                        // ignore reasoning start content if needed
-                                        if (!reasoning_in_content) {
-                                            task->generated_text.clear();
-                                        }
-                                    }
-                                    // finish reasoning analysis as not found any available start
-                                    else if (task->generated_text.length() > reasoning_start_word.length()) {
-                                        task->reasoning_finished = true;
-                                        send_text                = true;
-                                    }
-                                }
-                                // find reasoning end [in word]
-                                else if (!task->reasoning_end_found) {
-                                    task->n_reasoning++;
-                                    task->reasoning_end_found =
-                                        string_ends_with(task->generated_text, reasoning_end_word);
-                                    if (task->reasoning_end_found) {
-                                        // ignore reasoning end content if needed
-                                        if (!reasoning_in_content) {
-                                            size_t pos = task->generated_text.rfind(reasoning_end_word);
-                                            task->generated_text_keep_pos = pos;
-                                            task->generated_text          = task->generated_text.erase(pos);
-                                        }
-                                    } else {
-                                        send_text = reasoning_end_word.find(sampled_str) == std::string::npos;
-                                    }
-                                }
-                            }
-                            // find tool call
-                            if (task->tokenized_prompts_include_tools && task->reasoning_finished) {
-                                //// jinja
-                                if (params.llm_params.use_jinja) {
-                                    if (common_sampler_grammer_lazy_triggered(task->sampler)) {
-                                        send_text                 = false;
-                                        std::string functions_str = task->generated_text;
-                                        if (!functions_str.empty()) {
-                                            try {
-                                                common_chat_msg msg = common_chat_parse(functions_str, false,
-                                                                                        task->tokenized_prompts_syntax);
-                                                if (!msg.tool_calls.empty()) {
-                                                    for (const common_chat_tool_call & tc : msg.tool_calls) {
-                                                        task->generated_tool_calls.push_back({
-                                                            { "type",     "function"                                },
-                                                            { "function",
-                                                             { { "name", tc.name }, { "arguments", tc.arguments } } },
-                                                            { "id",       tc.id.empty() ? gen_call_id() : tc.id     },
-                                                        });
-                                                    }
-                                                    if (task->tool_call_stop_fast) {
-                                                        SRV_DBG("rid %s | stopped by tool call\n", rid.c_str());
-                                                        task->generated_finish_reason =
-                                                            "tool_calls";  // send_text = true;
-                                                    }
-                                                    // eat the rest of the text
-                                                    task->generated_text_keep_pos = std::string::npos;
-                                                    task->generated_text.clear();
-                                                }
-                                            } catch (const std::exception & e) {
-                                                task->generated_text_keep_pos = 0;
-                                            }
-                                        }
-                                    }
-                                }
-                                //// non-jinja
-                                else {
-                                    ////// found tool call start
-                                    if (!task->tool_call_start_found) {
-                                        if (!tool_call_start_tokens.empty()) {
-                                            // stop sending text if the start token found
-                                            for (int32_t i = n_generated_tokens_s; i < n_generated_tokens_e; i++) {
-                                                for (const llama_token & token : tool_call_start_tokens) {
-                                                    if (task->processed_tokens[i] == token) {
-                                                        task->tool_call_start_found = true;
-                                                        if (!sampled_str.empty() && tool_call_start_trim) {
-                                                            // trim the start word if needed
-                                                            for (const std::string & sw : tool_call_start_words) {
-                                                                if (size_t sp = task->generated_text.find(sw);
-                                                                    sp != std::string::npos) {
-                                                                    task->generated_text_keep_pos = sp;
-                                                                    // trim the start word
-                                                                    task->generated_text = task->generated_text.erase(
-                                                                        sp, sp + sw.length());
-                                                                }
-                                                            }
-                                                        }
-                                                        break;
-                                                    }
-                                                }
-                                                if (task->tool_call_start_found) {
-                                                    break;
-                                                }
-                                            }
-                                        } else if (!tool_call_start_words.empty()) {
-                                            // stop sending text if the start word found
-                                            if (task->generated_text.size() <= tool_call_start_words_longest_length) {
-                                                send_text = false;
-                                            } else {
-                                                for (const std::string & sw : tool_call_start_words) {
-                                                    if (size_t sp = task->generated_text.find(sw);
-                                                        sp != std::string::npos) {
-                                                        task->tool_call_start_found   = true;
-                                                        task->generated_text_keep_pos = sp;
-                                                        if (tool_call_start_trim) {
-                                                            // trim the start word
-                                                            task->generated_text =
-                                                                task->generated_text.erase(sp, sp + sw.length());
-                                                        }
-                                                        break;
-                                                    }
-                                                }
-                                            }
-                                        }
-                                    }
-                                    ////// found tool call end
-                                    else {
-                                        send_text = false;
-                                        std::string functions_str;
-                                        if (!tool_call_end_tokens.empty()) {
-                                            for (int32_t i = n_generated_tokens_e - 1; i >= n_generated_tokens_s; --i) {
-                                                for (const llama_token & token : tool_call_end_tokens) {
-                                                    if (task->processed_tokens[i] == token) {
-                                                        size_t sp     = task->generated_text_keep_pos;
-                                                        sp            = sp == std::string::npos ? 0 : sp;
-                                                        functions_str = task->generated_text.substr(sp);
-                                                        break;
-                                                    }
-                                                }
-                                                if (!functions_str.empty()) {
-                                                    if (tool_call_end_trim) {
-                                                        for (const std::string & ew : tool_call_end_words) {
-                                                            if (size_t ep = functions_str.rfind(ew);
-                                                                ep != std::string::npos) {
-                                                                functions_str = functions_str.substr(0, ep);
-                                                            }
-                                                        }
-                                                    }
-                                                    break;
-                                                }
-                                            }
-                                        } else if (!tool_call_end_words.empty()) {
-                                            for (const std::string & ew : tool_call_end_words) {
-                                                if (size_t ep = task->generated_text.rfind(ew);
-                                                    ep != std::string::npos) {
-                                                    if (!tool_call_end_trim) {
-                                                        ep += ew.length();
-                                                    }
-                                                    size_t sp     = task->generated_text_keep_pos;
-                                                    sp            = sp == std::string::npos ? 0 : sp;
-                                                    functions_str = task->generated_text.substr(sp, ep);
-                                                    break;
-                                                }
-                                            }
-                                        }
-                                        if (!functions_str.empty()) {
-                                            try {
-                                                auto append_tool_calls = [&](json & function) {
-                                                    if (!function.is_object()) {
-                                                        throw std::runtime_error("function is an object");
-                                                    }
-                                                    if (!function.contains("name")) {
-                                                        throw std::runtime_error("function does not contain \"name\"");
-                                                    }
-                                                    if (!function.contains("arguments")) {
-                                                        throw std::runtime_error(
-                                                            "function does not contain \"arguments\"");
-                                                    }
-                                                    if (!function.at("arguments").is_string()) {
-                                                        function["arguments"] =
-                                                            function.at("arguments")
-                                                                .dump(-1, ' ', false, json::error_handler_t::replace);
-                                                    }
-                                                    json tool_call = {
-                                                        { "type",     "function"    },
-                                                        { "function", function      },
-                                                        { "id",       gen_call_id() },
-                                                    };
-                                                    task->generated_tool_calls.push_back(tool_call);
-                                                };
-                                                // json
-                                                if (tool_call_format == "json") {
-                                                    json functions = json::parse(functions_str);
-                                                    if (functions.is_array()) {
-                                                        for (auto & function : functions) {
-                                                            append_tool_calls(function);
-                                                        }
-                                                    } else {
-                                                        append_tool_calls(functions);
-                                                    }
-                                                }
-                                                // function
-                                                else {
-                                                    const std::string name_s = "function";
-                                                    const std::string func_s = "```json\n";
-                                                    const std::string func_e = "```";
-                                                    size_t            sp     = functions_str.find(name_s);
-                                                    for (; sp != std::string::npos;) {
-                                                        sp += name_s.length();
-                                                        size_t ep = functions_str.find(func_s, sp);
-                                                        if (ep == std::string::npos) {
-                                                            break;  // incomplete
-                                                        }
-                                                        json fn{};
-                                                        fn["name"] = functions_str.substr(sp, ep - sp - 1);
-                                                        sp         = ep + func_s.length();
-                                                        ep         = functions_str.find(func_e, sp);
-                                                        if (ep == std::string::npos) {
-                                                            break;  // incomplete
-                                                        }
-                                                        fn["arguments"] = functions_str.substr(sp, ep - sp - 1);
-                                                        append_tool_calls(fn);
-                                                        sp = ep + func_e.length();
-                                                        sp = functions_str.find(name_s, sp);
-                                                    }
-                                                }
-                                                if (!task->generated_tool_calls.empty()) {
-                                                    if (task->tool_call_stop_fast) {
-                                                        SRV_DBG("rid %s | stopped by tool call\n", rid.c_str());
-                                                        task->generated_finish_reason =
-                                                            "tool_calls";  // send_text = true;
-                                                    }
-                                                    // eat the rest of the text
-                                                    task->generated_text_keep_pos = std::string::npos;
-                                                    task->generated_text.clear();
-                                                }
-                                            } catch (const std::exception & e) {
-                                                task->generated_text_keep_pos = 0;
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                        }
-                        //// check eog or budget
-                        if (task->generated_finish_reason.empty()) {
-                            // end of generation
-                            if (llama_vocab_is_eog(llm_vocab, task->processed_tokens.back())) {
-                                if (task->generated_tool_calls.empty()) {
-                                    SRV_DBG("rid %s | stopped by EOG\n", rid.c_str());
-                                    task->generated_finish_reason = "stop";
-                                } else {
-                                    SRV_DBG("rid %s | stopped by tool call\n", rid.c_str());
-                                    task->generated_finish_reason = "tool_calls";
-                                }
-                                task->generated_text_keep_pos = task->generated_text.size();
-                            }
-                            // no enough budget
-                            else if (task->n_decoding_budget <= 0) {
-                                SRV_DBG("rid %s | stopped by length\n", rid.c_str());
-                                task->generated_finish_reason = "length";
-                                task->generated_text_keep_pos = task->generated_text.size();
-                            }
+                        // index the prefilled prompt, so that the following requests can share it
+                        if (cache_prompt && task->pos_discard == 0) {
+                            cache_prompt_tree.insert(seq_id, task->processed_tokens, task->n_prefilling_request);
                         }
                     }
+                    const bool send_text = sampling_send_texts[i_sampling_task++];
                     // continue if not finished
                     bool opened = true;
                     if (task->generated_finish_reason.empty()) {
                         // stream outputting
                         if (send_text && task_ptr->is_stream()) {
                             json data = task->to_json(llm_ctx, reasoning_in_content);
-                            process_task_results[tid]->enqueue(
+                            task->results->enqueue(
                                 std::make_unique<btask_result>(httplib::Continue_100, std::move(data)));
                         }
                         // speculative
                         if (!task->tokenized_prompts_include_multimedias) {
                             task->drafted_tokens.clear();
-                            //// draft
-                            if (llm_ctx_draft != nullptr) {
-                                // clean batch for later adding
-                                common_batch_clear(batch_text_draft);
-                                common_batch_add(batch_text_draft, task->processed_tokens.back(), task->pos, { seq_id },
-                                                 true);
-                                int32_t decoded_draft = llama_decode(llm_ctx_draft, batch_text_draft);
-                                if (decoded_draft != 0) {
-                                    SRV_ERR(
-                                        "rid %s | decode draft, failed to decode, try again, "
-                                        "increasing context size or reducing requests: result = %d\n",
-                                        rid.c_str(), decoded_draft);
-                                    // output
-                                    json data = {
-                                        { "message",
-                                         "failed to decode draft, try again, "
-                                          "increasing context size or reducing parallel" }
-                                    };
-                                    process_task_results[tid]->enqueue(std::make_unique<btask_result>(
-                                        httplib::InternalServerError_500, std::move(data)));
-                                    continue;
-                                }
-                                // speculative in n_max times
-                                for (int32_t j = 0; j < params.llm_params.speculative.n_max; ++j) {
-                                    const llama_token tok =
-                                        common_sampler_sample2(task->sampler_draft, llm_ctx_draft, 0);
-                                    const llama_token_data_array * cur_p =
-                                        common_sampler_get_candidates(task->sampler_draft);
-                                    if (cur_p->data[0].p < params.llm_params.speculative.p_min) {
-                                        break;
-                                    }
-                                    common_sampler_accept(task->sampler_draft, tok, true);
-                                    task->n_drafted++;
-                                    if (llama_vocab_is_eog(llm_vocab_draft, tok)) {
-                                        break;
-                                    }
-                                    task->drafted_tokens.push_back(tok);
-                                    // clean batch for later adding
-                                    common_batch_clear(batch_text_draft);
-                                    common_batch_add(batch_text_draft, tok, task->pos + 1 + j, { seq_id }, true);
-                                    decoded_draft = llama_decode(llm_ctx_draft, batch_text_draft);
-                                    if (decoded_draft != 0) {
-                                        SRV_INFV(2,
-                                                 "rid %s | decode draft, "
-                                                 "clean kv cache, seq %d = [0, end)\n",
-                                                 rid.c_str(), seq_id);
-                                        break;
-                                    }
-                                }
-                                // ignore if less than n_min
-                                if (int32_t(task->drafted_tokens.size()) < params.llm_params.speculative.n_min) {
-                                    task->drafted_tokens.clear();
-                                }
+                            task->drafted_probs.clear();
+                            task->drafted_branches.clear();
+                            task->n_draft_limit =
+                                plan_draft_length(task, batch_text.n_tokens, int32_t(sampling_tasks.size()));
+                            //// prediction
+                            if (task->n_draft_limit > 0 && !task->req->prediction.empty()) {
+                                task->draft_prediction(task->n_draft_limit);
+                            }
+                            //// draft, in lockstep with the other tasks after sampling
+                            if (task->drafted_tokens.empty() && task->n_draft_limit > 0 && llm_ctx_draft != nullptr &&
+                                !task_ptr->is_connection_closed()) {
+                                drafting_task_ptrs.push_back(std::move(task_ptr));
+                                continue;
                             }
                             //// lookup ngram
-                            if (params.lookup_ngram_min > 0) {
+                            if (task->n_draft_limit > 0 && params.lookup_ngram_min > 0) {
                                 size_t n_drafted = task->drafted_tokens.size();
                                 if (n_drafted == 0) {
                                     task->drafted_tokens.push_back(task->processed_tokens.back());
                                 }
-                                common_ngram_cache ngram_cache_empty;
                                 common_ngram_cache_draft(task->processed_tokens, task->drafted_tokens,
-                                                         params.llm_params.speculative.n_max, params.lookup_ngram_min,
-                                                         LLAMA_NGRAM_MAX, task->ngram_cache, ngram_cache_empty,
-                                                         ngram_cache_empty);
+                                                         task->n_draft_limit, params.lookup_ngram_min,
+                                                         LLAMA_NGRAM_MAX, task->ngram_cache, *lookup_cache_dynamic_view,
+                                                         lookup_cache_static);
                                 if (n_drafted == 0) {
                                     task->drafted_tokens.erase(task->drafted_tokens.begin());
                                 }
@@ -4768,7 +7077,7 @@ struct httpserver {
                         }
                         // enqueue
                         if (!task_ptr->is_connection_closed()) {
-                            process_tasks->enqueue(std::move(task_ptr));
+                            active_task_ptrs.push_back(std::move(task_ptr));
                             continue;
                         }
                         opened = false;
@@ -4783,7 +7092,7 @@ struct httpserver {
                     // output
                     if (opened) {
                         json data = task->to_json(llm_ctx, reasoning_in_content);
-                        process_task_results[tid]->enqueue(
+                        task->results->enqueue(
                             std::make_unique<btask_result>(httplib::OK_200, std::move(data)));
                     }
                     SRV_INF(
@@ -4797,6 +7106,10 @@ struct httpserver {
                         task->t_prefilled, task->n_decoded, task->p_decoded_tps,
                         task->t_decoded / double(task->n_decoded), task->n_drafted, task->p_drafted_apt * 100,
                         task->n_prefilled + task->n_decoded, opened ? task->generated_finish_reason.c_str() : "closed");
+                    // learn the lookup cache
+                    if (params.lookup_ngram_min > 0 && !task->ngram_cache.empty()) {
+                        learn_lookup_cache(std::move(task->ngram_cache));
+                    }
                     // clean kv cache
                     if (!cache_prompt) {
                         llama_memory_seq_rm(llama_get_memory(llm_ctx), seq_id, 0, -1);
@@ -4817,12 +7130,42 @@ struct httpserver {
                         cache.pos  = task->pos;
                         cache.pos_discard += task->pos_discard;
                         llm_kv_cache_inactive += task->pos;
+                        // index the prefix which is still in place,
+                        // the shifted kv cache only keeps the tokens before n_keep
+                        cache_prompt_tree.insert(seq_id, cache.tokens,
+                                                 cache.pos_discard > 0 ?
+                                                     std::min(params.llm_params.n_keep + 1, cache.pos) :
+                                                     cache.pos);
                         SRV_INFV(2,
                                  "rid %s | released cache prompt, "
                                  "seq = %d, kv_cache_used = %d, kv_cache_inactive = %d\n",
                                  rid.c_str(), seq_id, llm_kv_cache_used, llm_kv_cache_inactive);
                     }
                 }
+                // draft
+                if (!drafting_task_ptrs.empty()) {
+                    draft_completion_task_batch(drafting_task_ptrs);
+                    for (auto & task_ptr : drafting_task_ptrs) {
+                        auto * task = static_cast<completions_task *>(task_ptr.get());
+                        //// lookup ngram
+                        if (params.lookup_ngram_min > 0) {
+                            size_t n_drafted = task->drafted_tokens.size();
+                            if (n_drafted == 0) {
+                                task->drafted_tokens.push_back(task->processed_tokens.back());
+                            }
+                            common_ngram_cache_draft(task->processed_tokens, task->drafted_tokens,
+                                                     task->n_draft_limit, params.lookup_ngram_min,
+                                                     LLAMA_NGRAM_MAX, task->ngram_cache, *lookup_cache_dynamic_view,
+                                                     lookup_cache_static);
+                            if (n_drafted == 0) {
+                                task->drafted_tokens.erase(task->drafted_tokens.begin());
+                            }
+                            task->n_drafted += int32_t(task->drafted_tokens.size() - n_drafted);
+                        }
+                        // enqueue
+                        active_task_ptrs.push_back(std::move(task_ptr));
+                    }
+                }
                 return;
             }
 
@@ -4840,19 +7183,19 @@ struct httpserver {
                 llama_memory_clear(llama_get_memory(llm_ctx), true);
                 // output
                 for (auto & task_ptr : batch_task_ptrs) {
+                    release_slot(task_ptr->get_seq_id());
                     json data = {
                         { "message",
                          "failed to decode, try again, "
                           "increasing context size or reducing parallel" }
                     };
-                    process_task_results[task_ptr->get_id()]->enqueue(
+                    task_ptr->results->enqueue(
                         std::make_unique<btask_result>(httplib::InternalServerError_500, std::move(data)));
                 }
                 return;
             }
             for (auto & task_ptr : batch_task_ptrs) {
-                auto *            task    = dynamic_cast<embeddings_task *>(task_ptr.get());
-                const int32_t     tid     = task->get_id();
+                auto *            task    = static_cast<embeddings_task *>(task_ptr.get());
                 const std::string rid     = task->get_r_id();
                 const req_type    rtype   = task->get_r_type();
                 const int32_t     seq_id  = task->get_seq_id();
@@ -4870,6 +7213,7 @@ struct httpserver {
                 }
                 if (embed == nullptr) {
                     SRV_WRN("rid %s | decode in batch, failed to get embeddings\n", rid.c_str());
+                    release_slot(seq_id);
                     continue;
                 }
                 if (rtype == REQ_EMBED) {
@@ -4893,11 +7237,14 @@ struct httpserver {
                 bool opened = true;
                 if (task->embeds.size() < n_input) {
                     if (!task_ptr->is_connection_closed()) {
-                        process_tasks->enqueue(std::move(task_ptr));
+                        active_task_ptrs.push_back(std::move(task_ptr));
                         continue;
                     }
                     opened = false;
                 }
+                // release slot
+                release_slot(seq_id);
+                task->set_seq_id(-1);
                 // stats
                 task->t_prefilled = double(ggml_time_us() - task->t_start_prefill) / 1.e3;
                 metrics.on_tokens_prefilled(task->t_prefilled, task->n_prefilled);
@@ -4905,7 +7252,7 @@ struct httpserver {
                 // output
                 if (opened) {
                     json data = task->to_json();
-                    process_task_results[tid]->enqueue(
+                    task->results->enqueue(
                         std::make_unique<btask_result>(httplib::OK_200, std::move(data)));
                 }
                 SRV_INF(
@@ -4924,7 +7271,7 @@ struct httpserver {
          */
 
         for (auto & task_ptr : batch_task_ptrs) {
-            auto *     task    = dynamic_cast<images_task *>(task_ptr.get());
+            auto *     task    = static_cast<images_task *>(task_ptr.get());
             const bool preview = json_value(task->req->stream_options, "preview", false) ||
                                  json_value(task->req->stream_options, "preview_faster", false);
             const int32_t     tid      = task->get_id();
@@ -4967,7 +7314,7 @@ struct httpserver {
                             task->b64_jsons[n]      = std::move(b64_json);
                         }
                         json data = task->to_json(n);
-                        process_task_results[tid]->enqueue(
+                        task->results->enqueue(
                             std::make_unique<btask_result>(httplib::Continue_100, std::move(data)));
                     }
                 } else {
@@ -4978,7 +7325,7 @@ struct httpserver {
                     // stream outputting, but not the last one
                     if (task->is_stream() && n + 1 < n_repeat) {
                         json data = task->to_json(n);
-                        process_task_results[tid]->enqueue(
+                        task->results->enqueue(
                             std::make_unique<btask_result>(httplib::Continue_100, std::move(data)));
                     }
                 }
@@ -4987,7 +7334,7 @@ struct httpserver {
             bool opened = true;
             if (incomplete) {
                 if (!task_ptr->is_connection_closed()) {
-                    process_tasks->enqueue(std::move(task_ptr));
+                    active_task_ptrs.push_back(std::move(task_ptr));
                     continue;
                 }
                 opened = false;
@@ -5004,7 +7351,7 @@ struct httpserver {
                 } else {
                     data = task->to_json(-1);
                 }
-                process_task_results[tid]->enqueue(std::make_unique<btask_result>(httplib::OK_200, std::move(data)));
+                task->results->enqueue(std::make_unique<btask_result>(httplib::OK_200, std::move(data)));
             }
             SRV_INF(
                 "rid %s | "
@@ -5020,7 +7367,6 @@ struct httpserver {
                     std::unique_ptr<btask> && task_ptr) {
         PIN_THREAD;
 
-        const int32_t     tid        = task_ptr->get_id();
         const task_type   ttype      = task_ptr->get_type();
         const std::string rid        = task_ptr->get_r_id();
         const req_type    rtype      = task_ptr->get_r_type();
@@ -5028,14 +7374,17 @@ struct httpserver {
         const bool        chunk      = stream && json_value(task_ptr->get_stream_options(), "chunk", false);
         const int32_t     chunk_size = json_value(task_ptr->get_stream_options(), "chunk_size", 4096);
 
-        // enqueue task
+        // enqueue task, the results are routed back through the queue held by the task
+        const std::shared_ptr<BlockingReaderWriterQueue<std::unique_ptr<btask_result>>> results =
+            std::make_shared<BlockingReaderWriterQueue<std::unique_ptr<btask_result>>>();
+        task_ptr->results = results;
         process_tasks->enqueue(std::move(task_ptr));
 
         // non-streaming
         if (!stream) {
             // dequeue result
             std::unique_ptr<btask_result> result_ptr;
-            process_task_results[tid]->wait_dequeue(result_ptr);
+            results->wait_dequeue(result_ptr);
 
             // output result
             int32_t status = send_json(request, response, result_ptr->status, result_ptr->result);
@@ -5049,20 +7398,31 @@ struct httpserver {
         const auto on_chunk = [=](size_t, httplib::DataSink & sink) {
             // dequeue result
             std::unique_ptr<btask_result> result_ptr;
-            process_task_results[tid]->wait_dequeue(result_ptr);
+            results->wait_dequeue(result_ptr);
 
             // output result
-            //// completions or embeddings
+            //// completions or embeddings,
+            //// coalesce the results arrived meanwhile into one write, so a slow client costs fewer writes
             if (ttype != TASK_IMAGES) {
-                int32_t status = send_event_json(sink, result_ptr->status, result_ptr->result);
-                if (status != httplib::OK_200) {
+                if (!sink.is_writable()) {
                     SRV_FUNC_ERR("process", "rid %s | failed to send event response, status = %d\n", rid.c_str(),
-                                 status);
+                                 httplib::RequestTimeout_408);
                     return false;
                 }
-                if (result_ptr->status != httplib::Continue_100) {
+                std::string buffer;
+                format_event_json(buffer, result_ptr->status, result_ptr->result);
+                while (result_ptr->status == httplib::Continue_100 && results->try_dequeue(result_ptr)) {
+                    format_event_json(buffer, result_ptr->status, result_ptr->result);
+                }
+                if (!sink.write(buffer.c_str(), buffer.size())) {
+                    SRV_FUNC_ERR("process", "rid %s | failed to send event response, status = %d\n", rid.c_str(),
+                                 httplib::RequestTimeout_408);
                     return false;
                 }
+                if (result_ptr->status != httplib::Continue_100) {
+                    // terminate the chunked body, then keep the connection alive for the next request
+                    sink.done();
+                }
             }
             //// images
             else {
@@ -5098,149 +7458,209 @@ struct httpserver {
                         }
                     }
                 }
-                if (result_ptr->status != httplib::Continue_100) {
-                    return false;
-                }
             }
 
+            // returning true after the sink is done ends the provider without canceling,
+            // which would close the connection
             return true;
         };
         response.set_header(HEADER_CACHE_CONTROL, "no-cache, no-store, no-transform");
-        response.set_header(HEADER_CONNECTION, "close");
         response.set_chunked_content_provider("text/event-stream", on_chunk);
         return httplib::OK_200;
     }
 
-    std::vector<llama_multimodal_tokens> cache_tokenize_multimedia(const char *                        rid,
-                                                                   std::unique_ptr<clip_multimedia> && mtmd) {
-        if (llm_ctx_clip_v == nullptr && llm_ctx_clip_a == nullptr) {
-            return {};
-        }
-
+    // tokenize_multimedia, encodes the given multimedia,
+    // must be called from the multimodal encoder worker, as the clip contexts are not thread-safe.
+    std::vector<llama_multimodal_tokens> tokenize_multimedia(const char * rid, const clip_multimedia * mtmd) {
         std::string type = mtmd->is_audio ? "audio" : "image";
 
         std::vector<llama_multimodal_tokens> result;
 
-        std::unique_lock<std::mutex> lock(llm_ctx_clip_mtx);
+        SRV_INFV(2,
+                 "rid %s | tokenizing, "
+                 "type = %s, hash = %s\n",
+                 rid, type.c_str(), mtmd->hash.c_str());
+        if (mtmd->is_audio) {
+            if (llm_ctx_clip_a == nullptr) {
+                SRV_ERR("rid %s | tokenizing, audio clip is not initialized\n", rid);
+                return result;
+            }
+            result = tokenize_audio(llm_ctx_clip_a, params.n_threads_mmproj, mtmd->ptr.get(), mtmd->hash);
+        } else {
+            if (llm_ctx_clip_v == nullptr) {
+                SRV_ERR("rid %s | tokenizing, vision clip is not initialized\n", rid);
+                return result;
+            }
+            result = tokenize_image(llm_ctx_clip_v, params.n_threads_mmproj, mtmd->ptr.get(), mtmd->hash);
+        }
+        if (common_log_verbosity_thold >= 2) {
+            int32_t n_tokens     = 0;
+            int32_t n_pos        = 0;
+            size_t  n_embed_size = 0;
+            for (const auto & token : result) {
+                n_tokens += token.n_tokens;
+                n_pos += token.n_pos;
+                n_embed_size += token.embed->size() * sizeof(float);
+            }
+            SRV_INF(
+                "rid %s | tokenized,  "
+                "type = %s, hash = %s, n_tokens = %d, n_pos = %d, n_embed_size = %zu kib\n",
+                rid, type.c_str(), mtmd->hash.c_str(), n_tokens, n_pos, n_embed_size >> 10);
+        }
 
-        // check if resource hash is empty or cache is disabled.
-        if (mtmd->hash.empty() || params.max_projected_cache <= 0) {
-            SRV_INFV(2,
-                     "rid %s | tokenizing, "
-                     "type = %s, hash = %s\n",
-                     rid, type.c_str(), mtmd->hash.c_str());
-            if (mtmd->is_audio) {
-                if (llm_ctx_clip_a == nullptr) {
-                    SRV_ERR("rid %s | tokenizing, audio clip is not initialized\n", rid);
-                    return result;
-                }
-                result = tokenize_audio(llm_ctx_clip_a, params.llm_params.cpuparams.n_threads, mtmd->ptr.get());
-            } else {
-                if (llm_ctx_clip_v == nullptr) {
-                    SRV_ERR("rid %s | tokenizing, vision clip is not initialized\n", rid);
-                    return result;
-                }
-                result = tokenize_image(llm_ctx_clip_v, params.llm_params.cpuparams.n_threads, mtmd->ptr.get());
+        return result;
+    }
+
+    // cache_get_multimedia, returns true and fills the given result if the multimedia is cached,
+    // the result shares the embeddings with the cache.
+    bool cache_get_multimedia(const char * rid, const clip_multimedia * mtmd,
+                              std::vector<llama_multimodal_tokens> & result) {
+        llama_multimodal_cache::tokens_ptr hit = cache_multimodals.get(mtmd->hash);
+        if (hit == nullptr) {
+            return false;
+        }
+        result = *hit;
+        if (common_log_verbosity_thold >= 2) {
+            int32_t n_tokens     = 0;
+            int32_t n_pos        = 0;
+            size_t  n_embed_size = 0;
+            for (const auto & token : result) {
+                n_tokens += token.n_tokens;
+                n_pos += token.n_pos;
+                n_embed_size += token.embed->size() * sizeof(float);
             }
-            if (common_log_verbosity_thold >= 2) {
-                int32_t n_tokens     = 0;
-                int32_t n_pos        = 0;
-                size_t  n_embed_size = 0;
-                for (const auto & token : result) {
-                    n_tokens += token.n_tokens;
-                    n_pos += token.n_pos;
-                    n_embed_size += token.embed.size() * sizeof(float);
-                }
-                SRV_INF(
-                    "rid %s | tokenized,  "
-                    "type = %s, hash = %s, n_tokens = %d, n_pos = %d, n_embed_size = %zu kib\n",
-                    rid, type.c_str(), mtmd->hash.c_str(), n_tokens, n_pos, n_embed_size >> 10);
-            }
-        }
-        // check if resource is already cached.
-        else if (auto hit = cache_multimodals.find(mtmd->hash); hit != cache_multimodals.end()) {
-            hit->second.last_used = ggml_time_us();
-            result                = hit->second.tokens;
-            if (common_log_verbosity_thold >= 2) {
-                int32_t n_tokens     = 0;
-                int32_t n_pos        = 0;
-                size_t  n_embed_size = 0;
-                for (const auto & token : result) {
+            SRV_INF(
+                "rid %s | cached,     "
+                "type = %s, hash = %s, n_tokens = %d, n_pos = %d, n_embed_size = %zu kib\n",
+                rid, mtmd->is_audio ? "audio" : "image", mtmd->hash.c_str(), n_tokens, n_pos, n_embed_size >> 10);
+        }
+        return true;
+    }
+
+    // cache_put_multimedia, caches the given result, evicts the least recently used ones if the cache is full.
+    void cache_put_multimedia(const char * rid, const clip_multimedia * mtmd,
+                              const std::vector<llama_multimodal_tokens> & result) {
+        std::vector<llama_multimodal_cache::entry> evicted = cache_multimodals.put(
+            mtmd->hash, std::make_shared<const std::vector<llama_multimodal_tokens>>(result));
+        if (common_log_verbosity_thold >= 2) {
+            for (const llama_multimodal_cache::entry & entry : evicted) {
+                int32_t n_tokens = 0;
+                int32_t n_pos    = 0;
+                for (const auto & token : *entry.tokens) {
                     n_tokens += token.n_tokens;
                     n_pos += token.n_pos;
-                    n_embed_size += token.embed.size() * sizeof(float);
                 }
                 SRV_INF(
-                    "rid %s | cached,     "
+                    "rid %s | decached,   "
                     "type = %s, hash = %s, n_tokens = %d, n_pos = %d, n_embed_size = %zu kib\n",
-                    rid, type.c_str(), mtmd->hash.c_str(), n_tokens, n_pos, n_embed_size >> 10);
+                    rid, entry.tokens->front().is_audio ? "audio" : "image", entry.hash.c_str(), n_tokens, n_pos,
+                    entry.size >> 10);
             }
         }
-        // cache resource.
-        else {
-            // evict the oldest image if the cache is full.
-            if (int32_t(cache_multimodals.size()) >= params.max_projected_cache) {
-                // find the oldest image,
-                // remove it and add the new image.
-                auto oldest_it = cache_multimodals.begin();
-                for (auto it = cache_multimodals.begin(); it != cache_multimodals.end(); ++it) {
-                    if (it->second.last_used < oldest_it->second.last_used) {
-                        oldest_it = it;
-                    }
-                }
-                auto oldest_mtmd = oldest_it->second.tokens;
-                if (common_log_verbosity_thold >= 2) {
-                    int32_t n_tokens     = 0;
-                    int32_t n_pos        = 0;
-                    size_t  n_embed_size = 0;
-                    for (const auto & token : oldest_mtmd) {
-                        n_tokens += token.n_tokens;
-                        n_pos += token.n_pos;
-                        n_embed_size += token.embed.size() * sizeof(float);
-                    }
-                    SRV_INF(
-                        "rid %s | decached,   "
-                        "type = %s, hash = %s, n_tokens = %d, n_pos = %d, n_embed_size = %zu kib\n",
-                        rid, type.c_str(), oldest_it->first.c_str(), n_tokens, n_pos, n_embed_size >> 10);
-                }
-                cache_multimodals.erase(oldest_it);
-            }
-            SRV_INFV(2,
-                     "rid %s | tokenizing, "
-                     "type = %s, hash = %s\n",
-                     rid, type.c_str(), mtmd->hash.c_str());
-            if (mtmd->is_audio) {
-                if (llm_ctx_clip_a == nullptr) {
-                    SRV_ERR("rid %s | tokenizing, audio clip is not initialized\n", rid);
-                    return result;
-                }
-                result = tokenize_audio(llm_ctx_clip_a, params.llm_params.cpuparams.n_threads, mtmd->ptr.get());
-            } else {
-                if (llm_ctx_clip_v == nullptr) {
-                    SRV_ERR("rid %s | tokenizing, vision clip is not initialized\n", rid);
-                    return result;
-                }
-                result = tokenize_image(llm_ctx_clip_v, params.llm_params.cpuparams.n_threads, mtmd->ptr.get());
+    }
+
+    // cache_load_multimedia, returns true and fills the given result if the multimedia is persisted,
+    // the loaded result is cached in memory as well.
+    bool cache_load_multimedia(const char * rid, const clip_multimedia * mtmd,
+                               std::vector<llama_multimodal_tokens> & result) {
+        if (params.projected_cache_dir.empty() || mtmd->hash.empty()) {
+            return false;
+        }
+
+        clip_ctx * ctx_clip = mtmd->is_audio ? llm_ctx_clip_a : llm_ctx_clip_v;
+        if (ctx_clip == nullptr) {
+            return false;
+        }
+
+        const std::string path   = params.projected_cache_dir + mtmd->hash + ".mtmd";
+        const int32_t     n_embd = clip_n_mmproj_embd(ctx_clip);
+        try {
+            if (!load_multimodal_tokens(path, cache_multimodals_identity, n_embd, mtmd->hash, result)) {
+                return false;
             }
-            if (common_log_verbosity_thold >= 2) {
-                int32_t n_tokens     = 0;
-                int32_t n_pos        = 0;
-                size_t  n_embed_size = 0;
-                for (const auto & token : result) {
-                    n_tokens += token.n_tokens;
-                    n_pos += token.n_pos;
-                    n_embed_size += token.embed.size() * sizeof(float);
-                }
-                SRV_INF(
-                    "rid %s | tokenized,  "
-                    "type = %s, hash = %s, n_tokens = %d, n_pos = %d, n_embed_size = %zu kib\n",
-                    rid, type.c_str(), mtmd->hash.c_str(), n_tokens, n_pos, n_embed_size >> 10);
+        } catch (const std::exception & e) {
+            SRV_WRN("rid %s | failed to load projected cache %s: %s, removing\n", rid, path.c_str(), e.what());
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            return false;
+        }
+        if (common_log_verbosity_thold >= 2) {
+            int32_t n_tokens     = 0;
+            int32_t n_pos        = 0;
+            size_t  n_embed_size = 0;
+            for (const auto & token : result) {
+                n_tokens += token.n_tokens;
+                n_pos += token.n_pos;
+                n_embed_size += token.embed->size() * sizeof(float);
             }
-            cache_multimodals[mtmd->hash] = { result, ggml_time_us() };
+            SRV_INF(
+                "rid %s | loaded,     "
+                "type = %s, hash = %s, n_tokens = %d, n_pos = %d, n_embed_size = %zu kib\n",
+                rid, mtmd->is_audio ? "audio" : "image", mtmd->hash.c_str(), n_tokens, n_pos, n_embed_size >> 10);
+        }
+        if (cache_multimodals.enabled()) {
+            cache_put_multimedia(rid, mtmd, result);
+        }
+        return true;
+    }
+
+    // cache_save_multimedia, persists the given result if the projected cache directory is specified.
+    void cache_save_multimedia(const char * rid, const clip_multimedia * mtmd,
+                               const std::vector<llama_multimodal_tokens> & result) {
+        if (params.projected_cache_dir.empty() || mtmd->hash.empty()) {
+            return;
+        }
+
+        const std::string path = params.projected_cache_dir + mtmd->hash + ".mtmd";
+        try {
+            save_multimodal_tokens(path, cache_multimodals_identity, result);
+        } catch (const std::exception & e) {
+            SRV_WRN("rid %s | failed to save projected cache %s: %s\n", rid, path.c_str(), e.what());
+        }
+    }
+
+    // cache_tokenize_multimedia, returns the cached tokens of the given multimedia immediately,
+    // otherwise submits it to the multimodal encoder worker,
+    // so that the caller can go on templating while encoding.
+    std::future<std::vector<llama_multimodal_tokens>> cache_tokenize_multimedia(
+        const char * rid, std::unique_ptr<clip_multimedia> && mtmd) {
+        const bool cacheable = !mtmd->hash.empty() && cache_multimodals.enabled();
+
+        if ((llm_ctx_clip_v == nullptr && llm_ctx_clip_a == nullptr) || mtmd_workers == nullptr) {
+            std::promise<std::vector<llama_multimodal_tokens>> ready;
+            ready.set_value({});
+            return ready.get_future();
         }
 
-        lock.unlock();
+        // check if resource is already cached, in memory or on disk.
+        if (std::vector<llama_multimodal_tokens> result; (cacheable && cache_get_multimedia(rid, mtmd.get(), result)) ||
+                                                         cache_load_multimedia(rid, mtmd.get(), result)) {
+            std::promise<std::vector<llama_multimodal_tokens>> ready;
+            ready.set_value(std::move(result));
+            return ready.get_future();
+        }
 
+        // encode resource,
+        // the job owns the request id and the multimedia, as the caller may return before the job runs.
+        auto job = std::make_shared<std::packaged_task<std::vector<llama_multimodal_tokens>()>>(
+            [this, cacheable, rid = std::string(rid), mtmd = std::shared_ptr<clip_multimedia>(std::move(mtmd))]() {
+                std::vector<llama_multimodal_tokens> result;
+                // check again, the same resource may be encoded by the previous job.
+                if ((cacheable && cache_get_multimedia(rid.c_str(), mtmd.get(), result)) ||
+                    cache_load_multimedia(rid.c_str(), mtmd.get(), result)) {
+                    return result;
+                }
+                result = tokenize_multimedia(rid.c_str(), mtmd.get());
+                if (!result.empty()) {
+                    if (cacheable) {
+                        cache_put_multimedia(rid.c_str(), mtmd.get(), result);
+                    }
+                    cache_save_multimedia(rid.c_str(), mtmd.get(), result);
+                }
+                return result;
+            });
+        std::future<std::vector<llama_multimodal_tokens>> result = job->get_future();
+        mtmd_workers->enqueue([job]() { (*job)(); });
         return result;
     }
 
@@ -5466,6 +7886,15 @@ struct httpserver {
         return send_json(request, response, httplib::OK_200, resp);
     }
 
+    int32_t handle_slots(const httplib::Request & request, httplib::Response & response) {
+        std::unique_ptr<slots_req> req = get_slots_req(request, response, params);
+
+        std::unique_ptr<slots_task> task = std::make_unique<slots_task>(get_task_id(), request.is_connection_closed);
+        task->req                        = std::move(req);
+
+        return process(request, response, std::move(task));
+    }
+
     int32_t handle_models(const httplib::Request & request, httplib::Response & response) {
         json metadata_json;
         /* STABLE DIFFUSION */
@@ -5502,7 +7931,7 @@ struct httpserver {
                 { "n_params",                    llama_model_n_params(llm_model)                  },
                 { "size",                        llama_model_size(llm_model)                      },
                 { "n_ctx",                       llm_ctx_size                                     },
-                { "n_slot",                      params.llm_params.n_threads_http                 },
+                { "n_slot",                      params.n_slots                                   },
                 { "n_slot_ctx",                  llm_slot_ctx_size                                },
                 { "ctx_shift",                   shift_context                                    },
                 { "prompt_cache",                cache_prompt                                     },
@@ -5662,6 +8091,7 @@ struct httpserver {
         task->n_decoding_budget    = n_decoding_budget;
         task->sampler              = sampler;
         task->sampler_draft        = sampler_draft;
+        task->rng_verify           = std::mt19937(req->sampling.seed);
         task->cmpl_id              = gen_completion_id();
         task->reasoning_finished   = !support_reasoning;
         task->req                  = std::move(req);
@@ -5747,6 +8177,14 @@ struct httpserver {
             auto    n_mtmd   = int32_t(req->multimedias.size());
             int32_t i_mtmd   = -1;
             size_t  mtmd_pos = prompt.find(mtmd_sign);
+
+            // submit all multimedias ahead, so that they are encoding while templating the text
+            std::vector<std::future<std::vector<llama_multimodal_tokens>>> tokenizing_mtmds;
+            tokenizing_mtmds.reserve(n_mtmd);
+            for (std::unique_ptr<clip_multimedia> & mtmd : req->multimedias) {
+                tokenizing_mtmds.push_back(cache_tokenize_multimedia(req->get_id(), std::move(mtmd)));
+            }
+
             while (mtmd_pos != std::string::npos && ++i_mtmd < n_mtmd) {
                 // process text
                 if (const std::string text = prompt.substr(0, mtmd_pos); !text.empty()) {
@@ -5756,8 +8194,7 @@ struct httpserver {
                 }
 
                 // process multimedia
-                std::vector<llama_multimodal_tokens> tokenized_mtmds =
-                    cache_tokenize_multimedia(req->get_id(), std::move(req->multimedias[i_mtmd]));
+                std::vector<llama_multimodal_tokens> tokenized_mtmds = tokenizing_mtmds[i_mtmd].get();
                 if (tokenized_mtmds.empty()) {
                     return send_string(request, response, httplib::InternalServerError_500,
                                        "Failed to embed the multimedia");
@@ -6123,6 +8560,7 @@ struct httpserver {
         task->n_prefilling_request                  = n_prefilling_request;
         task->sampler                               = sampler;
         task->sampler_draft                         = sampler_draft;
+        task->rng_verify                            = std::mt19937(req->sampling.seed);
         task->tool_call_stop_fast                   = tool_call_stop_fast;
         task->cmpl_id                               = gen_chat_completion_id();
         task->reasoning_finished                    = reasoning_finished;
@@ -2,9 +2,17 @@
 
 // heads
 
+#include <algorithm>
 #include <atomic>
 #include <csignal>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
 #include <unordered_map>
 #include <utility>
 #include <variant>
@@ -16,13 +24,13 @@
 // types
 
 struct llama_multimodal_tokens {
-    llama_token        dummy_token = LLAMA_TOKEN_NULL;
-    int32_t            n_tokens    = 0;
-    int32_t            n_pos       = 0;
-    bool               is_audio    = false;
-    std::vector<float> embed;
-    clip_image_size    size;
-    clip_image_size    grid_size;
+    llama_token                               dummy_token = LLAMA_TOKEN_NULL;
+    int32_t                                   n_tokens    = 0;
+    int32_t                                   n_pos       = 0;
+    bool                                      is_audio    = false;
+    std::shared_ptr<const std::vector<float>> embed;  // shared with the cache, never modified after encoding
+    clip_image_size                           size;
+    clip_image_size                           grid_size;
 };
 
 // implementations
@@ -89,9 +97,31 @@ struct llama_multimodal_embed_batch {
 
 static std::atomic<llama_token> multimodal_dummy_token_generator{ LLAMA_TOKEN_NULL };
 
+// multimodal_dummy_token derives the dummy token of the given chunk from the content hash,
+// so that the same multimedia gets the same dummy tokens even if encoded again, or by another process,
+// which keeps the prompt prefix behind it matchable, falls back to the generator if without content hash.
+static inline llama_token multimodal_dummy_token(const std::string & hash, size_t i_chunk) {
+    if (hash.empty()) {
+        return multimodal_dummy_token_generator--;
+    }
+
+    // FNV-1a over the content hash and the chunk index
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char c : hash) {
+        h ^= uint8_t(c);
+        h *= 0x100000001b3ULL;
+    }
+    for (size_t i = 0; i < sizeof(i_chunk); i++) {
+        h ^= uint8_t(i_chunk >> (i * 8));
+        h *= 0x100000001b3ULL;
+    }
+    // negative, and never LLAMA_TOKEN_NULL
+    return -llama_token(2 + h % uint64_t(INT32_MAX - 1));
+}
+
 // tokenize_image is not thread-safe, must be called from mutex-protected context.
 static inline std::vector<llama_multimodal_tokens> tokenize_image(clip_ctx * ctx_clip, const int n_threads,
-                                                                  const clip_image_u8 * img) {
+                                                                  const clip_image_u8 * img, const std::string & hash) {
     clip_image_f32_batch batch;
     if (!clip_image_preprocess(ctx_clip, img, &batch)) {
         LOG_ERR("%s", "unable to preprocess image\n");
@@ -114,10 +144,11 @@ static inline std::vector<llama_multimodal_tokens> tokenize_image(clip_ctx * ctx
             result[i].n_pos     = result[i].n_tokens;
             result[i].size      = clip_image_size{ entries[i]->nx, entries[i]->ny };
             result[i].grid_size = clip_image_size{ batch.grid_x, batch.grid_y };
-            result[i].embed.resize(result[i].n_tokens * n_mmproj_embd);
+            auto embed          = std::make_shared<std::vector<float>>(result[i].n_tokens * n_mmproj_embd);
+            result[i].embed     = embed;
             // encode
             const int64_t t_start = ggml_time_us();
-            bool          encoded = clip_image_encode(ctx_clip, n_threads, entries[i].get(), result[i].embed.data());
+            bool          encoded = clip_image_encode(ctx_clip, n_threads, entries[i].get(), embed->data());
             if (!encoded) {
                 LOG_ERR("failed to encode image %2zu/%zu\n", i + 1, n_entries);
                 return {};
@@ -126,7 +157,7 @@ static inline std::vector<llama_multimodal_tokens> tokenize_image(clip_ctx * ctx
                 LOG_INF("encoded image %2zu/%zu within %8.2f ms, n_tokens = %d\n", i + 1, n_entries,
                         (ggml_time_us() - t_start) / 1000.0, result[i].n_tokens);
             }
-            result[i].dummy_token = multimodal_dummy_token_generator--;
+            result[i].dummy_token = multimodal_dummy_token(hash, i);
         }
     }
     // llava / glm, non-batching
@@ -143,7 +174,8 @@ static inline std::vector<llama_multimodal_tokens> tokenize_image(clip_ctx * ctx
         result[0].n_pos     = result[0].n_tokens;
         result[0].size      = clip_image_size{ batch.entries[0]->nx, batch.entries[0]->ny };
         result[0].grid_size = clip_image_size{ batch.grid_x, batch.grid_y };
-        result[0].embed.resize(result[0].n_tokens * n_mmproj_embd);
+        auto embed          = std::make_shared<std::vector<float>>(result[0].n_tokens * n_mmproj_embd);
+        result[0].embed     = embed;
         // encode
         const auto & entries   = batch.entries;
         const size_t n_entries = entries.size();
@@ -151,7 +183,7 @@ static inline std::vector<llama_multimodal_tokens> tokenize_image(clip_ctx * ctx
             int32_t       n_entry_tokens = clip_n_output_tokens(ctx_clip, entries[i].get());
             const int64_t t_start        = ggml_time_us();
             bool          encoded        = clip_image_encode(ctx_clip, n_threads, entries[i].get(),
-                                                             result[0].embed.data() + i * n_entry_tokens * n_mmproj_embd);
+                                                             embed->data() + i * n_entry_tokens * n_mmproj_embd);
             if (!encoded) {
                 LOG_ERR("failed to encode image %2zu/%zu\n", i + 1, n_entries);
                 return {};
@@ -161,7 +193,7 @@ static inline std::vector<llama_multimodal_tokens> tokenize_image(clip_ctx * ctx
                         (ggml_time_us() - t_start) / 1000.0, n_entry_tokens);
             }
         }
-        result[0].dummy_token = multimodal_dummy_token_generator--;
+        result[0].dummy_token = multimodal_dummy_token(hash, 0);
     }
     // others, batching
     else {
@@ -172,10 +204,11 @@ static inline std::vector<llama_multimodal_tokens> tokenize_image(clip_ctx * ctx
         result[0].n_pos     = result[0].n_tokens;
         result[0].size      = clip_image_size{ batch.entries[0]->nx, batch.entries[0]->ny };
         result[0].grid_size = clip_image_size{ batch.grid_x, batch.grid_y };
-        result[0].embed.resize(result[0].n_tokens * n_mmproj_embd);
+        auto embed          = std::make_shared<std::vector<float>>(result[0].n_tokens * n_mmproj_embd);
+        result[0].embed     = embed;
         // encode
         const int64_t t_start = ggml_time_us();
-        bool          encoded = clip_image_batch_encode(ctx_clip, n_threads, &batch, result[0].embed.data());
+        bool          encoded = clip_image_batch_encode(ctx_clip, n_threads, &batch, embed->data());
         if (!encoded) {
             LOG_ERR("%s", "failed to encode image in batch\n");
             return {};
@@ -189,14 +222,14 @@ static inline std::vector<llama_multimodal_tokens> tokenize_image(clip_ctx * ctx
             const int32_t ph = batch.entries[0]->ny / ps + (batch.entries[0]->ny % ps > 0);
             result[0].n_pos  = ph;
         }
-        result[0].dummy_token = multimodal_dummy_token_generator--;
+        result[0].dummy_token = multimodal_dummy_token(hash, 0);
     }
 
     return result;
 }
 
 static inline std::vector<llama_multimodal_tokens> tokenize_audio(clip_ctx * ctx_clip, const int n_threads,
-                                                                  const clip_image_u8 * aud) {
+                                                                  const clip_image_u8 * aud, const std::string & hash) {
     whisper_preprocessor::whisper_filters          filters = whisper_precalc_filters::get_128_bins();
     std::vector<whisper_preprocessor::whisper_mel> entries;
     if (!whisper_preprocessor::preprocess_audio((const float *) aud->buf.data(), aud->nx, filters, entries)) {
@@ -225,13 +258,14 @@ static inline std::vector<llama_multimodal_tokens> tokenize_audio(clip_ctx * ctx
         result[i].is_audio  = true;
         result[i].size      = clip_image_size{ entries[i].n_len, entries[i].n_mel };
         result[i].grid_size = clip_image_size{ 1, 1 };
-        result[i].embed.resize(result[i].n_tokens * n_mmproj_embd);
+        auto embed          = std::make_shared<std::vector<float>>(result[i].n_tokens * n_mmproj_embd);
+        result[i].embed     = embed;
         // encode
         clip_image_f32_batch batch_f32;
         batch_f32.is_audio = true;
         batch_f32.entries.push_back(std::move(mel_f32));
         const int64_t t_start = ggml_time_us();
-        bool          encoded = clip_image_batch_encode(ctx_clip, n_threads, &batch_f32, result[i].embed.data());
+        bool          encoded = clip_image_batch_encode(ctx_clip, n_threads, &batch_f32, embed->data());
         if (!encoded) {
             LOG_ERR("failed to encode audio %2zu/%zu\n", i + 1, n_entries);
             return {};
@@ -240,8 +274,231 @@ static inline std::vector<llama_multimodal_tokens> tokenize_audio(clip_ctx * ctx
             LOG_INF("encoded audio %2zu/%zu within %8.2f ms, n_tokens = %d\n", i + 1, n_entries,
                     (ggml_time_us() - t_start) / 1000.0, result[i].n_tokens);
         }
-        result[i].dummy_token = multimodal_dummy_token_generator--;
+        result[i].dummy_token = multimodal_dummy_token(hash, i);
     }
 
     return result;
 }
+
+// llama_multimodal_cache, a byte budgeted least recently used cache of the projected embeddings,
+// the entries are handed out as shared pointers, so a hit does not copy the embeddings,
+// the keys are spread over shards, each shard locks and refreshes in constant time,
+// while the budget is global, once exceeding, the least recently used entry among the shard tails is evicted.
+struct llama_multimodal_cache {
+    using tokens_ptr = std::shared_ptr<const std::vector<llama_multimodal_tokens>>;
+
+    struct entry {
+        std::string hash;
+        tokens_ptr  tokens;
+        size_t      size      = 0;
+        uint64_t    last_used = 0;
+    };
+
+    llama_multimodal_cache() = default;
+
+    llama_multimodal_cache(size_t max_entries, size_t max_size, size_t n_shards = 8) :
+        shards(std::max(n_shards, size_t(1))),
+        max_entries(max_entries),
+        max_size(max_size == 0 ? SIZE_MAX : max_size) {}
+
+    llama_multimodal_cache & operator=(llama_multimodal_cache && other) noexcept {
+        shards      = std::move(other.shards);
+        max_entries = other.max_entries;
+        max_size    = other.max_size;
+        n_entries   = other.n_entries.load();
+        size        = other.size.load();
+        tick        = other.tick.load();
+        return *this;
+    }
+
+    bool enabled() const { return !shards.empty(); }
+
+    // get, returns nullptr if missed, otherwise refreshes the entry.
+    tokens_ptr get(const std::string & hash) {
+        shard &                     s = locate(hash);
+        std::lock_guard<std::mutex> lock(s.mtx);
+
+        auto hit = s.index.find(hash);
+        if (hit == s.index.end()) {
+            return nullptr;
+        }
+        hit->second->last_used = ++tick;
+        s.entries.splice(s.entries.begin(), s.entries, hit->second);
+        return hit->second->tokens;
+    }
+
+    // put, caches the given tokens, returns the evicted entries,
+    // the tokens larger than the whole budget are not cached.
+    std::vector<entry> put(const std::string & hash, tokens_ptr tokens) {
+        size_t tokens_size = 0;
+        for (const llama_multimodal_tokens & token : *tokens) {
+            tokens_size += sizeof(llama_multimodal_tokens) + (token.embed ? token.embed->size() * sizeof(float) : 0);
+        }
+
+        std::vector<entry> evicted;
+        if (tokens_size > max_size) {
+            return evicted;
+        }
+        {
+            shard &                     s = locate(hash);
+            std::lock_guard<std::mutex> lock(s.mtx);
+            if (s.index.find(hash) != s.index.end()) {
+                return evicted;
+            }
+            s.entries.push_front({ hash, std::move(tokens), tokens_size, ++tick });
+            s.index[hash] = s.entries.begin();
+        }
+        n_entries += 1;
+        size += tokens_size;
+
+        // evict the least recently used entries globally,
+        // lock one shard at a time, so the concurrent puts never deadlock.
+        while (n_entries.load() > max_entries || size.load() > max_size) {
+            shard *  victim           = nullptr;
+            uint64_t victim_last_used = UINT64_MAX;
+            for (shard & s : shards) {
+                std::lock_guard<std::mutex> lock(s.mtx);
+                if (!s.entries.empty() && s.entries.back().last_used < victim_last_used) {
+                    victim           = &s;
+                    victim_last_used = s.entries.back().last_used;
+                }
+            }
+            if (victim == nullptr) {
+                break;
+            }
+            std::lock_guard<std::mutex> lock(victim->mtx);
+            if (victim->entries.empty() || victim->entries.back().last_used != victim_last_used) {
+                continue;  // refreshed or evicted meanwhile, pick again
+            }
+            n_entries -= 1;
+            size -= victim->entries.back().size;
+            victim->index.erase(victim->entries.back().hash);
+            evicted.push_back(std::move(victim->entries.back()));
+            victim->entries.pop_back();
+        }
+        return evicted;
+    }
+
+  private:
+    struct shard {
+        std::mutex                                                  mtx;
+        std::list<entry>                                            entries;  // most recently used first
+        std::unordered_map<std::string, std::list<entry>::iterator> index;
+    };
+
+    std::vector<shard>    shards;
+    size_t                max_entries = 0;
+    size_t                max_size    = 0;
+    std::atomic<size_t>   n_entries{ 0 };
+    std::atomic<size_t>   size{ 0 };
+    std::atomic<uint64_t> tick{ 0 };
+
+    shard & locate(const std::string & hash) { return shards[std::hash<std::string>{}(hash) % shards.size()]; }
+};
+
+// llama_multimodal_tokens_file, the binary layout to persist the projected embeddings of one multimedia,
+// header: magic, version, identity of the projector, count of tokens,
+// per tokens: n_tokens, n_pos, is_audio, size, grid_size, count of embedding, embedding.
+constexpr uint32_t LLAMA_MULTIMODAL_TOKENS_FILE_MAGIC   = 0x544d424c;  // "LBMT"
+constexpr uint32_t LLAMA_MULTIMODAL_TOKENS_FILE_VERSION = 1;
+
+// save_multimodal_tokens writes the given tokens into a temporary file first, then renames it,
+// so that the concurrent readers never see a partial file, throws on failure.
+static inline void save_multimodal_tokens(const std::string & path, uint64_t identity,
+                                          const std::vector<llama_multimodal_tokens> & tokens) {
+    const std::string path_tmp = path + ".tmp." + std::to_string(ggml_time_us());
+    try {
+        std::ofstream ofs(path_tmp, std::ios::binary | std::ios::trunc);
+        ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+        const auto write = [&](const auto & v) { ofs.write((const char *) &v, sizeof(v)); };
+        write(LLAMA_MULTIMODAL_TOKENS_FILE_MAGIC);
+        write(LLAMA_MULTIMODAL_TOKENS_FILE_VERSION);
+        write(identity);
+        write(uint32_t(tokens.size()));
+        for (const llama_multimodal_tokens & token : tokens) {
+            write(token.n_tokens);
+            write(token.n_pos);
+            write(uint8_t(token.is_audio));
+            write(token.size.width);
+            write(token.size.height);
+            write(token.grid_size.width);
+            write(token.grid_size.height);
+            write(uint64_t(token.embed->size()));
+            ofs.write((const char *) token.embed->data(), std::streamsize(token.embed->size() * sizeof(float)));
+        }
+        ofs.close();
+        std::filesystem::rename(path_tmp, path);
+    } catch (...) {
+        std::error_code ec;
+        std::filesystem::remove(path_tmp, ec);
+        throw;
+    }
+}
+
+// load_multimodal_tokens reads the tokens saved by save_multimodal_tokens,
+// returns false if the file is missing or saved by another projector, throws if the file is broken,
+// the counts are bounded by the remaining file size before allocating,
+// and every embedding must be n_tokens * n_embd long, so that the decoding never reads out of bounds.
+static inline bool load_multimodal_tokens(const std::string & path, uint64_t identity, int32_t n_embd,
+                                          const std::string & hash, std::vector<llama_multimodal_tokens> & tokens) {
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    if (!ifs.is_open()) {
+        return false;
+    }
+    ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+    const auto size = uint64_t(ifs.tellg());
+    ifs.seekg(0);
+    const auto read      = [&](auto & v) { ifs.read((char *) &v, sizeof(v)); };
+    const auto remaining = [&]() { return size - uint64_t(ifs.tellg()); };
+
+    uint32_t magic        = 0;
+    uint32_t version      = 0;
+    uint64_t identity_got = 0;
+    if (size < sizeof(magic) + sizeof(version) + sizeof(identity_got)) {
+        throw std::runtime_error("truncated header");
+    }
+    read(magic);
+    read(version);
+    read(identity_got);
+    if (magic != LLAMA_MULTIMODAL_TOKENS_FILE_MAGIC || version != LLAMA_MULTIMODAL_TOKENS_FILE_VERSION ||
+        identity_got != identity) {
+        return false;
+    }
+
+    // n_tokens, n_pos, is_audio, size, grid_size, count of embedding
+    constexpr uint64_t entry_header_size = 4 + 4 + 1 + 4 * 4 + 8;
+
+    uint32_t n_tokens = 0;
+    read(n_tokens);
+    if (n_tokens == 0 || n_tokens > remaining() / entry_header_size) {
+        throw std::runtime_error("invalid count of tokens");
+    }
+    std::vector<llama_multimodal_tokens> result(n_tokens);
+    for (size_t i = 0; i < result.size(); i++) {
+        llama_multimodal_tokens & token = result[i];
+        uint8_t  is_audio = 0;
+        uint64_t n_embed  = 0;
+        read(token.n_tokens);
+        read(token.n_pos);
+        read(is_audio);
+        read(token.size.width);
+        read(token.size.height);
+        read(token.grid_size.width);
+        read(token.grid_size.height);
+        read(n_embed);
+        if (token.n_tokens <= 0 || token.n_pos <= 0 || n_embd <= 0 ||
+            n_embed != uint64_t(token.n_tokens) * uint64_t(n_embd) || n_embed > remaining() / sizeof(float)) {
+            throw std::runtime_error("invalid embedding of tokens " + std::to_string(i));
+        }
+        auto embed = std::make_shared<std::vector<float>>(n_embed);
+        ifs.read((char *) embed->data(), std::streamsize(n_embed * sizeof(float)));
+        token.is_audio    = is_audio != 0;
+        token.embed       = std::move(embed);
+        token.dummy_token = multimodal_dummy_token(hash, i);
+    }
+    if (remaining() != 0) {
+        throw std::runtime_error("trailing data");
+    }
+    tokens = std::move(result);
+    return true;
+}
@@ -0,0 +1,68 @@
+#if defined(_WIN32)
+#    ifndef WIN32_LEAN_AND_MEAN
+#        define WIN32_LEAN_AND_MEAN
+#    endif
+#    ifndef NOMINMAX
+#        define NOMINMAX
+#    endif
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+#include "llama.cpp/common/common.h"
+
+#include "z_utils.hpp"
+
+// mmap_file, keeps the platform headers out of the shared header.
+
+mmap_file::mmap_file(const std::string & path) {
+#if defined(_WIN32)
+    HANDLE fh = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (fh == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    LARGE_INTEGER fs;
+    if (GetFileSizeEx(fh, &fs) && fs.QuadPart > 0) {
+        HANDLE mh = CreateFileMappingA(fh, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mh != nullptr) {
+            addr = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+            if (addr != nullptr) {
+                size = size_t(fs.QuadPart);
+            }
+            CloseHandle(mh);
+        }
+    }
+    CloseHandle(fh);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void * ptr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            posix_madvise(ptr, size_t(st.st_size), POSIX_MADV_SEQUENTIAL);
+            addr = ptr;
+            size = size_t(st.st_size);
+        }
+    }
+    close(fd);
+#endif
+}
+
+mmap_file::~mmap_file() {
+    if (addr == nullptr) {
+        return;
+    }
+#if defined(_WIN32)
+    UnmapViewOfFile(addr);
+#else
+    munmap(addr, size);
+#endif
+}
@@ -1,10 +1,34 @@
 #pragma once
 
 // heads
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <mutex>
 #include <queue>
 #include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <utility>
+#include <vector>
+// NB(thxCode): BOX_NO_SIMD builds the scalar paths only, which the base64 benchmark compares against.
+#if defined(BOX_NO_SIMD)
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define SIMD_SSE2
+#    include <emmintrin.h>
+#    include <tmmintrin.h>
+#    if defined(_MSC_VER)
+#        include <intrin.h>
+#    endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#    define SIMD_NEON
+#    include <arm_neon.h>
+#endif
 
 #define JSON_ASSERT GGML_ASSERT
 #include "llama.cpp/common/log.h"
@@ -158,86 +182,274 @@ static const std::string base64_chars =
     "abcdefghijklmnopqrstuvwxyz"
     "0123456789+/";
 
+// base64_values maps a character to its 6-bit value, or 0xFF if the character is not base64.
+static const std::array<uint8_t, 256> base64_values = [] {
+    std::array<uint8_t, 256> values{};
+    values.fill(0xFF);
+    for (size_t i = 0; i < base64_chars.size(); i++) {
+        values[uint8_t(base64_chars[i])] = uint8_t(i);
+    }
+    return values;
+}();
+
 static inline bool char_is_base64(uint8_t c) {
-    return (isalnum(c) || (c == '+') || (c == '/'));
+    return base64_values[c] != 0xFF;
 }
 
-static inline std::vector<uint8_t> decode_base64(const std::string & encoded_string) {
-    int i   = 0;
-    int j   = 0;
-    int in_ = 0;
-
-    int in_len = int(encoded_string.size());
-
-    uint8_t char_array_4[4];
-    uint8_t char_array_3[3];
-
-    std::vector<uint8_t> ret;
+#if defined(SIMD_SSE2)
+#    if defined(__GNUC__) || defined(__clang__)
+#        define SIMD_TARGET_SSSE3 __attribute__((target("ssse3")))
+#    else
+#        define SIMD_TARGET_SSSE3
+#    endif
 
-    while (in_len-- && (encoded_string[in_] != '=') && char_is_base64(encoded_string[in_])) {
-        char_array_4[i++] = encoded_string[in_];
-        in_++;
-        if (i == 4) {
-            for (i = 0; i < 4; i++) {
-                char_array_4[i] = base64_chars.find(char(char_array_4[i]));
-            }
-
-            char_array_3[0] = ((char_array_4[0]) << 2) + ((char_array_4[1] & 0x30) >> 4);
-            char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-            char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-            for (i = 0; (i < 3); i++) {
-                ret.push_back(char_array_3[i]);
-            }
+// cpu_has_ssse3 detects SSSE3 at runtime, as the binary is usually built for the SSE2 baseline.
+static inline bool cpu_has_ssse3() {
+#    if defined(__SSSE3__)
+    return true;
+#    elif defined(__GNUC__) || defined(__clang__)
+    static const bool has = __builtin_cpu_supports("ssse3");
+    return has;
+#    else
+    static const bool has = [] {
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 9)) != 0;
+    }();
+    return has;
+#    endif
+}
 
-            i = 0;
+// decode_base64_ssse3 decodes 16 characters into 12 bytes at a time,
+// stops before the block containing a non-base64 character, returns the count of decoded characters,
+// NB(thxCode): it stores 16 bytes per block, the output must have 4 bytes to spare.
+static inline SIMD_TARGET_SSSE3 size_t decode_base64_ssse3(const uint8_t * in, size_t in_len, uint8_t * out) {
+    // classify each character by its nibbles, and roll it to the 6-bit value by its high nibble
+    const __m128i lut_lo   = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B,
+                                           0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi   = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                           0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i pack     = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m128i mask_2f  = _mm_set1_epi8(0x2F);
+    const __m128i mask_0f  = _mm_set1_epi8(0x0F);
+
+    size_t i = 0;
+    for (; i + 16 <= in_len; i += 16) {
+        const __m128i v  = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        const __m128i hi = _mm_and_si128(_mm_srli_epi32(v, 4), mask_0f);
+        const __m128i lo = _mm_and_si128(v, mask_0f);
+        const __m128i e  = _mm_and_si128(_mm_shuffle_epi8(lut_lo, lo), _mm_shuffle_epi8(lut_hi, hi));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(e, _mm_setzero_si128())) != 0xFFFF) {
+            break;
         }
-    }
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(v, mask_2f), hi));
+        const __m128i vals = _mm_add_epi8(v, roll);
+        // merge 4 x 6 bits into 3 bytes per 32-bit lane, then compact the lanes
+        const __m128i ab   = _mm_maddubs_epi16(vals, _mm_set1_epi32(0x01400140));
+        const __m128i abcd = _mm_madd_epi16(ab, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_shuffle_epi8(abcd, pack));
+        out += 12;
+    }
+    return i;
+}
 
-    if (i) {
-        for (j = i; j < 4; j++) {
-            char_array_4[j] = 0;
+// encode_base64_ssse3 encodes 12 bytes into 16 characters at a time, returns the count of encoded bytes,
+// NB(thxCode): it loads 16 bytes per block, the input must have 4 bytes to spare.
+static inline SIMD_TARGET_SSSE3 size_t encode_base64_ssse3(const uint8_t * in, size_t in_len, char * out) {
+    const __m128i split = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+    size_t i = 0;
+    for (; i + 16 <= in_len; i += 12) {
+        // spread 3 bytes into 4 x 6 bits per 32-bit lane
+        const __m128i v   = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i)), split);
+        const __m128i t0  = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+        const __m128i t1  = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+        const __m128i idx = _mm_or_si128(t0, t1);
+        // map the 6-bit values to characters by the offset of their range
+        __m128i       r   = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+        r = _mm_or_si128(r, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx), _mm_set1_epi8(13)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_add_epi8(_mm_shuffle_epi8(shift, r), idx));
+        out += 16;
+    }
+    return i;
+}
+#elif defined(SIMD_NEON)
+// decode_base64_neon decodes 64 characters into 48 bytes at a time,
+// stops before the block containing a non-base64 character, returns the count of decoded characters.
+static inline size_t decode_base64_neon(const uint8_t * in, size_t in_len, uint8_t * out) {
+    const uint8_t *    values = base64_values.data();
+    const uint8x16x4_t lut_lo = { vld1q_u8(values), vld1q_u8(values + 16), vld1q_u8(values + 32),
+                                  vld1q_u8(values + 48) };
+    const uint8x16x4_t lut_hi = { vld1q_u8(values + 64), vld1q_u8(values + 80), vld1q_u8(values + 96),
+                                  vld1q_u8(values + 112) };
+    const uint8x16_t   offset = vdupq_n_u8(64);
+    const uint8x16_t   ascii  = vdupq_n_u8(0x80);
+
+    size_t i = 0;
+    for (; i + 64 <= in_len; i += 64) {
+        const uint8x16x4_t v = vld4q_u8(in + i);
+        uint8x16_t         d[4];
+        uint8x16_t         e = vdupq_n_u8(0);
+        for (int k = 0; k < 4; k++) {
+            // the characters above 0x7F are marked as 0xFF
+            d[k] = vqtbx4q_u8(vqtbl4q_u8(lut_lo, v.val[k]), lut_hi, vsubq_u8(v.val[k], offset));
+            d[k] = vorrq_u8(d[k], vcgeq_u8(v.val[k], ascii));
+            e    = vorrq_u8(e, d[k]);
         }
-
-        for (j = 0; j < 4; j++) {
-            char_array_4[j] = base64_chars.find(char(char_array_4[j]));
+        if (vmaxvq_u8(e) >= 0x40) {
+            break;
         }
+        uint8x16x3_t o;
+        o.val[0] = vorrq_u8(vshlq_n_u8(d[0], 2), vshrq_n_u8(d[1], 4));
+        o.val[1] = vorrq_u8(vshlq_n_u8(d[1], 4), vshrq_n_u8(d[2], 2));
+        o.val[2] = vorrq_u8(vshlq_n_u8(d[2], 6), d[3]);
+        vst3q_u8(out, o);
+        out += 48;
+    }
+    return i;
+}
 
-        char_array_3[0] = ((char_array_4[0]) << 2) + ((char_array_4[1] & 0x30) >> 4);
-        char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-        char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+// encode_base64_neon encodes 48 bytes into 64 characters at a time, returns the count of encoded bytes.
+static inline size_t encode_base64_neon(const uint8_t * in, size_t in_len, char * out) {
+    const auto *       chars = reinterpret_cast<const uint8_t *>(base64_chars.data());
+    const uint8x16x4_t lut   = { vld1q_u8(chars), vld1q_u8(chars + 16), vld1q_u8(chars + 32), vld1q_u8(chars + 48) };
+    const uint8x16_t   mask  = vdupq_n_u8(0x3F);
+
+    size_t i = 0;
+    for (; i + 48 <= in_len; i += 48) {
+        const uint8x16x3_t v = vld3q_u8(in + i);
+        uint8x16x4_t       o;
+        o.val[0] = vqtbl4q_u8(lut, vshrq_n_u8(v.val[0], 2));
+        o.val[1] = vqtbl4q_u8(lut, vandq_u8(vorrq_u8(vshlq_n_u8(v.val[0], 4), vshrq_n_u8(v.val[1], 4)), mask));
+        o.val[2] = vqtbl4q_u8(lut, vandq_u8(vorrq_u8(vshlq_n_u8(v.val[1], 2), vshrq_n_u8(v.val[2], 6)), mask));
+        o.val[3] = vqtbl4q_u8(lut, vandq_u8(v.val[2], mask));
+        vst4q_u8(reinterpret_cast<uint8_t *>(out), o);
+        out += 64;
+    }
+    return i;
+}
+#endif
 
-        for (j = 0; j < i - 1; j++) {
-            ret.push_back(char_array_3[j]);
+// decode_base64 decodes until the padding or the first non-base64 character,
+// it decodes the full blocks with SSSE3 or NEON, and the rest of 4 characters into 3 bytes through the lookup table.
+static inline std::vector<uint8_t> decode_base64(const std::string & encoded_string) {
+    const auto * in     = reinterpret_cast<const uint8_t *>(encoded_string.data());
+    const size_t in_len = encoded_string.size();
+
+    std::vector<uint8_t> ret(in_len / 4 * 3 + 4);
+    uint8_t *            out = ret.data();
+
+    // full blocks with SIMD, the rest of groups with the table,
+    // stop at the group containing a non-base64 character
+    size_t i = 0;
+#if defined(SIMD_SSE2)
+    if (cpu_has_ssse3()) {
+        i = decode_base64_ssse3(in, in_len, out);
+    }
+#elif defined(SIMD_NEON)
+    i = decode_base64_neon(in, in_len, out);
+#endif
+    out += i / 4 * 3;
+    for (; i + 4 <= in_len; i += 4) {
+        const uint8_t a = base64_values[in[i]];
+        const uint8_t b = base64_values[in[i + 1]];
+        const uint8_t c = base64_values[in[i + 2]];
+        const uint8_t d = base64_values[in[i + 3]];
+        if (((a | b | c | d) & 0xC0) != 0) {
+            break;
         }
+        const uint32_t v = uint32_t(a) << 18 | uint32_t(b) << 12 | uint32_t(c) << 6 | uint32_t(d);
+        out[0]           = uint8_t(v >> 16);
+        out[1]           = uint8_t(v >> 8);
+        out[2]           = uint8_t(v);
+        out += 3;
     }
 
+    // partial group, at most 3 characters
+    uint32_t v = 0;
+    size_t   r = 0;
+    for (; r < 3 && i + r < in_len && char_is_base64(in[i + r]); r++) {
+        v |= uint32_t(base64_values[in[i + r]]) << (18 - 6 * r);
+    }
+    if (r > 1) {
+        *out++ = uint8_t(v >> 16);
+    }
+    if (r > 2) {
+        *out++ = uint8_t(v >> 8);
+    }
+
+    ret.resize(size_t(out - ret.data()));
     return ret;
 }
 
+// encode_base64 encodes into the presized output,
+// it encodes the full blocks with SSSE3 or NEON, and the rest of 3 bytes into 4 characters through the lookup table.
 static inline std::string encode_base64(const unsigned char * input, size_t length) {
-    std::string output;
-    output.reserve(length);
-
-    auto val = 0, valb = -6;
-    for (size_t i = 0; i < length; ++i) {
-        val = (val << 8) + static_cast<uint8_t>(input[i]);
-        valb += 8;
-        while (valb >= 0) {
-            output.push_back(base64_chars[(val >> valb) & 0x3F]);
-            valb -= 6;
+    std::string output((length + 2) / 3 * 4, '=');
+    char *      out = output.data();
+
+    // full blocks with SIMD, the rest of groups with the table
+    size_t i = 0;
+#if defined(SIMD_SSE2)
+    if (cpu_has_ssse3()) {
+        i = encode_base64_ssse3(input, length, out);
+    }
+#elif defined(SIMD_NEON)
+    i = encode_base64_neon(input, length, out);
+#endif
+    out += i / 3 * 4;
+    for (; i + 3 <= length; i += 3) {
+        const uint32_t v = uint32_t(input[i]) << 16 | uint32_t(input[i + 1]) << 8 | uint32_t(input[i + 2]);
+        *out++           = base64_chars[(v >> 18) & 0x3F];
+        *out++           = base64_chars[(v >> 12) & 0x3F];
+        *out++           = base64_chars[(v >> 6) & 0x3F];
+        *out++           = base64_chars[v & 0x3F];
+    }
+    if (const size_t r = length - i; r > 0) {
+        const uint32_t v = uint32_t(input[i]) << 16 | (r > 1 ? uint32_t(input[i + 1]) << 8 : 0);
+        *out++           = base64_chars[(v >> 18) & 0x3F];
+        *out++           = base64_chars[(v >> 12) & 0x3F];
+        if (r > 1) {
+            *out = base64_chars[(v >> 6) & 0x3F];
         }
     }
 
-    if (valb > -6) {
-        output.push_back(base64_chars[((val << 8) >> valb) & 0x3F]);
-    }
+    return output;
+}
 
-    while (output.size() % 4) {
-        output.push_back('=');
+// ascii_prefix_length returns the length of the leading ASCII bytes,
+// it checks 16 bytes at a time with SSE2 or NEON, or 8 bytes at a time otherwise.
+static inline size_t ascii_prefix_length(const unsigned char * bytes, size_t len) {
+    size_t i = 0;
+#if defined(SIMD_SSE2)
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + i));
+        if (_mm_movemask_epi8(v) != 0) {
+            break;
+        }
     }
-
-    return output;
+#elif defined(SIMD_NEON)
+    for (; i + 16 <= len; i += 16) {
+        const uint8x16_t v = vld1q_u8(bytes + i);
+        if (vmaxvq_u8(v) >= 0x80) {
+            break;
+        }
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, bytes + i, sizeof(v));
+        if ((v & 0x8080808080808080ULL) != 0) {
+            break;
+        }
+    }
+    while (i < len && bytes[i] <= 0x7F) {
+        i++;
+    }
+    return i;
 }
 
 static inline bool string_is_utf8(const std::string & str) {
@@ -246,8 +458,8 @@ static inline bool string_is_utf8(const std::string & str) {
 
     while (bytes < end) {
         if (*bytes <= 0x7F) {
-            // 1-byte sequence (0xxxxxxx)
-            bytes++;
+            // 1-byte sequences (0xxxxxxx), skip the whole ASCII run
+            bytes += ascii_prefix_length(bytes, size_t(end - bytes));
         } else if ((*bytes & 0xE0) == 0xC0) {
             // 2-byte sequence (110xxxxx 10xxxxxx)
             if (end - bytes < 2 || (bytes[1] & 0xC0) != 0x80) {
@@ -543,7 +755,7 @@ static inline std::unique_ptr<longest_common_prefix> find_longest_common_prefix(
 }
 
 // Computes FNV-1a hash of the data
-static std::string hash_fnv(const uint8_t * data, size_t len) {
+static inline std::string hash_fnv(const uint8_t * data, size_t len) {
     constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
     constexpr uint64_t FNV_PRIME        = 0x100000001b3ULL;
 
@@ -559,7 +771,7 @@ static std::string hash_fnv(const uint8_t * data, size_t len) {
     return ss.str();
 }
 
-static std::string escape_string(const std::string & str) {
+static inline std::string escape_string(const std::string & str) {
     std::ostringstream oss;
     for (const unsigned char uc : str) {
         switch (uc) {
@@ -595,3 +807,20 @@ static std::string escape_string(const std::string & str) {
     }
     return oss.str();
 }
+
+// mmap_file maps the whole file into memory as read-only.
+struct mmap_file {
+    explicit mmap_file(const std::string & path);
+
+    ~mmap_file();
+
+    mmap_file(const mmap_file &)             = delete;
+    mmap_file & operator=(const mmap_file &) = delete;
+
+    [[nodiscard]] bool valid() const { return addr != nullptr; }
+
+    [[nodiscard]] const uint8_t * data() const { return (const uint8_t *) addr; }
+
+    void * addr = nullptr;
+    size_t size = 0;
+};